@@ -1,11 +1,19 @@
+#include <algorithm>
+#include <atomic>
+#include <csignal>
 #include <memory>
 #include <string>
 #include <filesystem>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
 
 #include <folly/init/Init.h>
 #include <folly/logging/xlog.h>
 #include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/executors/GlobalExecutor.h>
+#include <folly/io/async/AsyncServerSocket.h>
 #include <proxygen/httpserver/HTTPServer.h>
 #ifndef DEBUG
 #include <syslog.h>
@@ -16,20 +24,19 @@
 #include <proxygen/httpserver/ResponseBuilder.h>
 
 #include "server/core.h"
+#include "server/file_io.h"
+#include "server/upgrade.h"
 
 #include "utils/defines.h"
 #include "utils/config.h"
 #include "server/module.h"
+#include "utils/compression.h"
+#include "utils/file_watcher.h"
+#include "utils/route_index.h"
 
 
 using namespace proxygen;
 
-std::shared_mutex config_mutex;
-
-thread_local folly::EvictingCacheMap<XXH64_hash_t, Cache::ResponseData> tl_response_data_cache(1000);
-thread_local folly::EvictingCacheMap<XXH64_hash_t, Cache::VirtualHostConfig> tl_host_config_cache(100);
-thread_local folly::EvictingCacheMap<XXH64_hash_t, folly::fbstring> tl_directory_redirect_cache(1000);
-
 extern "C" {
 extern ModuleManage::Module *__start_my_module_section[] __attribute__((weak));
 extern ModuleManage::Module *__stop_my_module_section[] __attribute__((weak));
@@ -58,46 +65,27 @@ const folly::fbstring &getSingleOrEmptyTest(const T &nameOrCode) {
 
 class HandlerFactory : public RequestHandlerFactory {
 public:
-    void onServerStart(folly::EventBase * /*evb*/) noexcept override {
-        std::shared_lock lock(config_mutex);
-
-        for (const auto &[hostname, config]: Config::virtual_hosts) {
-            tl_host_config_cache.set(Utils::computeXXH64Hash(hostname), config);
-
-            if (!std::filesystem::exists(config.web_root_directory.c_str())) continue;
-
-            const auto web_root = config.web_root_directory;
-            const auto normalized_root = web_root.back() == '/' ? web_root : web_root + "/";
-
-            for (const auto &index_file: config.index_page_files) {
-                const auto full_index_path = web_root + '/' + index_file.data();
-                if (std::filesystem::exists(full_index_path.toStdString())) {
-                    tl_directory_redirect_cache.set(Utils::computeXXH64Hash(normalized_root), full_index_path);
-                    break;
-                }
-            }
+    HandlerFactory(Cache::ResponseCache *response_cache, const Config::ServerConfig *server_config,
+                   Routing::DirectoryCache *directory_cache, Cache::FlightTable *flights)
+        : response_cache_(response_cache), server_config_(server_config), directory_cache_(directory_cache),
+          flights_(flights) {
+    }
 
-            for (const auto &entry: std::filesystem::recursive_directory_iterator(config.web_root_directory.c_str())) {
-                if (!entry.is_directory()) continue;
-
-                const auto dir_path = entry.path().string();
-                for (const auto &index_file: config.index_page_files) {
-                    const auto full_index_path = dir_path + "/" + index_file;
-                    if (std::filesystem::exists(full_index_path)) {
-                        tl_directory_redirect_cache.set(Utils::computeXXH64Hash(dir_path), full_index_path);
-                        break;
-                    }
-                }
-            }
-        }
+    void onServerStart(folly::EventBase * /*evb*/) noexcept override {
     }
 
     void onServerStop() noexcept override {
     }
 
     RequestHandler *onRequest(RequestHandler *requestHandler, HTTPMessage *message) noexcept override {
-        return new ServerHandler(&tl_response_data_cache, &tl_host_config_cache, &tl_directory_redirect_cache);
+        return new ServerHandler(response_cache_, server_config_, directory_cache_, flights_);
     }
+
+private:
+    Cache::ResponseCache *response_cache_;
+    const Config::ServerConfig *server_config_;
+    Routing::DirectoryCache *directory_cache_;
+    Cache::FlightTable *flights_;
 };
 
 void register_all_modules(ModuleManage::System<> &system) {
@@ -109,6 +97,23 @@ void register_all_modules(ModuleManage::System<> &system) {
     }
 }
 
+// What a running listener's TLS contexts were built from, comparable across a reload.
+static std::vector<std::string> tls_settings(const HTTPServer::IPConfig &listener) {
+    std::vector<std::string> settings;
+    for (const auto &context: listener.sslConfigs) {
+        std::string setting = context.isDefault ? "default" : "";
+        for (const auto &certificate: context.certificates) {
+            setting += '|' + certificate.certPath + '|' + certificate.keyPath;
+        }
+        for (const auto &name: context.sniNames) {
+            setting += '|' + name;
+        }
+        settings.push_back(std::move(setting));
+    }
+    std::ranges::sort(settings);
+    return settings;
+}
+
 int main(int argc, char *argv[]) {
     folly::InitOptions folly_options;
     folly_options.install_fatal_signal_callbacks = false;
@@ -157,14 +162,13 @@ int main(int argc, char *argv[]) {
         return -1;
     }
     XLOG(INFO) << "Server configuration loaded successfully";
+    Config::server_config = &server_config;
 
-    register_all_modules(g_moduleSystem);
-    // Initialize the module system
-    if (!g_moduleSystem.initialize()) {
-        XLOG(ERR) << "Failed to initialize module system";
-        return -1;
-    }
-    XLOG(INFO) << "Module system initialized successfully";
+    // SIGHUP is only taken by the reload thread; threads started from here on inherit the mask.
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr);
 
 #ifndef DEBUG
     XLOG(INFO) << "Setting CPU affinity and process priority";
@@ -196,13 +200,101 @@ int main(int argc, char *argv[]) {
     }
     XLOG(INFO) << "Virtual host configurations loaded, " << IPs.size() << " configurations";
 
+    // Modules may read the virtual hosts (PHP preloading), so they start after them. PHP's preloading may
+    // also fork, so they start before any thread does.
+    register_all_modules(g_moduleSystem);
+    if (!g_moduleSystem.initialize()) {
+        XLOG(ERR) << "Failed to initialize module system";
+        return -1;
+    }
+    XLOG(INFO) << "Module system initialized successfully";
+
+    Cache::ResponseCache response_cache(server_config.cache_max_bytes, server_config.cache_max_object_bytes,
+                                        std::chrono::seconds(CACHE_TTL), server_config.cache_hugepages);
+    XLOG(INFO) << "Response cache limited to " << (server_config.cache_max_bytes >> 20) << " MB";
+
+    const auto collect_roots = [] {
+        std::vector<Routing::Root> roots;
+        for (const auto &[name, host]: Config::virtual_hosts) {
+            const auto root = host.web_root_directory.toStdString();
+            const auto it = std::ranges::find(roots, root, &Routing::Root::path);
+            if (it == roots.end()) {
+                roots.push_back({root, host.index_page_files});
+            } else if (it->index_pages != host.index_page_files) {
+                XLOG(WARN) << "Virtual host " << name << " shares " << root
+                        << " with different index pages, using those of the first host";
+            }
+        }
+        return roots;
+    };
+    // Replaced on reload, read by rescans and the file watcher.
+    std::mutex roots_mutex;
+    std::vector<Routing::Root> routing_roots = collect_roots();
+    const unsigned scan_threads = server_config.threads > 0
+                                      ? static_cast<unsigned>(server_config.threads)
+                                      : std::max(std::thread::hardware_concurrency(), 1u);
+    if (server_config.routing_index) {
+        Routing::publish(Routing::Index::build(routing_roots, scan_threads));
+    }
+    Routing::DirectoryCache directory_cache(server_config.directory_cache_entries, std::chrono::seconds(CACHE_TTL),
+                                            std::chrono::seconds(NEGATIVE_CACHE_TTL));
+    Cache::FlightTable flight_table;
+
+    // Stopped before anything it could still publish into goes away. Callers hold roots_mutex.
+    Routing::Rescanner rescanner(scan_threads);
+    const auto schedule_rescan = [&] {
+        if (server_config.routing_index) {
+            rescanner.request(routing_roots);
+        }
+    };
+
+    Cache::FileWatcher file_watcher([&](const std::string &path, Cache::FileWatcher::Change change) {
+        g_moduleSystem.notify_file_changed(path);
+
+        if (path.empty()) {
+            response_cache.clear();
+            directory_cache.clear();
+            std::lock_guard lock(roots_mutex);
+            schedule_rescan();
+            return;
+        }
+
+        for (uint8_t i = 0; i < static_cast<uint8_t>(Compression::Encoding::ENCODING_COUNT); ++i) {
+            const auto encoding = static_cast<Compression::Encoding>(i);
+            response_cache.erase(Compression::variantKey(path, encoding));
+
+            // A precompressed sibling changed: drop the variant built from it.
+            const folly::StringPiece extension(Compression::extension(encoding));
+            if (!extension.empty() && folly::StringPiece(path).endsWith(extension)) {
+                response_cache.erase(Compression::variantKey(
+                    folly::StringPiece(path.data(), path.size() - extension.size()), encoding));
+            }
+        }
+
+        // Only index pages appearing or going away change how directories resolve; edits to one don't.
+        if (change == Cache::FileWatcher::Change::CONTENTS) {
+            return;
+        }
+        const folly::StringPiece name = folly::StringPiece(path).subpiece(path.rfind('/') + 1);
+        std::lock_guard lock(roots_mutex);
+        for (const auto &root: routing_roots) {
+            if (std::ranges::find(root.index_pages, name) != root.index_pages.end()) {
+                directory_cache.erase(folly::StringPiece(path).subpiece(0, path.rfind('/')));
+                schedule_rescan();
+                break;
+            }
+        }
+    });
+
     HTTPServerOptions options;
     options.threads = static_cast<size_t>(server_config.threads);
     options.idleTimeout = std::chrono::milliseconds(60000);
     options.shutdownOn = {SIGINT, SIGTERM, SIGSEGV};
+    // Static variants are compressed once and cached by ServerHandler instead of per response.
     options.enableContentCompression = false;
     options.handlerFactories =
-            RequestHandlerChain().addThen<HandlerFactory>().build();
+            RequestHandlerChain().addThen<HandlerFactory>(&response_cache, &server_config, &directory_cache,
+                                                          &flight_table).build();
     options.h2cEnabled = true;
     options.supportsConnect = true;
 
@@ -212,12 +304,146 @@ int main(int argc, char *argv[]) {
     folly::setUnsafeMutableGlobalCPUExecutor(unsafeThreadPool);
     XLOG(INFO) << "Thread pool created with " << server_config.threads << " threads";
 
+    FileIO::initialize(server_config.file_io, server_config.io_uring_depth);
+    Compression::initialize(server_config.compression_threads);
+
+    const auto watch_roots = [&] {
+        std::vector<std::string> roots;
+        std::lock_guard lock(roots_mutex);
+        for (const auto &root: routing_roots) {
+            roots.push_back(root.path);
+        }
+        return roots;
+    };
+    if (server_config.watch_files) {
+        // With the watcher running, cache hits are trusted without a stat.
+        response_cache.set_watched(file_watcher.start(watch_roots()));
+    }
+
+    // A server already running with this configuration hands over its listeners instead of us binding them.
+    std::optional<Upgrade::Takeover> takeover;
+    if (!server_config.upgrade_socket.empty()) {
+        std::vector<folly::SocketAddress> addresses;
+        for (const auto &ip: IPs) {
+            addresses.push_back(ip.address);
+        }
+        takeover = Upgrade::Takeover::request(server_config.upgrade_socket, addresses);
+        if (takeover) {
+            options.useExistingSockets(takeover->sockets());
+            warmResponseCache(&response_cache, std::move(takeover->warm_paths));
+        }
+    }
+
     HTTPServer server(std::move(options));
 
     server.bind(IPs);
 
-    server.start();
+    // Reloads the host files in place. Requests in flight finish with the hosts and routes they started
+    // with, new ones see the new snapshot, and the caches stay warm. The listeners keep the TLS contexts
+    // they were bound with: certificates are re-read from the same files, but a port, certificate path or
+    // SNI name that is new needs a restart.
+    const auto reload = [&] {
+        XLOG(INFO) << "Reloading virtual host configurations";
+        std::vector<HTTPServer::IPConfig> reloaded;
+        try {
+            if (!Config::load_virtual_host_configurations(reloaded)) {
+                XLOG(ERR) << "No usable virtual host configurations, keeping the current ones";
+                return;
+            }
+        } catch (const std::exception &e) {
+            XLOG(ERR) << "Failed to reload virtual host configurations, keeping the current ones: " << e.what();
+            return;
+        }
+        for (const auto &listener: reloaded) {
+            const auto bound = std::ranges::find_if(IPs, [&](const auto &ip) {
+                return ip.address == listener.address;
+            });
+            if (bound == IPs.end()) {
+                XLOG(WARN) << "Port " << listener.address.getPort() << " is new, restart the server to listen on it";
+            } else if (tls_settings(*bound) != tls_settings(listener)) {
+                XLOG(WARN) << "Certificates or SNI names on port " << listener.address.getPort()
+                        << " changed, restart the server to apply them";
+            }
+        }
+
+        g_moduleSystem.notify_config_reloaded();
+        {
+            std::lock_guard lock(roots_mutex);
+            routing_roots = collect_roots();
+            schedule_rescan();
+        }
+        directory_cache.clear();
+        if (server_config.watch_files) {
+            file_watcher.set_roots(watch_roots());
+        }
+        server.updateTLSCredentials();
+        XLOG(INFO) << "Reloaded " << Config::virtual_hosts.size() << " virtual hosts";
+    };
+
+    // Once a new process accepts on our listeners, this one stops accepting and gives the requests it has
+    // until the deadline to finish; the reload thread stops the server as soon as they have.
+    std::atomic<int64_t> drain_started{0};
+    std::atomic<int64_t> drain_deadline{0};
+    const auto now_seconds = [] {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+    const auto listening_sockets = [&server] {
+        std::vector<Upgrade::Handoff::Listener> listeners;
+        for (const auto *socket: server.getSockets()) {
+            const auto *listening = dynamic_cast<const folly::AsyncServerSocket *>(socket);
+            if (!listening) continue;
+            folly::SocketAddress address;
+            listening->getAddress(&address);
+            listeners.push_back({address, listening->getNetworkSocket().toFd()});
+        }
+        return listeners;
+    };
+    const auto warm_paths = [&] {
+        return server_config.upgrade_warm_bytes
+                   ? response_cache.hot_paths(server_config.upgrade_warm_bytes)
+                   : std::vector<std::string>();
+    };
+    Upgrade::Handoff handoff(listening_sockets, warm_paths, [&] {
+        XLOG(INFO) << "Upgraded, finishing open connections for up to " << server_config.upgrade_drain_seconds
+                << " seconds";
+        server.stopListening();
+        drain_started = now_seconds();
+        drain_deadline = drain_started + server_config.upgrade_drain_seconds;
+    });
+
+    std::atomic<bool> stopping{false};
+    std::thread reload_thread([&] {
+        const timespec interval{1, 0};
+        while (!stopping) {
+            if (sigtimedwait(&reload_signals, nullptr, &interval) == SIGHUP) {
+                reload();
+            }
+            // A connection accepted just before the handover may not have sent its request yet, so even an
+            // idle server waits a second or so.
+            const int64_t now = now_seconds();
+            if (drain_deadline && (now >= drain_deadline || (now > drain_started + 1 && requestsInFlight() == 0))) {
+                server.stop();
+                break;
+            }
+        }
+    });
+
+    server.start([&] {
+        if (takeover) {
+            takeover->complete();
+            takeover.reset();
+        }
+        if (!server_config.upgrade_socket.empty()) {
+            handoff.start(server_config.upgrade_socket);
+        }
+    });
 
+    stopping = true;
+    reload_thread.join();
+    handoff.stop();
+    file_watcher.stop();
+    rescanner.stop();
     g_moduleSystem.cleanup();
 #ifndef DEBUG
     exit(EXIT_SUCCESS);
@@ -0,0 +1,1206 @@
+#include "server/module.h"
+#include <folly/logging/xlog.h>
+#include <proxygen/lib/http/HTTPMessage.h>
+#include <proxygen/httpserver/ResponseBuilder.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include <folly/Conv.h>
+#include <folly/SocketAddress.h>
+#include <folly/String.h>
+#include <folly/io/Cursor.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/AsyncSocket.h>
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/io/async/EventBaseLocal.h>
+
+#include "utils/config.h"
+#include "utils/host_table.h"
+#include "utils/utils.h"
+
+using namespace ModuleManage;
+
+// FastCGI 1.0 record types and flags; see the specification at fastcgi-archives.github.io.
+enum FcgiType : uint8_t {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+    FCGI_GET_VALUES = 9,
+    FCGI_GET_VALUES_RESULT = 10,
+};
+
+static constexpr uint8_t FCGI_VERSION_1 = 1;
+static constexpr uint8_t FCGI_RESPONDER = 1;
+static constexpr uint8_t FCGI_KEEP_CONN = 1;
+static constexpr size_t FCGI_HEADER_SIZE = 8;
+static constexpr size_t FCGI_MAX_CONTENT = 65535;
+
+// Request body is sent in records of this size, with at most this many of them queued on the socket.
+static constexpr size_t FASTCGI_BODY_CHUNK = 32 * 1024;
+static constexpr unsigned FASTCGI_BODY_WRITES = 4;
+// A streamed body waiting for the socket beyond this pauses the client.
+static constexpr size_t FASTCGI_BODY_BUFFER = FASTCGI_BODY_CHUNK * FASTCGI_BODY_WRITES;
+// Requests one connection carries at once when the backend multiplexes; php-fpm does not.
+static constexpr uint16_t FASTCGI_MAX_MULTIPLEX = 16;
+// A response whose CGI headers grow past this is rejected.
+static constexpr size_t FASTCGI_MAX_HEADER_SIZE = 64 * 1024;
+static constexpr int FASTCGI_CONNECT_TIMEOUT_MS = 5000;
+// A backend that refused a connection is skipped for this long while others are up.
+static constexpr std::chrono::seconds FASTCGI_RETRY_DELAY(5);
+
+static std::vector<folly::SocketAddress> fastcgi_backends;
+static std::vector<std::string> fastcgi_extensions;
+static size_t fastcgi_max_connections = 16;
+static size_t fastcgi_max_queued = 1024;
+static std::chrono::milliseconds fastcgi_timeout(60000);
+
+static constexpr size_t padding_for(size_t length) {
+    return (8 - length % 8) % 8;
+}
+
+static void write_header(uint8_t *out, uint8_t type, uint16_t id, size_t length, size_t padding) {
+    out[0] = FCGI_VERSION_1;
+    out[1] = type;
+    out[2] = static_cast<uint8_t>(id >> 8);
+    out[3] = static_cast<uint8_t>(id);
+    out[4] = static_cast<uint8_t>(length >> 8);
+    out[5] = static_cast<uint8_t>(length);
+    out[6] = static_cast<uint8_t>(padding);
+    out[7] = 0;
+}
+
+// Splits `content` over as many records as it takes; empty content makes the empty record ending a stream.
+static void append_records(folly::IOBufQueue &out, uint8_t type, uint16_t id, folly::StringPiece content) {
+    static constexpr uint8_t zeros[8] = {};
+    do {
+        const size_t length = std::min(content.size(), FCGI_MAX_CONTENT);
+        const size_t padding = padding_for(length);
+        uint8_t header[FCGI_HEADER_SIZE];
+        write_header(header, type, id, length, padding);
+        out.append(header, sizeof(header));
+        out.append(content.data(), length);
+        out.append(zeros, padding);
+        content.advance(length);
+    } while (!content.empty());
+}
+
+static void append_length(std::string &out, size_t length) {
+    if (length < 128) {
+        out += static_cast<char>(length);
+        return;
+    }
+    out += static_cast<char>(0x80 | (length >> 24));
+    out += static_cast<char>(length >> 16);
+    out += static_cast<char>(length >> 8);
+    out += static_cast<char>(length);
+}
+
+static bool read_length(const uint8_t *&p, const uint8_t *end, size_t &length) {
+    if (p == end) {
+        return false;
+    }
+    if (!(*p & 0x80)) {
+        length = *p++;
+        return true;
+    }
+    if (end - p < 4) {
+        return false;
+    }
+    length = static_cast<size_t>(p[0] & 0x7f) << 24 | static_cast<size_t>(p[1]) << 16 |
+             static_cast<size_t>(p[2]) << 8 | p[3];
+    p += 4;
+    return true;
+}
+
+static void append_param(std::string &out, folly::StringPiece name, folly::StringPiece value) {
+    append_length(out, name.size());
+    append_length(out, value.size());
+    out.append(name.data(), name.size());
+    out.append(value.data(), value.size());
+}
+
+// The CGI/1.1 environment php-fpm expects, plus every request header as HTTP_*.
+static void build_params(const ModuleContext &ctx, std::optional<uint64_t> content_length, std::string &params) {
+    const proxygen::HTTPMessage &request = *ctx.request;
+    const folly::StringPiece file_path(ctx.file_path);
+    const folly::StringPiece script_name = file_path.startsWith(folly::StringPiece(ctx.document_root))
+                                               ? file_path.subpiece(ctx.document_root.size())
+                                               : file_path;
+    // The Host without its port; IPv6 literals keep their brackets.
+    char host_buffer[Routing::HostTable::MAX_NAME_LENGTH];
+    const folly::StringPiece server_name = Routing::HostTable::normalize(
+        request.getHeaders().getSingleOrEmpty(proxygen::HTTP_HEADER_HOST), host_buffer);
+
+    append_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    append_param(params, "SERVER_SOFTWARE", "WBSRV");
+    append_param(params, "SERVER_PROTOCOL", "HTTP/" + request.getVersionString());
+    append_param(params, "SERVER_NAME", server_name);
+    append_param(params, "SERVER_ADDR", request.getDstIP());
+    append_param(params, "SERVER_PORT", request.getDstPort());
+    append_param(params, "REMOTE_ADDR", request.getClientIP());
+    append_param(params, "REMOTE_PORT", request.getClientPort());
+    append_param(params, "REQUEST_METHOD", request.getMethodString());
+    append_param(params, "REQUEST_URI", request.getURL());
+    append_param(params, "QUERY_STRING", request.getQueryString());
+    append_param(params, "DOCUMENT_ROOT", folly::StringPiece(ctx.document_root));
+    append_param(params, "SCRIPT_FILENAME", file_path);
+    append_param(params, "SCRIPT_NAME", script_name);
+    // php-cgi refuses to run without it (cgi.force_redirect).
+    append_param(params, "REDIRECT_STATUS", "200");
+    if (request.isSecure()) {
+        append_param(params, "HTTPS", "on");
+    }
+    if (content_length) {
+        append_param(params, "CONTENT_LENGTH", folly::to<std::string>(*content_length));
+    }
+
+    thread_local std::string variable;
+    request.getHeaders().forEachWithCode(
+        [&](proxygen::HTTPHeaderCode code, const std::string &name, const std::string &value) {
+            if (code == proxygen::HTTP_HEADER_CONTENT_TYPE) {
+                append_param(params, "CONTENT_TYPE", value);
+            }
+            // A "Proxy" header would become HTTP_PROXY, which HTTP clients take for their proxy (httpoxy).
+            if (folly::StringPiece(name).equals("Proxy", folly::AsciiCaseInsensitive())) {
+                return;
+            }
+            variable.assign("HTTP_");
+            for (const char c: name) {
+                variable += c == '-' ? '_' : static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            }
+            append_param(params, variable, value);
+        });
+}
+
+class FastCgiConnection;
+
+// A request on its way through a backend. The pool owns it while it waits for a connection, then the
+// connection carrying it does until the backend ends it, even if the client has gone away by then.
+// Everything happens on the request's EventBase.
+//
+// A request taken over in ROUTE is `streamed`: its body goes to the backend as it arrives, and the client
+// is paused while more than FASTCGI_BODY_BUFFER of it waits for the socket. Otherwise the body is
+// complete before the request is made.
+class FastCgiRequest : public folly::AsyncWriter::WriteCallback {
+public:
+    FastCgiRequest(ModuleContext &ctx, bool streamed);
+
+    ~FastCgiRequest() override {
+        detach();
+    }
+
+    // Sends the request to `connection` as `id`. The client must still be there.
+    void start(FastCgiConnection *connection, uint16_t id);
+
+    // Makes a request whose connection could not be established ready to start again.
+    void reset();
+
+    // Waiting for a connection: the timeout runs from here.
+    void queued();
+
+    void onStdout(std::unique_ptr<folly::IOBuf> data);
+
+    // Hands what arrived to the client.
+    void flush();
+
+    void onEnd();
+
+    // Answers with an error page, or aborts the response if part of it went out already.
+    void fail(int status);
+
+    bool alive() const noexcept {
+        return !detached_ && !released_ && !origin_.expired();
+    }
+
+    bool detached() const noexcept {
+        return detached_;
+    }
+
+    // Part of the body has not reached the backend yet.
+    bool writing() const noexcept {
+        return !body_done_ || writes_in_flight_ > 0;
+    }
+
+    bool paused() const noexcept {
+        return paused_;
+    }
+
+    unsigned attempts() const noexcept {
+        return attempts_;
+    }
+
+    // Whether it can start over on another connection: a streamed body that went out is gone.
+    bool restartable() const noexcept {
+        return !body_streamed_;
+    }
+
+    bool aborted = false; // the backend was told to stop, or the connection is going away
+
+    void writeSuccess() noexcept override;
+
+    void writeErr(size_t bytes_written, const folly::AsyncSocketException &error) noexcept override;
+
+private:
+    void pumpBody();
+
+    void onClientBody(std::unique_ptr<folly::IOBuf> chunk);
+
+    void onClientGone();
+
+    void updateIngress();
+
+    bool parseHeaders();
+
+    void deliver(bool eom);
+
+    void setPaused(bool paused);
+
+    void detach();
+
+    void release();
+
+    std::weak_ptr<ModuleContext> origin_;
+    proxygen::ResponseHandler *downstream_ = nullptr; // streamed requests only
+    Utils::RequestBody body_;
+    std::optional<uint64_t> content_length_;
+    folly::fbstring path_;
+    FastCgiConnection *connection_ = nullptr;
+    uint16_t id_ = 0;
+    unsigned attempts_ = 0;
+
+    std::optional<Utils::RequestBody::Reader> body_reader_;
+    uint64_t body_left_ = 0;
+    unsigned writes_in_flight_ = 0;
+    bool body_done_ = true;
+    bool streamed_ = false;
+    folly::IOBufQueue pending_body_{folly::IOBufQueue::cacheChainLength()}; // streamed, not yet written
+    bool body_ended_ = false;
+    bool body_streamed_ = false; // part of a streamed body was handed to a connection
+    bool ingress_paused_ = false;
+
+    folly::IOBufQueue head_{folly::IOBufQueue::cacheChainLength()};
+    folly::IOBufQueue output_{folly::IOBufQueue::cacheChainLength()};
+    int status_ = 200;
+    std::string reason_;
+    proxygen::HTTPHeaders headers_;
+    bool headers_parsed_ = false;
+    bool headers_sent_ = false;
+    bool paused_ = false;
+    bool detached_ = false;
+    bool released_ = false; // the listeners on the client are gone, or the client is
+    std::unique_ptr<folly::AsyncTimeout> timeout_;
+};
+
+class FastCgiPool;
+
+// One socket to a backend with up to FASTCGI_MAX_MULTIPLEX requests on it. Connections start out carrying
+// one request at a time and take more only once the backend reports FCGI_MPXS_CONNS. Since FastCGI has
+// no per-request flow control, reading stops for all of them while any of their clients is paused.
+class FastCgiConnection : public folly::AsyncSocket::ConnectCallback, public folly::AsyncReader::ReadCallback {
+public:
+    FastCgiConnection(FastCgiPool &pool, size_t upstream, folly::EventBase *event_base,
+                      const folly::SocketAddress &address);
+
+    bool hasRoom() const noexcept {
+        return !closed_ && active_ < capacity_;
+    }
+
+    size_t upstream() const noexcept {
+        return upstream_;
+    }
+
+    folly::EventBase *eventBase() const noexcept {
+        return event_base_;
+    }
+
+    void add(std::unique_ptr<FastCgiRequest> request);
+
+    void write(std::unique_ptr<folly::IOBuf> data, folly::AsyncWriter::WriteCallback *callback = nullptr);
+
+    // The request's client is gone or it timed out: stop the script if the backend can be told to,
+    // otherwise drop the connection with it.
+    void abandon(uint16_t id);
+
+    void requestPaused(bool paused);
+
+    void close(bool connect_failed);
+
+    void connectSuccess() noexcept override;
+
+    void connectErr(const folly::AsyncSocketException &error) noexcept override;
+
+    void getReadBuffer(void **buffer, size_t *length) override;
+
+    void readDataAvailable(size_t length) noexcept override;
+
+    void readEOF() noexcept override;
+
+    void readErr(const folly::AsyncSocketException &error) noexcept override;
+
+private:
+    void processRecords();
+
+    void endRequest(uint16_t id);
+
+    void onValues(folly::IOBuf &content);
+
+    void updateReading();
+
+    FastCgiPool &pool_;
+    size_t upstream_;
+    folly::EventBase *event_base_;
+    folly::AsyncSocket::UniquePtr socket_;
+    folly::IOBufQueue input_{folly::IOBufQueue::cacheChainLength()};
+    std::array<std::unique_ptr<FastCgiRequest>, FASTCGI_MAX_MULTIPLEX + 1> slots_; // by request id
+    uint16_t capacity_ = 1;
+    uint16_t active_ = 0;
+    unsigned paused_requests_ = 0;
+    bool connected_ = false;
+    bool closed_ = false;
+};
+
+// The connections of one EventBase to every backend, and the requests waiting for room on them.
+// Backends are used in turn; one that refused a connection sits out FASTCGI_RETRY_DELAY.
+class FastCgiPool {
+public:
+    explicit FastCgiPool(folly::EventBase &event_base) : event_base_(event_base), upstreams_(fastcgi_backends.size()) {
+    }
+
+    // False when too many requests are waiting already.
+    bool submit(std::unique_ptr<FastCgiRequest> request);
+
+    // Starts waiting requests on connections that have room.
+    void dispatch();
+
+    // Takes a closed connection out of service. Requests that never reached a backend go to the next one;
+    // the rest fail. Both are destroyed from the loop, outside the callbacks that got here.
+    void retire(FastCgiConnection *connection, bool connect_failed,
+                std::vector<std::unique_ptr<FastCgiRequest> > requests);
+
+private:
+    struct Upstream {
+        std::vector<std::unique_ptr<FastCgiConnection> > connections;
+        std::chrono::steady_clock::time_point down_until;
+    };
+
+    FastCgiConnection *pick();
+
+    void reap();
+
+    folly::EventBase &event_base_;
+    std::vector<Upstream> upstreams_;
+    size_t next_ = 0;
+    std::deque<std::unique_ptr<FastCgiRequest> > waiting_;
+    std::vector<std::unique_ptr<FastCgiConnection> > retired_connections_;
+    std::vector<std::unique_ptr<FastCgiRequest> > retired_requests_;
+    bool reap_scheduled_ = false;
+};
+
+static folly::EventBaseLocal<FastCgiPool> fastcgi_pools;
+
+FastCgiRequest::FastCgiRequest(ModuleContext &ctx, bool streamed)
+    : origin_(ctx.weak()), path_(ctx.file_path), streamed_(streamed) {
+    if (streamed) {
+        downstream_ = ctx.downstream;
+        const std::string &length = ctx.request->getHeaders().getSingleOrEmpty(proxygen::HTTP_HEADER_CONTENT_LENGTH);
+        if (const auto value = folly::tryTo<uint64_t>(length); value) {
+            content_length_ = *value;
+        }
+        ctx.body_listener = [this](std::unique_ptr<folly::IOBuf> chunk) { onClientBody(std::move(chunk)); };
+        ctx.close_listener = [this] { onClientGone(); };
+    } else {
+        body_ = ctx.request_body;
+        if (!body_.empty()) {
+            content_length_ = body_.size();
+        }
+    }
+
+    timeout_ = folly::AsyncTimeout::make(*ctx.event_base, [this]() noexcept {
+        if (connection_) {
+            XLOG(WARN) << "FastCGI backend timed out on " << path_;
+        } else {
+            XLOG(WARN) << "No FastCGI connection became free for " << path_;
+        }
+        fail(504);
+        if (connection_) {
+            connection_->abandon(id_);
+        }
+    });
+}
+
+void FastCgiRequest::start(FastCgiConnection *connection, uint16_t id) {
+    const auto ctx = origin_.lock();
+    connection_ = connection;
+    id_ = id;
+    attempts_++;
+
+    folly::IOBufQueue out{folly::IOBufQueue::cacheChainLength()};
+    const uint8_t begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    uint8_t header[FCGI_HEADER_SIZE];
+    write_header(header, FCGI_BEGIN_REQUEST, id, sizeof(begin), 0);
+    out.append(header, sizeof(header));
+    out.append(begin, sizeof(begin));
+
+    thread_local std::string params;
+    params.clear();
+    build_params(*ctx, content_length_, params);
+    append_records(out, FCGI_PARAMS, id, params);
+    append_records(out, FCGI_PARAMS, id, folly::StringPiece());
+    connection_->write(out.move());
+
+    body_left_ = body_.size();
+    body_reader_.reset();
+    if (body_left_ > 0) {
+        body_reader_.emplace(body_);
+    }
+    body_done_ = false;
+    writes_in_flight_ = 0;
+    pumpBody();
+
+    timeout_->scheduleTimeout(fastcgi_timeout);
+
+    ctx->egress_listener = [this](bool paused) { setPaused(paused); };
+    setPaused(ctx->egress_paused);
+}
+
+void FastCgiRequest::reset() {
+    connection_ = nullptr;
+    paused_ = false;
+    aborted = false;
+    body_done_ = true;
+    writes_in_flight_ = 0;
+}
+
+void FastCgiRequest::queued() {
+    timeout_->scheduleTimeout(fastcgi_timeout);
+}
+
+// The body goes out a few records at a time as the socket takes them, so a spilled upload is never read
+// into memory as a whole.
+void FastCgiRequest::pumpBody() {
+    while (!body_done_ && writes_in_flight_ < FASTCGI_BODY_WRITES) {
+        if (streamed_ && !pending_body_.empty()) {
+            auto data = pending_body_.splitAtMost(FASTCGI_BODY_CHUNK);
+            const size_t length = data->computeChainDataLength();
+            const size_t padding = padding_for(length);
+            static constexpr uint8_t zeros[8] = {};
+            auto record = folly::IOBuf::create(FCGI_HEADER_SIZE);
+            write_header(record->writableData(), FCGI_STDIN, id_, length, padding);
+            record->append(FCGI_HEADER_SIZE);
+            record->prependChain(std::move(data));
+            if (padding > 0) {
+                record->prependChain(folly::IOBuf::wrapBuffer(zeros, padding));
+            }
+            body_streamed_ = true;
+            writes_in_flight_++;
+            connection_->write(std::move(record), this);
+            continue;
+        }
+        if (streamed_ && !body_ended_) {
+            break; // the rest is still on its way from the client
+        }
+        if (body_left_ == 0) {
+            folly::IOBufQueue out;
+            append_records(out, FCGI_STDIN, id_, folly::StringPiece());
+            body_done_ = true;
+            connection_->write(out.move());
+            return;
+        }
+
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(body_left_, FASTCGI_BODY_CHUNK));
+        auto record = folly::IOBuf::create(FCGI_HEADER_SIZE + length + 8);
+        const size_t read = body_reader_->read(record->writableData() + FCGI_HEADER_SIZE, length);
+        if (read == 0) {
+            // The backend sees a body shorter than CONTENT_LENGTH and fails the request.
+            XLOG(ERR) << "Can't read the request body for " << path_;
+            body_left_ = 0;
+            continue;
+        }
+        body_left_ -= read;
+
+        const size_t padding = padding_for(read);
+        write_header(record->writableData(), FCGI_STDIN, id_, read, padding);
+        std::memset(record->writableData() + FCGI_HEADER_SIZE + read, 0, padding);
+        record->append(FCGI_HEADER_SIZE + read + padding);
+        writes_in_flight_++;
+        connection_->write(std::move(record), this);
+    }
+}
+
+void FastCgiRequest::writeSuccess() noexcept {
+    writes_in_flight_--;
+    // The backend stays silent until it has the whole body; body still going out is not a stall.
+    if (!detached_ && !paused_) {
+        timeout_->scheduleTimeout(fastcgi_timeout);
+    }
+    pumpBody();
+    updateIngress();
+}
+
+void FastCgiRequest::onClientBody(std::unique_ptr<folly::IOBuf> chunk) {
+    if (!chunk) {
+        body_ended_ = true;
+    } else {
+        pending_body_.append(std::move(chunk));
+    }
+    if (connection_ && !detached_) {
+        if (!paused_) {
+            timeout_->scheduleTimeout(fastcgi_timeout);
+        }
+        pumpBody();
+    }
+    updateIngress();
+}
+
+// The ModuleContext is being destroyed: forget it, and stop the backend unless it already finished.
+void FastCgiRequest::onClientGone() {
+    released_ = true;
+    downstream_ = nullptr;
+    if (detached_) {
+        return;
+    }
+    detach();
+    if (connection_) {
+        connection_->abandon(id_);
+    }
+}
+
+void FastCgiRequest::updateIngress() {
+    if (released_ || !downstream_) {
+        return;
+    }
+    const bool pause = pending_body_.chainLength() >= FASTCGI_BODY_BUFFER;
+    if (pause != ingress_paused_) {
+        ingress_paused_ = pause;
+        pause ? downstream_->pauseIngress() : downstream_->resumeIngress();
+    }
+}
+
+void FastCgiRequest::writeErr(size_t /*bytes_written*/, const folly::AsyncSocketException & /*error*/) noexcept {
+    // The connection reports the failure to every request on it.
+    writes_in_flight_--;
+    body_done_ = true;
+}
+
+void FastCgiRequest::onStdout(std::unique_ptr<folly::IOBuf> data) {
+    if (detached_) {
+        return;
+    }
+    timeout_->scheduleTimeout(fastcgi_timeout);
+
+    if (headers_parsed_) {
+        output_.append(std::move(data));
+        return;
+    }
+    head_.append(std::move(data));
+    if (!parseHeaders() && head_.chainLength() > FASTCGI_MAX_HEADER_SIZE) {
+        XLOG(ERR) << "FastCGI response headers too large for " << path_;
+        fail(502);
+    }
+}
+
+// The CGI header block ends at the first empty line. "Status" carries the status; a Location without one
+// is a redirect. Returns false while the block is incomplete.
+bool FastCgiRequest::parseHeaders() {
+    auto head = head_.move();
+    head->coalesce();
+    const folly::StringPiece text(reinterpret_cast<const char *>(head->data()), head->length());
+
+    const size_t crlf = text.find("\r\n\r\n");
+    const size_t lf = text.find("\n\n");
+    size_t end;
+    if (crlf != folly::StringPiece::npos && (lf == folly::StringPiece::npos || crlf < lf)) {
+        end = crlf + 4;
+    } else if (lf != folly::StringPiece::npos) {
+        end = lf + 2;
+    } else {
+        head_.append(std::move(head));
+        return false;
+    }
+
+    bool has_status = false;
+    folly::StringPiece lines = text.subpiece(0, end);
+    while (!lines.empty()) {
+        const size_t newline = lines.find('\n');
+        const folly::StringPiece line = lines.subpiece(0, newline);
+        lines = newline == folly::StringPiece::npos ? folly::StringPiece() : lines.subpiece(newline + 1);
+
+        const size_t colon = line.find(':');
+        if (colon == folly::StringPiece::npos) continue;
+        const folly::StringPiece name = folly::trimWhitespace(line.subpiece(0, colon));
+        const folly::StringPiece value = folly::trimWhitespace(line.subpiece(colon + 1));
+
+        if (name.equals("Status", folly::AsciiCaseInsensitive())) {
+            if (const auto code = folly::tryTo<int>(value.subpiece(0, 3)); code && *code >= 100 && *code < 600) {
+                status_ = *code;
+                reason_ = folly::trimWhitespace(value.subpiece(3)).str();
+                has_status = true;
+            }
+            continue;
+        }
+        headers_.add(name, value.str());
+    }
+    if (!has_status && headers_.exists(proxygen::HTTP_HEADER_LOCATION)) {
+        status_ = 302;
+    }
+    if (reason_.empty()) {
+        reason_ = proxygen::HTTPMessage::getDefaultReason(status_);
+    }
+    headers_parsed_ = true;
+
+    head->trimStart(end);
+    if (!head->empty()) {
+        output_.append(std::move(head));
+    }
+    return true;
+}
+
+void FastCgiRequest::flush() {
+    if (!detached_ && headers_parsed_ && (!headers_sent_ || !output_.empty())) {
+        deliver(false);
+    }
+}
+
+void FastCgiRequest::onEnd() {
+    if (detached_) {
+        return;
+    }
+    if (!headers_parsed_) {
+        XLOG(ERR) << "FastCGI backend ended " << path_ << " without a response";
+        fail(502);
+        return;
+    }
+    deliver(true);
+    detach();
+}
+
+// Without a Content-Length from the script the codec sends the body chunked as it arrives.
+void FastCgiRequest::deliver(bool eom) {
+    const auto ctx = origin_.lock();
+    if (!ctx) {
+        detach();
+        return;
+    }
+
+    if (!headers_sent_) {
+        ctx->response->status(status_, reason_);
+        headers_.forEach([&](const std::string &name, const std::string &value) {
+            ctx->response->header(name, value);
+        });
+        headers_sent_ = true;
+    }
+    if (!output_.empty()) {
+        ctx->response->body(output_.move());
+    }
+    if (eom) {
+        release(); // sending the EOM may end the request right away
+        ctx->response->sendWithEOM();
+    } else {
+        ctx->response->send();
+    }
+}
+
+void FastCgiRequest::fail(int status) {
+    if (detached_) {
+        return;
+    }
+    const auto ctx = released_ ? nullptr : origin_.lock();
+    // Done with the client before answering it: an abort ends the request on the spot.
+    detach();
+    if (!ctx) {
+        return;
+    }
+    if (!headers_sent_) {
+        ctx->response->status(status, proxygen::HTTPMessage::getDefaultReason(status))
+                .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
+                .body(Utils::getErrorPage(status))
+                .sendWithEOM();
+    } else {
+        // Part of the page is already out. Ending it normally would pass the truncated page off as
+        // complete, to the client and to any cache in between.
+        XLOG(WARN) << "FastCGI response cut short: " << path_;
+        ctx->response->rejectUpstream();
+    }
+}
+
+void FastCgiRequest::setPaused(bool paused) {
+    if (paused == paused_ || detached_ || !connection_) {
+        return;
+    }
+    paused_ = paused;
+    // A paused client keeps the backend waiting; that is not the backend's silence.
+    if (paused) {
+        timeout_->cancelTimeout();
+    } else {
+        timeout_->scheduleTimeout(fastcgi_timeout);
+    }
+    connection_->requestPaused(paused);
+}
+
+void FastCgiRequest::detach() {
+    if (detached_) {
+        return;
+    }
+    detached_ = true;
+    head_.reset();
+    output_.reset();
+    pending_body_.reset();
+    if (timeout_) {
+        timeout_->cancelTimeout();
+    }
+    release();
+    if (paused_) {
+        paused_ = false;
+        connection_->requestPaused(false);
+    }
+}
+
+// Stops listening to the client. Its ingress is resumed so that an upload nobody reads any more can end.
+void FastCgiRequest::release() {
+    if (released_) {
+        return;
+    }
+    released_ = true;
+    if (const auto ctx = origin_.lock()) {
+        ctx->egress_listener = nullptr;
+        ctx->body_listener = nullptr;
+        ctx->close_listener = nullptr;
+    }
+    if (ingress_paused_ && downstream_) {
+        downstream_->resumeIngress();
+    }
+    ingress_paused_ = false;
+    downstream_ = nullptr;
+}
+
+FastCgiConnection::FastCgiConnection(FastCgiPool &pool, size_t upstream, folly::EventBase *event_base,
+                                     const folly::SocketAddress &address)
+    : pool_(pool), upstream_(upstream), event_base_(event_base),
+      socket_(folly::AsyncSocket::newSocket(event_base)) {
+    socket_->connect(this, address, FASTCGI_CONNECT_TIMEOUT_MS);
+
+    // Queued until the connection is up. Backends that multiplex say so in their answer.
+    std::string names;
+    append_param(names, "FCGI_MPXS_CONNS", "");
+    append_param(names, "FCGI_MAX_REQS", "");
+    folly::IOBufQueue out;
+    append_records(out, FCGI_GET_VALUES, 0, names);
+    write(out.move());
+}
+
+void FastCgiConnection::add(std::unique_ptr<FastCgiRequest> request) {
+    uint16_t id = 1;
+    while (slots_[id]) {
+        id++;
+    }
+    active_++;
+    slots_[id] = std::move(request);
+    slots_[id]->start(this, id);
+}
+
+void FastCgiConnection::write(std::unique_ptr<folly::IOBuf> data, folly::AsyncWriter::WriteCallback *callback) {
+    if (!closed_) {
+        socket_->writeChain(callback, std::move(data));
+    }
+}
+
+void FastCgiConnection::abandon(uint16_t id) {
+    FastCgiRequest &request = *slots_[id];
+    if (request.aborted) {
+        return;
+    }
+    request.aborted = true;
+
+    if (capacity_ == 1) {
+        close(false);
+        return;
+    }
+    folly::IOBufQueue out;
+    append_records(out, FCGI_ABORT_REQUEST, id, folly::StringPiece());
+    write(out.move());
+}
+
+void FastCgiConnection::requestPaused(bool paused) {
+    paused ? paused_requests_++ : paused_requests_--;
+    updateReading();
+}
+
+void FastCgiConnection::updateReading() {
+    if (connected_ && !closed_) {
+        socket_->setReadCB(paused_requests_ > 0 ? nullptr : this);
+    }
+}
+
+void FastCgiConnection::close(bool connect_failed) {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    socket_->setReadCB(nullptr);
+    // Fails the queued writes first, while the requests behind them are still here.
+    socket_->closeNow();
+
+    std::vector<std::unique_ptr<FastCgiRequest> > requests;
+    for (auto &slot: slots_) {
+        if (slot) {
+            requests.push_back(std::move(slot));
+        }
+    }
+    active_ = 0;
+    pool_.retire(this, connect_failed, std::move(requests));
+}
+
+void FastCgiConnection::connectSuccess() noexcept {
+    connected_ = true;
+    updateReading();
+}
+
+void FastCgiConnection::connectErr(const folly::AsyncSocketException &error) noexcept {
+    XLOG(ERR) << "Can't connect to FastCGI backend: " << error.what();
+    close(true);
+}
+
+void FastCgiConnection::getReadBuffer(void **buffer, size_t *length) {
+    const auto space = input_.preallocate(4096, 65536);
+    *buffer = space.first;
+    *length = space.second;
+}
+
+void FastCgiConnection::readDataAvailable(size_t length) noexcept {
+    input_.postallocate(length);
+    processRecords();
+}
+
+void FastCgiConnection::readEOF() noexcept {
+    close(false);
+}
+
+void FastCgiConnection::readErr(const folly::AsyncSocketException &error) noexcept {
+    XLOG(WARN) << "FastCGI connection failed: " << error.what();
+    close(false);
+}
+
+// Handles every complete record received. Output is only handed to the clients once the whole read is
+// through, so records the backend wrote in small pieces leave as one chunk.
+void FastCgiConnection::processRecords() {
+    uint32_t touched = 0;
+    while (!closed_ && input_.chainLength() >= FCGI_HEADER_SIZE) {
+        uint8_t header[FCGI_HEADER_SIZE];
+        folly::io::Cursor(input_.front()).pull(header, sizeof(header));
+        const uint8_t type = header[1];
+        const uint16_t id = static_cast<uint16_t>(header[2] << 8 | header[3]);
+        const size_t length = static_cast<size_t>(header[4] << 8 | header[5]);
+        const size_t padding = header[6];
+        if (header[0] != FCGI_VERSION_1) {
+            XLOG(ERR) << "FastCGI backend sent a malformed record";
+            close(false);
+            return;
+        }
+        if (input_.chainLength() < FCGI_HEADER_SIZE + length + padding) {
+            break;
+        }
+
+        input_.trimStart(FCGI_HEADER_SIZE);
+        std::unique_ptr<folly::IOBuf> content = length > 0 ? input_.split(length) : nullptr;
+        if (padding > 0) {
+            input_.trimStart(padding);
+        }
+
+        if (id == 0) {
+            if (type == FCGI_GET_VALUES_RESULT && content) {
+                onValues(*content);
+            }
+            continue;
+        }
+        if (id > FASTCGI_MAX_MULTIPLEX || !slots_[id]) {
+            continue;
+        }
+
+        switch (type) {
+            case FCGI_STDOUT:
+                if (content) {
+                    slots_[id]->onStdout(std::move(content));
+                    touched |= 1u << id;
+                }
+                break;
+            case FCGI_STDERR:
+                if (content) {
+                    content->coalesce();
+                    XLOG(WARN) << "FastCGI: " << folly::trimWhitespace(folly::StringPiece(
+                        reinterpret_cast<const char *>(content->data()), content->length()));
+                }
+                break;
+            case FCGI_END_REQUEST:
+                touched &= ~(1u << id);
+                endRequest(id);
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (uint16_t id = 1; id <= FASTCGI_MAX_MULTIPLEX && touched && !closed_; ++id) {
+        FastCgiRequest *request = slots_[id].get();
+        if (!(touched & (1u << id)) || !request) continue;
+        // Flushing may end the client's request on the spot, and its close listener may abandon the
+        // request or close this connection.
+        request->flush();
+        if (closed_ || slots_[id].get() != request) continue;
+        if (request->detached()) {
+            abandon(id);
+        }
+    }
+}
+
+void FastCgiConnection::endRequest(uint16_t id) {
+    std::unique_ptr<FastCgiRequest> request = std::move(slots_[id]);
+    active_--;
+    request->onEnd();
+
+    if (request->writing()) {
+        // The backend answered before reading the whole body; the rest can't go to anyone else.
+        close(false);
+        return;
+    }
+    pool_.dispatch();
+}
+
+void FastCgiConnection::onValues(folly::IOBuf &content) {
+    content.coalesce();
+    const uint8_t *p = content.data();
+    const uint8_t *end = p + content.length();
+
+    bool multiplexed = false;
+    size_t max_requests = FASTCGI_MAX_MULTIPLEX;
+    size_t name_length, value_length;
+    while (read_length(p, end, name_length) && read_length(p, end, value_length) &&
+           static_cast<size_t>(end - p) >= name_length + value_length) {
+        const folly::StringPiece name(reinterpret_cast<const char *>(p), name_length);
+        const folly::StringPiece value(reinterpret_cast<const char *>(p) + name_length, value_length);
+        p += name_length + value_length;
+
+        if (name == "FCGI_MPXS_CONNS") {
+            multiplexed = value == "1";
+        } else if (name == "FCGI_MAX_REQS") {
+            if (const auto requests = folly::tryTo<size_t>(value); requests && *requests > 0) {
+                max_requests = *requests;
+            }
+        }
+    }
+
+    if (multiplexed) {
+        capacity_ = static_cast<uint16_t>(std::min<size_t>(max_requests, FASTCGI_MAX_MULTIPLEX));
+        pool_.dispatch();
+    }
+}
+
+bool FastCgiPool::submit(std::unique_ptr<FastCgiRequest> request) {
+    if (waiting_.empty()) {
+        if (FastCgiConnection *connection = pick()) {
+            connection->add(std::move(request));
+            return true;
+        }
+    }
+    if (waiting_.size() >= fastcgi_max_queued) {
+        std::erase_if(waiting_, [](const auto &waiting) { return !waiting->alive(); });
+        if (waiting_.size() >= fastcgi_max_queued) {
+            return false;
+        }
+    }
+    request->queued();
+    waiting_.push_back(std::move(request));
+    return true;
+}
+
+void FastCgiPool::dispatch() {
+    while (!waiting_.empty()) {
+        if (!waiting_.front()->alive()) {
+            waiting_.pop_front(); // the client left while it waited
+            continue;
+        }
+        FastCgiConnection *connection = pick();
+        if (!connection) {
+            return;
+        }
+        auto request = std::move(waiting_.front());
+        waiting_.pop_front();
+        connection->add(std::move(request));
+    }
+}
+
+// A connection with room on the next backend in turn, opening one if the backend has fewer than allowed.
+// Backends that recently refused a connection are only tried when all of them did.
+FastCgiConnection *FastCgiPool::pick() {
+    const auto now = std::chrono::steady_clock::now();
+    const bool all_down = std::ranges::all_of(upstreams_, [&](const Upstream &upstream) {
+        return upstream.down_until > now;
+    });
+
+    for (size_t i = 0; i < upstreams_.size(); ++i) {
+        const size_t index = (next_ + i) % upstreams_.size();
+        Upstream &upstream = upstreams_[index];
+        if (upstream.down_until > now && !all_down) continue;
+
+        FastCgiConnection *found = nullptr;
+        for (const auto &connection: upstream.connections) {
+            if (connection->hasRoom()) {
+                found = connection.get();
+                break;
+            }
+        }
+        if (!found && upstream.connections.size() < fastcgi_max_connections) {
+            upstream.connections.push_back(
+                std::make_unique<FastCgiConnection>(*this, index, &event_base_, fastcgi_backends[index]));
+            found = upstream.connections.back().get();
+        }
+        if (found) {
+            next_ = index + 1;
+            return found;
+        }
+    }
+    return nullptr;
+}
+
+void FastCgiPool::retire(FastCgiConnection *connection, bool connect_failed,
+                         std::vector<std::unique_ptr<FastCgiRequest> > requests) {
+    Upstream &upstream = upstreams_[connection->upstream()];
+    const auto it = std::ranges::find_if(upstream.connections, [&](const auto &owned) {
+        return owned.get() == connection;
+    });
+    retired_connections_.push_back(std::move(*it));
+    upstream.connections.erase(it);
+    if (connect_failed) {
+        upstream.down_until = std::chrono::steady_clock::now() + FASTCGI_RETRY_DELAY;
+    }
+
+    for (auto &request: requests) {
+        if (connect_failed && request->alive() && request->attempts() < upstreams_.size() &&
+            request->restartable()) {
+            request->reset();
+            request->queued();
+            waiting_.push_front(std::move(request));
+        } else {
+            request->fail(502);
+            retired_requests_.push_back(std::move(request));
+        }
+    }
+    reap();
+    dispatch();
+}
+
+void FastCgiPool::reap() {
+    if (reap_scheduled_) {
+        return;
+    }
+    reap_scheduled_ = true;
+    event_base_.runInLoop([this] {
+        reap_scheduled_ = false;
+        retired_requests_.clear();
+        retired_connections_.clear();
+    });
+}
+
+static bool isFastCgiFile(folly::StringPiece path) {
+    return std::ranges::any_of(fastcgi_extensions, [&](const std::string &extension) {
+        return path.endsWith(extension);
+    });
+}
+
+static bool FastCGIModule_init() {
+    const Config::ServerConfig *config = Config::server_config;
+    if (!config || config->fastcgi_backends.empty()) {
+        return true;
+    }
+
+    for (const auto &backend: config->fastcgi_backends) {
+        folly::SocketAddress address;
+        try {
+            if (folly::StringPiece(backend).startsWith("unix:")) {
+                address.setFromPath(folly::StringPiece(backend).subpiece(5));
+            } else {
+                address.setFromHostPort(backend);
+            }
+        } catch (const std::exception &e) {
+            XLOG(ERR) << "Invalid FastCGI backend " << backend << ": " << e.what();
+            return false;
+        }
+        fastcgi_backends.push_back(address);
+    }
+    fastcgi_extensions = config->fastcgi_extensions;
+    fastcgi_max_connections = std::max<size_t>(config->fastcgi_connections, 1);
+    fastcgi_max_queued = config->fastcgi_queue_size;
+    fastcgi_timeout = std::chrono::seconds(config->fastcgi_timeout_seconds);
+
+    XLOG(INFO) << "FastCGI enabled with " << fastcgi_backends.size() << " backends";
+    return true;
+}
+
+// The response is streamed by the connection as the backend produces it.
+static ModuleResult submit_request(ModuleContext &ctx, bool streamed) {
+    FastCgiPool &pool = fastcgi_pools.try_emplace(*ctx.event_base, *ctx.event_base);
+    if (!pool.submit(std::make_unique<FastCgiRequest>(ctx, streamed))) {
+        XLOG(WARN) << "FastCGI queue full, rejecting " << ctx.file_path;
+        ctx.response->status(503, proxygen::HTTPMessage::getDefaultReason(503))
+                .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
+                .body(Utils::getErrorPage(503))
+                .sendWithEOM();
+    }
+    return ModuleResult::BREAK;
+}
+
+// Scripts named in the URL are taken before the body arrives, so an upload streams to the backend instead
+// of being buffered first. A body without a Content-Length is left to PRE_RESPONSE, which sees it whole.
+static ModuleResult FastCGIModule_route(ModuleContext &ctx) {
+    const folly::StringPiece path = ctx.request->getPathAsStringPiece();
+    if (fastcgi_backends.empty() || !isFastCgiFile(path)) {
+        return ModuleResult::CONTINUE;
+    }
+    const proxygen::HTTPMethod method = ctx.request->getMethod().value_or(proxygen::HTTPMethod::GET);
+    if (method != proxygen::HTTPMethod::GET && method != proxygen::HTTPMethod::HEAD &&
+        !ctx.request->getHeaders().exists(proxygen::HTTP_HEADER_CONTENT_LENGTH)) {
+        return ModuleResult::CONTINUE;
+    }
+
+    ctx.file_path.clear();
+    ctx.file_path.append(ctx.document_root);
+    ctx.file_path.append(path.begin(), path.end());
+    return submit_request(ctx, true);
+}
+
+// Index pages and chunked uploads, which only resolve to a script once the request is mapped.
+static ModuleResult FastCGIModule_pre_response(ModuleContext &ctx) {
+    if (fastcgi_backends.empty() || !isFastCgiFile(ctx.file_path)) {
+        return ModuleResult::CONTINUE;
+    }
+    return submit_request(ctx, false);
+}
+
+static Module FastCGIModule = {
+    "FastCGIModule",
+    "1.0.0",
+    5, // after ProxyModule's prefixes, ahead of the embedded PHP
+    true, // enabled
+    nullptr,
+    FastCGIModule_pre_response,
+    nullptr,
+    FastCGIModule_init,
+    nullptr,
+    nullptr,
+    FastCGIModule_route,
+    true, // skips cache hits, only scripts are theirs
+    nullptr
+};
+
+REGISTER_MODULE(FastCGIModule);
@@ -2,14 +2,33 @@
 #include <glog/logging.h>
 #include <folly/logging/xlog.h>
 #include <proxygen/lib/http/HTTPMessage.h>
+#include <proxygen/lib/http/HTTPCommonHeaders.h>
 #include <proxygen/httpserver/ResponseBuilder.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
-#include <iostream>
+#include <deque>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <folly/Conv.h>
+#include <folly/String.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventBase.h>
 
 #include <php.h>
 #include <main/SAPI.h>
@@ -17,14 +36,161 @@
 #include <main/php_variables.h>
 #include <zend_ini.h>
 
+#include "utils/config.h"
 #include "utils/defines.h"
+#include "utils/host_table.h"
+#include "utils/page_cache.h"
 #include "utils/utils.h"
+#include "utils/validators.h"
 
 using namespace ModuleManage;
 
-thread_local proxygen::HTTPHeaders tl_headers_response;
+// Shared by a job and its request. The request's timer cancels the job once it has answered for the
+// script; the worker then drops the job or stops the script at its next write. While the client takes no
+// more output the worker waits in its next flush, so a slow reader holds one buffer rather than the
+// whole page.
+struct PhpTicket {
+    std::atomic<bool> cancelled{false};
+    bool headers_sent = false; // EventBase only
+
+    std::mutex mutex;
+    std::condition_variable resumed;
+    bool paused = false;
+    bool closed = false; // cancelled or the request went away; nobody waits for output any more
+
+    void setPaused(bool value) {
+        {
+            std::lock_guard lock(mutex);
+            paused = value;
+        }
+        if (!value) resumed.notify_all();
+    }
+
+    void close() {
+        {
+            std::lock_guard lock(mutex);
+            closed = true;
+        }
+        resumed.notify_all();
+    }
+
+    void cancel() {
+        cancelled.store(true, std::memory_order_release);
+        close();
+    }
+
+    void waitWhilePaused() {
+        std::unique_lock lock(mutex);
+        resumed.wait(lock, [this] { return !paused || closed; });
+    }
+};
+
+// A PHP request as seen by a worker thread. The context is the worker's own copy of what the script may
+// read; output is coalesced here and handed to the request's EventBase a flush at a time.
+struct PhpJob {
+    ModuleContext context;
+    std::weak_ptr<ModuleContext> origin;
+    std::shared_ptr<PhpTicket> ticket;
+    folly::EventBase *event_base = nullptr;
+    std::chrono::steady_clock::time_point enqueued_at;
+
+    int status = 200;
+    bool failed = false; // answer with the error page for `status` instead of the script output
+    bool headers_flushed = false; // status and headers went out with an earlier flush
+    proxygen::HTTPHeaders headers;
+    folly::IOBufQueue output{folly::IOBufQueue::cacheChainLength()};
+
+    // Set while the response may still go into the page cache; the page collects what was sent.
+    std::optional<std::string> cache_key;
+    std::shared_ptr<Cache::Page> cache_page;
+    folly::IOBufQueue cache_body{folly::IOBufQueue::cacheChainLength()};
+};
+
+// One flush of a PHP response, applied on the request's EventBase. Flushes of a job are posted from a
+// single worker thread and therefore run in order.
+struct PhpOutput {
+    std::weak_ptr<ModuleContext> origin;
+    std::shared_ptr<PhpTicket> ticket;
+    int status = 200;
+    bool failed = false;
+    bool send_headers = false; // first flush: carries the status and headers
+    bool eom = false; // last flush
+    proxygen::HTTPHeaders headers;
+    std::unique_ptr<folly::IOBuf> body;
+};
+
+// Runs scripts on a fixed set of threads, each with its own TSRM context, so a slow script only ever
+// occupies a PHP worker and never an event loop. The queue is bounded; a full queue answers 503. The
+// timeout is kept by a timer on the request's loop, which answers 504 whether the job is still queued or
+// running, so a stuck queue never holds a client longer than that.
+class PhpWorkerPool {
+public:
+    PhpWorkerPool(unsigned workers, size_t max_queued, std::chrono::seconds timeout)
+        : max_queued_(max_queued), timeout_(timeout) {
+        threads_.reserve(workers);
+        for (unsigned i = 0; i < workers; ++i) {
+            threads_.emplace_back([this] { run(); });
+        }
+    }
+
+    ~PhpWorkerPool() {
+        stop();
+    }
+
+    bool submit(std::unique_ptr<PhpJob> job) {
+        {
+            std::lock_guard lock(mutex_);
+            if (stopping_ || queue_.size() >= max_queued_) {
+                return false;
+            }
+            job->enqueued_at = std::chrono::steady_clock::now();
+            queue_.push_back(std::move(job));
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto &thread: threads_) {
+            if (thread.joinable()) thread.join();
+        }
+        threads_.clear();
+    }
+
+    std::chrono::seconds timeout() const noexcept {
+        return timeout_;
+    }
+
+private:
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::unique_ptr<PhpJob> > queue_;
+    size_t max_queued_;
+    std::chrono::seconds timeout_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+static std::unique_ptr<PhpWorkerPool> php_pool;
+static std::unique_ptr<Cache::PageCache> page_cache;
+
+// Script output is copied into buffers of this size, so a loop of small echoes ends up in a few large
+// IOBufs rather than one per write.
+static constexpr size_t PHP_OUTPUT_CHUNK_SIZE = 16 * 1024;
+// Buffered output beyond this is streamed to the client without waiting for the script to finish; 0 only
+// streams on flush().
+static size_t php_flush_bytes = 64 * 1024;
+
+thread_local PhpJob *tl_job = nullptr;
 thread_local ModuleContext *tl_context = nullptr;
-thread_local size_t read_post_offset = 0;
+thread_local std::optional<Utils::RequestBody::Reader> tl_post_reader;
 
 static int wbsrv_php_startup(sapi_module_struct *sapi_module) {
     return php_module_startup(sapi_module, nullptr);
@@ -34,11 +200,37 @@ static int wbsrv_php_deactivate(void) {
     return SUCCESS;
 }
 
+static void flush_php_output(PhpJob &job, bool last);
+
 static size_t wbsrv_php_ub_write(const char *str, size_t str_length) {
-    tl_context->response->body(str);
+    PhpJob &job = *tl_job;
+    if (job.ticket->cancelled.load(std::memory_order_acquire)) {
+        php_handle_aborted_connection(); // the request timed out; ends the script unless it ignores aborts
+        return 0;
+    }
+    size_t remaining = str_length;
+    while (remaining > 0) {
+        const auto [data, room] = job.output.preallocate(1, PHP_OUTPUT_CHUNK_SIZE, PHP_OUTPUT_CHUNK_SIZE);
+        const size_t length = std::min(room, remaining);
+        std::memcpy(data, str, length);
+        job.output.postallocate(length);
+        str += length;
+        remaining -= length;
+    }
+
+    if (php_flush_bytes > 0 && job.output.chainLength() >= php_flush_bytes) {
+        flush_php_output(job, false);
+    }
     return str_length;
 }
 
+// flush() in a script: send what is buffered now.
+static void wbsrv_php_flush(void * /*server_context*/) {
+    if (tl_job) {
+        flush_php_output(*tl_job, false);
+    }
+}
+
 static int wbsrv_php_header_handler(sapi_header_struct *sapi_header,
                                     sapi_header_op_enum op,
                                     sapi_headers_struct *sapi_headers) {
@@ -53,27 +245,24 @@ static int wbsrv_php_header_handler(sapi_header_struct *sapi_header,
         return FAILURE;
     }
 
-    std::string_view header(start, colon - start);
+    const std::string name(start, colon - start);
     std::string_view value(colon + 1, end - (colon + 1));
+    while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
 
+    proxygen::HTTPHeaders &headers = tl_job->headers;
     switch (op) {
         case SAPI_HEADER_DELETE:
-            tl_headers_response.rawRemove(header.data());
+            headers.remove(name);
             break;
-        case SAPI_HEADER_ADD:
         case SAPI_HEADER_REPLACE:
-            // Remove existing header with the same name
-            tl_headers_response.removeByPredicate(
-                [header](proxygen::HTTPHeaderCode, const std::string &name, const std::string &) {
-                    if (name == header.data())
-                        return false;
-                    return true;
-                });
-
-            tl_headers_response.rawSet(header.data(), value.data());
+            headers.remove(name);
+            headers.add(name, std::string(value));
+            break;
+        case SAPI_HEADER_ADD:
+            headers.add(name, std::string(value));
             break;
         case SAPI_HEADER_DELETE_ALL:
-            tl_headers_response.removeAll();
+            headers.removeAll();
             break;
         default:
             return FAILURE;
@@ -83,73 +272,87 @@ static int wbsrv_php_header_handler(sapi_header_struct *sapi_header,
 }
 
 static size_t wbsrv_php_read_post(char *buffer, size_t count_bytes) {
-    if (!tl_context || !buffer || count_bytes == 0) {
+    if (!tl_post_reader || !buffer || count_bytes == 0) {
         return 0;
     }
+    return tl_post_reader->read(buffer, count_bytes);
+}
 
-    folly::fbstring body = tl_context->getRequestBody();
+// $_SERVER names for the headers proxygen knows by code ("HTTP_ACCEPT_ENCODING", ...), built once.
+static std::array<std::string, 256> header_variables;
+// The process environment as PHP would import it, captured at startup.
+static std::vector<std::pair<std::string, std::string> > environment_variables;
 
-    if (body.empty() || read_post_offset >= body.size()) {
-        return 0;
+static void header_variable_name(std::string_view header, std::string &name) {
+    name.assign("HTTP_");
+    for (const char c: header) {
+        name += c == '-' ? '_' : static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
     }
+}
 
-    size_t available = body.size() - read_post_offset;
-    size_t to_read = std::min(count_bytes, available);
-
-    std::memcpy(buffer, body.data() + read_post_offset, to_read);
-    read_post_offset += to_read;
+static void prepare_server_variables() {
+    for (uint64_t code = proxygen::HTTPHeaderCodeCommonOffset; code < proxygen::HTTPCommonHeaders::num_codes; ++code) {
+        if (const std::string *name = proxygen::HTTPCommonHeaders::getPointerToName(
+            static_cast<proxygen::HTTPHeaderCode>(code))) {
+            header_variable_name(*name, header_variables[code]);
+        }
+    }
 
-    return to_read;
+    for (char **entry = environ; *entry; ++entry) {
+        const std::string_view variable(*entry);
+        const size_t equals = variable.find('=');
+        if (equals == std::string_view::npos || equals == 0) continue;
+        environment_variables.emplace_back(variable.substr(0, equals), variable.substr(equals + 1));
+    }
 }
 
 void wbsrv_php_register_variables(zval *track_vars_array) {
     if (!track_vars_array || !tl_context || !tl_context->request) {
         return;
     }
+    const proxygen::HTTPMessage &request = *tl_context->request;
 
-    php_import_environment_variables(track_vars_array);
+    for (const auto &[name, value]: environment_variables) {
+        php_register_variable_safe(name.c_str(), value.data(), value.size(), track_vars_array);
+    }
 
-    std::string uri = tl_context->request->getURL();
-    std::string method = tl_context->request->getMethodString();
+    const folly::fbstring &document_root = tl_context->document_root;
+    php_register_variable_safe("DOCUMENT_ROOT", document_root.data(), document_root.size(), track_vars_array);
+    php_register_variable_safe("SERVER_SOFTWARE", ZEND_STRL("WBSRV"), track_vars_array);
 
-    php_register_variable("DOCUMENT_ROOT", tl_context->document_root.c_str(), track_vars_array);
-    php_register_variable("REQUEST_URI", uri.c_str(), track_vars_array);
-    php_register_variable("REQUEST_METHOD", method.c_str(), track_vars_array);
-    php_register_variable("SERVER_SOFTWARE", "WBSRV", track_vars_array);
-    php_register_variable("PHP_SELF", uri.c_str(), track_vars_array);
+    const std::string &uri = request.getURL();
+    const std::string &method = request.getMethodString();
+    php_register_variable_safe("REQUEST_URI", uri.data(), uri.size(), track_vars_array);
+    php_register_variable_safe("REQUEST_METHOD", method.data(), method.size(), track_vars_array);
+    php_register_variable_safe("PHP_SELF", uri.data(), uri.size(), track_vars_array);
 
-    size_t body_size = tl_context->getRequestBodySize();
-    php_register_variable("CONTENT_LENGTH", std::to_string(body_size).c_str(), track_vars_array);
+    char content_length[24];
+    const auto end = std::to_chars(std::begin(content_length), std::end(content_length),
+                                   tl_context->getRequestBodySize()).ptr;
+    php_register_variable_safe("CONTENT_LENGTH", content_length, end - content_length, track_vars_array);
 
-    // Handle headers
-    tl_context->request->getHeaders().forEachWithCode(
+    // Every header once; known headers use their precomputed name, others share one reused buffer.
+    thread_local std::string other_name;
+    request.getHeaders().forEachWithCode(
         [&](proxygen::HTTPHeaderCode code, const std::string &name, const std::string &value) {
             if (code == proxygen::HTTPHeaderCode::HTTP_HEADER_CONTENT_TYPE) {
-                php_register_variable("CONTENT_TYPE", value.c_str(), track_vars_array);
+                php_register_variable_safe("CONTENT_TYPE", value.data(), value.size(), track_vars_array);
             }
 
-            std::string var_name = name;
-            for (auto &c: var_name) {
-                if (c == '-') c = '_';
-                c = std::toupper(c);
+            const std::string *variable = &header_variables[code];
+            if (code == proxygen::HTTPHeaderCode::HTTP_HEADER_OTHER || variable->empty()) {
+                header_variable_name(name, other_name);
+                variable = &other_name;
             }
-            var_name = "HTTP_" + var_name;
-            php_register_variable(var_name.c_str(), value.c_str(), track_vars_array);
+            php_register_variable_safe(variable->c_str(), value.data(), value.size(), track_vars_array);
         });
-
-    // Handle custom headers
-    tl_context->request->getHeaders().forEach([&](const std::string &header, const std::string &value) {
-        std::string var_name = header;
-        for (auto &c: var_name) {
-            if (c == '-') c = '_';
-            c = std::toupper(c);
-        }
-        var_name = "HTTP_" + var_name;
-        php_register_variable(var_name.c_str(), value.c_str(), track_vars_array);
-    });
 }
 
 static int wbsrv_php_send_headers(sapi_headers_struct *sapi_headers) {
+    // PHP calls this right before the first output; the status is final from here on.
+    if (tl_job && sapi_headers->http_response_code != 0) {
+        tl_job->status = sapi_headers->http_response_code;
+    }
     return SAPI_HEADER_SENT_SUCCESSFULLY;
 }
 
@@ -164,21 +367,18 @@ static char *wbsrv_php_sapi_getenv(const char *name, size_t name_len) {
 }
 
 static char *wbsrv_php_read_cookies() {
-    std::string cookie_header;
-    if (tl_context->request->getHeaders().exists("Cookie")) {
-        cookie_header = tl_context->request->getHeaders().getSingleOrEmpty("Cookie");
-    }
-
+    const std::string &cookie_header =
+            tl_context->request->getHeaders().getSingleOrEmpty(proxygen::HTTP_HEADER_COOKIE);
     if (cookie_header.empty()) {
         return nullptr;
     }
 
-    return estrdup(cookie_header.c_str());
+    return estrndup(cookie_header.data(), cookie_header.size());
 }
 
 // PHP SAPI module definition
 SAPI_API sapi_module_struct php_embed_module = {
-    "PHP Module", /* name */
+    "embed", /* name */
     "PHP Module for WBSRV", /* pretty name */
 
     wbsrv_php_startup, /* startup */
@@ -188,7 +388,7 @@ SAPI_API sapi_module_struct php_embed_module = {
     wbsrv_php_deactivate, /* deactivate */
 
     wbsrv_php_ub_write, /* unbuffered write */
-    nullptr, /* flush */
+    wbsrv_php_flush, /* flush */
     nullptr, /* get uid */
     wbsrv_php_sapi_getenv, /* getenv */
 
@@ -209,7 +409,7 @@ SAPI_API sapi_module_struct php_embed_module = {
     STANDARD_SAPI_MODULE_PROPERTIES
 };
 
-inline bool isPhpFile(const folly::fbstring &path) {
+inline bool isPhpFile(folly::StringPiece path) {
     size_t len = path.length();
     return len >= 4 &&
            path[len - 4] == '.' &&
@@ -218,35 +418,235 @@ inline bool isPhpFile(const folly::fbstring &path) {
            path[len - 1] == 'p';
 }
 
+static std::string php_ini_entries;
+static std::string php_preload_script; // generated when several hosts preload; removed after startup
+
+// Single quoted PHP string literal.
+static std::string php_quote(folly::StringPiece value) {
+    std::string quoted = "'";
+    for (const char c: value) {
+        if (c == '\'' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "'";
+}
+
+// opcache.preload takes a single script. Hosts preloading different ones get a generated script that
+// requires each in turn.
+static std::string preload_script(const Config::ServerConfig &config) {
+    std::vector<std::string> scripts;
+    for (const auto &[name, host]: Config::virtual_hosts) {
+        if (!host.php_preload.empty() && std::ranges::find(scripts, host.php_preload) == scripts.end()) {
+            scripts.push_back(host.php_preload);
+        }
+    }
+    if (scripts.size() <= 1) {
+        return scripts.empty() ? std::string() : scripts.front();
+    }
+
+    std::string path = config.request_body_temp_dir + "/wbsrv-preload-XXXXXX.php";
+    const int fd = mkostemps(path.data(), 4, O_CLOEXEC);
+    if (fd < 0) {
+        XLOG(WARN) << "Can't create the combined preload script, preloading " << scripts.front() << " only";
+        return scripts.front();
+    }
+    std::string source = "<?php\n";
+    for (const auto &script: scripts) {
+        source += "require_once " + php_quote(script) + ";\n";
+    }
+    const bool written = write(fd, source.data(), source.size()) == static_cast<ssize_t>(source.size());
+    close(fd);
+    if (!written) {
+        unlink(path.c_str());
+        return scripts.front();
+    }
+    php_preload_script = path;
+    return path;
+}
+
+static bool single_threaded() {
+    struct stat task;
+    return stat("/proc/self/task", &task) == 0 && task.st_nlink == 3; // ".", ".." and the main thread
+}
+
+// INI settings handed to the engine before startup: one OPcache in shared memory for all workers,
+// optionally with the JIT, plus the hosts' preload scripts. Scripts below the document roots are
+// invalidated by the file watcher, so timestamps are only revalidated as a fallback for the rest.
+static std::string php_ini(const Config::ServerConfig &config) {
+    std::string ini;
+    if (!config.php_extension_dir.empty()) {
+        ini += "extension_dir=" + config.php_extension_dir + "\n";
+    }
+    if (!config.php_opcache) {
+        return ini;
+    }
+
+#if PHP_VERSION_ID < 80500
+    ini += "zend_extension=opcache\n";
+#endif
+    // OPcache treats SAPIs that are not one of the web servers it knows like the CLI.
+    ini += "opcache.enable=1\n";
+    ini += "opcache.enable_cli=1\n";
+    ini += "opcache.memory_consumption=" + std::to_string(config.php_opcache_memory_mb) + "\n";
+    ini += "opcache.interned_strings_buffer=16\n";
+    ini += "opcache.max_accelerated_files=20000\n";
+    ini += "opcache.validate_timestamps=1\n";
+    ini += std::string("opcache.revalidate_freq=") + (config.watch_files ? "60" : "2") + "\n";
+    ini += "opcache.jit=" + config.php_jit + "\n";
+    if (config.php_jit != "disable" && config.php_jit != "off" && config.php_jit != "0") {
+        ini += "opcache.jit_buffer_size=" + std::to_string(config.php_jit_buffer_mb) + "M\n";
+    }
+
+    const std::string preload = preload_script(config);
+    if (!preload.empty()) {
+        // With preload_user OPcache forks to preload as that user, which only a single-threaded process
+        // can do safely; PHPModule_init runs before the server starts any thread.
+        if (!config.php_preload_user.empty() && !single_threaded()) {
+            XLOG(ERR) << "Not preloading PHP: threads are already running, so OPcache can't fork for "
+                    << "php_preload_user";
+            if (!php_preload_script.empty()) {
+                unlink(php_preload_script.c_str());
+                php_preload_script.clear();
+            }
+            return ini;
+        }
+        ini += "opcache.preload=" + preload + "\n";
+        if (!config.php_preload_user.empty()) {
+            ini += "opcache.preload_user=" + config.php_preload_user + "\n";
+        }
+    }
+    return ini;
+}
+
+// Scripts changed on disk. OPcache's shared memory is common to all workers, so the next worker to start
+// a request invalidates them once for everybody.
+static std::mutex opcache_mutex;
+static std::vector<std::string> opcache_stale;
+static bool opcache_reset_pending = false;
+static std::atomic<bool> opcache_dirty{false};
+
+static void PHPModule_file_changed(const std::string &path) {
+    if (!path.empty() && !isPhpFile(path)) {
+        return;
+    }
+    // Any script may contribute to any page.
+    if (page_cache) {
+        page_cache->clear();
+    }
+    {
+        std::lock_guard lock(opcache_mutex);
+        if (path.empty()) {
+            opcache_reset_pending = true;
+            opcache_stale.clear();
+        } else if (!opcache_reset_pending) {
+            opcache_stale.push_back(path);
+        }
+    }
+    opcache_dirty.store(true, std::memory_order_release);
+}
+
+// Runs on a worker inside a request.
+static void invalidate_stale_scripts() {
+    if (!opcache_dirty.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    std::vector<std::string> stale;
+    bool reset;
+    {
+        std::lock_guard lock(opcache_mutex);
+        stale.swap(opcache_stale);
+        reset = std::exchange(opcache_reset_pending, false);
+    }
+    if (!zend_hash_str_exists(CG(function_table), ZEND_STRL("opcache_invalidate"))) {
+        return; // OPcache is disabled or failed to load
+    }
+
+    zval function, result;
+    if (reset) {
+        ZVAL_STRING(&function, "opcache_reset");
+        call_user_function(CG(function_table), nullptr, &function, &result, 0, nullptr);
+        zval_ptr_dtor(&result);
+        zval_ptr_dtor(&function);
+        return;
+    }
+
+    ZVAL_STRING(&function, "opcache_invalidate");
+    for (const auto &path: stale) {
+        zval params[2];
+        ZVAL_STRINGL(&params[0], path.data(), path.size());
+        ZVAL_TRUE(&params[1]);
+        call_user_function(CG(function_table), nullptr, &function, &result, 2, params);
+        zval_ptr_dtor(&params[0]);
+        zval_ptr_dtor(&result);
+    }
+    zval_ptr_dtor(&function);
+}
+
 static bool PHPModule_init() {
-    php_tsrm_startup_ex(3);
+    const Config::ServerConfig *config = Config::server_config;
+    unsigned workers = config ? config->php_workers : 0;
+    if (workers == 0) {
+        workers = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    php_tsrm_startup_ex(static_cast<int>(workers) + 1);
     zend_signal_startup();
     sapi_startup(&php_embed_module);
 
-    if (php_embed_module.startup(&php_embed_module) == FAILURE) {
+    prepare_server_variables();
+
+    if (config) {
+        php_ini_entries = php_ini(*config);
+        php_embed_module.ini_entries = php_ini_entries.data();
+    }
+
+    const bool started = php_embed_module.startup(&php_embed_module) != FAILURE;
+    if (!php_preload_script.empty()) {
+        unlink(php_preload_script.c_str());
+    }
+    if (!started) {
         return false;
     }
 
     PG(file_uploads) = 1;
     PG(enable_post_data_reading) = 1;
 
+    if (config) {
+        php_flush_bytes = config->php_flush_bytes;
+        if (config->php_cache_entries > 0) {
+            page_cache = std::make_unique<Cache::PageCache>(config->php_cache_entries,
+                                                            std::chrono::seconds(config->php_timeout_seconds));
+        }
+    }
+    php_pool = std::make_unique<PhpWorkerPool>(
+        workers,
+        config ? config->php_queue_size : 1024,
+        std::chrono::seconds(config ? config->php_timeout_seconds : 30));
+    XLOG(INFO) << "PHP worker pool started with " << workers << " threads";
+
     return true;
 }
 
 static void PHPModule_cleanup() {
+    // Workers release their TSRM resources before the engine goes away.
+    if (php_pool) {
+        php_pool->stop();
+        php_pool.reset();
+    }
     php_embed_module.shutdown(&php_embed_module);
     sapi_shutdown();
     tsrm_shutdown();
 }
 
-static ModuleResult PHPModule_pre_response(ModuleContext &ctx) {
-    if (!isPhpFile(ctx.file_path))
-        return ModuleResult::CONTINUE;
-
-
+// Runs on a worker thread.
+static void execute_php_job(PhpJob &job, std::chrono::seconds timeout) {
+    ModuleContext &ctx = job.context;
+    tl_job = &job;
     tl_context = &ctx;
-    read_post_offset = 0;
-    ts_resource(0);
+    if (ctx.hasRequestBody()) {
+        tl_post_reader.emplace(ctx.request_body);
+    }
 
     SG(server_context) = (void *) 1;
     SG(sapi_headers).http_response_code = 200;
@@ -272,44 +672,37 @@ static ModuleResult PHPModule_pre_response(ModuleContext &ctx) {
     SG(request_info).proto_num = 2000;
     SG(post_read) = 0;
 
-    if (php_request_startup() == FAILURE)
-        return ModuleResult::CONTINUE;
+    if (php_request_startup() == FAILURE) {
+        job.status = 500;
+        job.failed = true;
+        tl_job = nullptr;
+        tl_context = nullptr;
+        tl_post_reader.reset();
+        return;
+    }
 
+    invalidate_stale_scripts();
 
     // Execute PHP script
     zend_file_handle file_handle;
     zend_stream_init_filename(&file_handle, ctx.file_path.c_str());
 
-    bool execution_success = false;
     zend_try
         {
             CG(skip_shebang) = true;
+            // Per-thread execution timer (ZTS); the script dies with a fatal error when it runs out.
+            zend_set_timeout(std::max<zend_long>(timeout.count(), 1), 0);
             php_execute_script(&file_handle);
 
             // Get status code from PHP
-            int status_code = SG(sapi_headers).http_response_code;
-            if (status_code == 0) {
-                status_code = 200;
+            job.status = SG(sapi_headers).http_response_code;
+            if (job.status == 0) {
+                job.status = 200;
             }
-
-            ctx.response->status(status_code, proxygen::HTTPMessage::getDefaultReason(status_code));
-
-            tl_headers_response.forEach([&](const std::string &name, const std::string &value) {
-                ctx.response->header(name, value);
-            });
-
-            ctx.response->header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8");
-
-            ctx.response->sendWithEOM();
-
-            execution_success = true;
         }
     zend_catch {
-            ctx.response->status(STATUS_500)
-                    .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
-                    .body(Utils::getErrorPage(500))
-                    .sendWithEOM();
-            execution_success = false;
+            job.status = 500;
+            job.failed = true;
         }
     zend_end_try();
 
@@ -317,27 +710,405 @@ static ModuleResult PHPModule_pre_response(ModuleContext &ctx) {
     zend_destroy_file_handle(&file_handle);
     php_request_shutdown(nullptr);
 
+    tl_job = nullptr;
+    tl_context = nullptr;
+    tl_post_reader.reset();
+}
+
+// Runs on the request's EventBase. Without a Content-Length the codec frames a streamed body as chunked;
+// a response that fits in a single flush is sent with its length.
+static void deliver_php_output(PhpOutput &output) {
+    const auto ctx = output.origin.lock();
+    if (!ctx || output.ticket->cancelled.load(std::memory_order_relaxed)) {
+        return; // the client went away while the script ran, or the timeout answered for it
+    }
+    if (output.eom) {
+        ctx->close_listener = nullptr; // disarms the timeout
+        ctx->egress_listener = nullptr;
+    }
+    output.ticket->headers_sent = true;
+
+    if (output.failed) {
+        if (output.send_headers) {
+            ctx->response->status(output.status, proxygen::HTTPMessage::getDefaultReason(output.status))
+                    .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
+                    .body(Utils::getErrorPage(output.status))
+                    .sendWithEOM();
+        } else {
+            // Part of the page is already out. Ending it normally would pass the truncated page off as
+            // complete, to the client and to any cache in between.
+            XLOG(WARN) << "PHP script failed after streaming output: " << ctx->file_path;
+            ctx->response->rejectUpstream();
+        }
+        return;
+    }
+
+    if (output.send_headers) {
+        ctx->response->status(output.status, proxygen::HTTPMessage::getDefaultReason(output.status));
+        output.headers.forEach([&](const std::string &name, const std::string &value) {
+            ctx->response->header(name, value);
+        });
+        if (!output.headers.exists(proxygen::HTTP_HEADER_CONTENT_TYPE)) {
+            ctx->response->header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8");
+        }
+    }
+    if (output.body) {
+        ctx->response->body(std::move(output.body));
+    }
+    if (output.eom) {
+        ctx->response->sendWithEOM();
+    } else {
+        ctx->response->send();
+    }
+}
+
+// Runs on a worker thread: hands the buffered output to the request's EventBase.
+static void drop_page_capture(PhpJob &job) {
+    page_cache->abandon(*job.cache_key);
+    job.cache_key.reset();
+    job.cache_page.reset();
+    job.cache_body.reset();
+}
 
-    return (execution_success ? ModuleResult::BREAK : ModuleResult::CONTINUE);
+// Keeps a reference to everything sent so the page can be stored once the script is done.
+static void capture_page(PhpJob &job) {
+    if (!job.cache_page) {
+        job.cache_page = std::make_shared<Cache::Page>();
+        job.cache_page->status = static_cast<uint16_t>(job.status);
+        job.cache_page->headers = job.headers;
+    }
+    if (!job.output.empty()) {
+        job.cache_body.append(job.output.front()->clone());
+        if (job.cache_body.chainLength() > Config::server_config->php_cache_max_object_bytes) {
+            drop_page_capture(job);
+        }
+    }
 }
 
-static ModuleResult PHPModule_post_response(ModuleContext &ctx) {
-    tl_context = nullptr;
-    read_post_offset = 0;
+static void flush_php_output(PhpJob &job, bool last) {
+    if (!last && job.output.empty()) {
+        return;
+    }
+    if (job.cache_key) {
+        capture_page(job);
+    }
+    if (job.origin.expired() || job.ticket->cancelled.load(std::memory_order_acquire)) {
+        job.output.reset(); // nobody to send it to; keep the script's memory bounded
+        return;
+    }
+
+    auto output = std::make_unique<PhpOutput>();
+    output->origin = job.origin;
+    output->ticket = job.ticket;
+    output->status = job.status;
+    output->failed = job.failed;
+    output->send_headers = !job.headers_flushed;
+    output->eom = last;
+    if (output->send_headers) {
+        output->headers = std::move(job.headers);
+        job.headers_flushed = true;
+    }
+    // An error page replaces the output unless part of the page is already out.
+    if (!job.output.empty() && !(job.failed && output->send_headers)) {
+        output->body = job.output.move();
+    }
+
+    job.event_base->runInEventBaseThread([output = std::move(output)] {
+        deliver_php_output(*output);
+    });
+    if (!last) {
+        job.ticket->waitWhilePaused();
+    }
+}
+
+// How long a response may be cached according to its own headers; false when it must not be. Without
+// Cache-Control or Expires the configured TTL and grace period apply.
+static bool page_lifetime(const proxygen::HTTPHeaders &headers, std::chrono::seconds &ttl,
+                          std::chrono::seconds &stale) {
+    const Config::ServerConfig &config = *Config::server_config;
+    ttl = std::chrono::seconds(config.php_cache_ttl_seconds);
+    stale = std::chrono::seconds(config.php_cache_stale_seconds);
+
+    if (headers.exists(proxygen::HTTP_HEADER_SET_COOKIE)) {
+        return false;
+    }
+
+    bool explicit_ttl = false;
+    bool shared_ttl = false;
+    bool revalidate = false;
+    const std::string &cache_control = headers.combine(proxygen::HTTP_HEADER_CACHE_CONTROL);
+    folly::StringPiece directives(cache_control);
+    while (!directives.empty()) {
+        const size_t comma = directives.find(',');
+        const folly::StringPiece directive = folly::trimWhitespace(directives.subpiece(0, comma));
+        directives = comma == folly::StringPiece::npos ? folly::StringPiece() : directives.subpiece(comma + 1);
+
+        const size_t equals = directive.find('=');
+        const folly::StringPiece name = directive.subpiece(0, equals);
+        std::optional<int64_t> seconds;
+        if (equals != folly::StringPiece::npos) {
+            if (const auto value = folly::tryTo<int64_t>(directive.subpiece(equals + 1)); value) {
+                seconds = *value;
+            }
+        }
+
+        if (name.equals("no-store", folly::AsciiCaseInsensitive()) ||
+            name.equals("no-cache", folly::AsciiCaseInsensitive()) ||
+            name.equals("private", folly::AsciiCaseInsensitive())) {
+            return false;
+        }
+        if (name.equals("must-revalidate", folly::AsciiCaseInsensitive()) ||
+            name.equals("proxy-revalidate", folly::AsciiCaseInsensitive())) {
+            revalidate = true; // never served once stale
+        }
+        if (seconds && *seconds >= 0) {
+            if (name.equals("s-maxage", folly::AsciiCaseInsensitive())) {
+                ttl = std::chrono::seconds(*seconds);
+                explicit_ttl = shared_ttl = true;
+            } else if (name.equals("max-age", folly::AsciiCaseInsensitive()) && !shared_ttl) {
+                ttl = std::chrono::seconds(*seconds);
+                explicit_ttl = true;
+            } else if (name.equals("stale-while-revalidate", folly::AsciiCaseInsensitive())) {
+                stale = std::chrono::seconds(*seconds);
+            }
+        }
+    }
+
+    if (!explicit_ttl && headers.exists(proxygen::HTTP_HEADER_EXPIRES)) {
+        const auto expires = Validators::parseHttpDate(headers.getSingleOrEmpty(proxygen::HTTP_HEADER_EXPIRES));
+        if (!expires) {
+            return false; // an invalid date means already expired
+        }
+        ttl = std::chrono::seconds(*expires - std::chrono::duration_cast<std::chrono::seconds>(
+                                       std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+    if (ttl.count() <= 0) {
+        return false;
+    }
+    if (revalidate) {
+        stale = std::chrono::seconds(0);
+    }
+
+    // The key only covers the configured request headers.
+    const std::string &vary = headers.combine(proxygen::HTTP_HEADER_VARY);
+    folly::StringPiece fields(vary);
+    while (!fields.empty()) {
+        const size_t comma = fields.find(',');
+        const folly::StringPiece field = folly::trimWhitespace(fields.subpiece(0, comma));
+        fields = comma == folly::StringPiece::npos ? folly::StringPiece() : fields.subpiece(comma + 1);
+        if (!field.empty() && std::ranges::none_of(config.php_cache_vary_headers, [&](const std::string &header) {
+            return field.equals(header, folly::AsciiCaseInsensitive());
+        })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void store_page(PhpJob &job) {
+    std::chrono::seconds ttl, stale;
+    const uint16_t status = job.cache_page->status;
+    if (job.failed || (status != 200 && status != 301 && status != 404) ||
+        !page_lifetime(job.cache_page->headers, ttl, stale)) {
+        drop_page_capture(job);
+        return;
+    }
+
+    if (!job.cache_body.empty()) {
+        auto body = job.cache_body.move();
+        body->coalesce(); // one buffer per page instead of pinning the partly used output chunks
+        job.cache_page->body = std::move(body);
+    }
+    page_cache->set(*job.cache_key, std::move(job.cache_page), ttl, stale);
+    job.cache_key.reset();
+}
+
+void PhpWorkerPool::run() {
+    ts_resource(0);
+
+    for (;;) {
+        std::unique_ptr<PhpJob> job;
+        {
+            std::unique_lock lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_) break;
+            job = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        // Abandoned or timed out while it queued; in the latter case the timer answers, if it has not yet.
+        const auto waited = std::chrono::steady_clock::now() - job->enqueued_at;
+        if (job->origin.expired() || job->ticket->cancelled.load(std::memory_order_acquire) || waited >= timeout_) {
+            if (job->cache_key) drop_page_capture(*job);
+            continue;
+        }
+
+        execute_php_job(*job, std::chrono::duration_cast<std::chrono::seconds>(timeout_ - waited));
+
+        flush_php_output(*job, true);
+        if (job->cache_key) {
+            store_page(*job);
+        }
+    }
+
+    ts_free_thread();
+}
+
+// Page cache key: virtual host, URL and the configured request headers and cookies, each followed by a
+// NUL. Only GET and HEAD requests without credentials are looked up, and only while every cookie they send
+// is one the key covers: any other cookie may be a session the page is generated for.
+static std::optional<std::string> page_cache_key(const ModuleContext &ctx) {
+    const proxygen::HTTPMessage &request = *ctx.request;
+    const auto method = request.getMethod();
+    if ((method != proxygen::HTTPMethod::GET && method != proxygen::HTTPMethod::HEAD) ||
+        request.getHeaders().exists(proxygen::HTTP_HEADER_AUTHORIZATION)) {
+        return std::nullopt;
+    }
+
+    const Config::ServerConfig &config = *Config::server_config;
+    std::vector<std::optional<folly::StringPiece> > cookie_values(config.php_cache_vary_cookies.size());
+    const std::string &cookies = request.getHeaders().combine(proxygen::HTTP_HEADER_COOKIE, "; ");
+    folly::StringPiece remaining(cookies);
+    while (!remaining.empty()) {
+        const size_t semicolon = remaining.find(';');
+        const folly::StringPiece cookie = folly::trimWhitespace(remaining.subpiece(0, semicolon));
+        remaining = semicolon == folly::StringPiece::npos ? folly::StringPiece() : remaining.subpiece(semicolon + 1);
+        if (cookie.empty()) continue;
+
+        const size_t equals = cookie.find('=');
+        const folly::StringPiece name = folly::trimWhitespace(cookie.subpiece(0, equals));
+        const auto it = std::ranges::find_if(config.php_cache_vary_cookies, [&](const std::string &vary) {
+            return name == folly::StringPiece(vary);
+        });
+        if (it == config.php_cache_vary_cookies.end()) {
+            return std::nullopt;
+        }
+        cookie_values[it - config.php_cache_vary_cookies.begin()] =
+                equals == folly::StringPiece::npos ? folly::StringPiece() : cookie.subpiece(equals + 1);
+    }
+
+    std::string key;
+    const auto append = [&](folly::StringPiece value) {
+        key.append(value.data(), value.size());
+        key += '\0';
+    };
+    append(ctx.document_root);
+    // Normalized as for routing, so "Example.com" and "example.com:80" share a page. The local port
+    // stands in for the one stripped, as pages may differ between listeners (http and https).
+    char host_buffer[Routing::HostTable::MAX_NAME_LENGTH];
+    append(Routing::HostTable::normalize(request.getHeaders().getSingleOrEmpty(proxygen::HTTP_HEADER_HOST),
+                                         host_buffer));
+    append(folly::to<std::string>(request.getDstAddress().getPort()));
+    append(request.getURL());
+    for (const auto &header: config.php_cache_vary_headers) {
+        append(request.getHeaders().combine(header));
+    }
+    for (const auto &value: cookie_values) {
+        // A missing cookie and an empty one are told apart.
+        key += value ? '=' : '-';
+        append(value.value_or(folly::StringPiece()));
+    }
+    return key;
+}
 
-    return ModuleResult::CONTINUE;
+static void serve_page(ModuleContext &ctx, const Cache::Page &page) {
+    ctx.response->status(page.status, proxygen::HTTPMessage::getDefaultReason(page.status));
+    page.headers.forEach([&](const std::string &name, const std::string &value) {
+        ctx.response->header(name, value);
+    });
+    if (ctx.request->getMethod() == proxygen::HTTPMethod::HEAD) {
+        ctx.response->header(proxygen::HTTP_HEADER_CONTENT_LENGTH,
+                             page.body ? page.body->computeChainDataLength() : 0);
+    } else if (page.body) {
+        ctx.response->body(page.body->clone());
+    }
+    ctx.response->sendWithEOM();
+}
+
+static ModuleResult PHPModule_pre_response(ModuleContext &ctx) {
+    if (!isPhpFile(ctx.file_path))
+        return ModuleResult::CONTINUE;
+
+    std::optional<std::string> cache_key;
+    if (page_cache && (cache_key = page_cache_key(ctx))) {
+        const auto cached = page_cache->get(*cache_key);
+        const bool head = ctx.request->getMethod() == proxygen::HTTPMethod::HEAD;
+        if (cached && (!cached->refresh || head)) {
+            if (cached->refresh) {
+                page_cache->abandon(*cache_key); // a HEAD request has no body to refresh the page with
+            }
+            serve_page(ctx, *cached->page);
+            return ModuleResult::BREAK;
+        }
+        if (head) {
+            cache_key.reset();
+        }
+    }
+
+    // The worker gets its own copy; the handler's context stays on this loop.
+    auto job = std::make_unique<PhpJob>();
+    job->cache_key = cache_key;
+    job->context.request = std::make_unique<proxygen::HTTPMessage>(*ctx.request);
+    job->context.request_body = ctx.request_body;
+    job->context.document_root = ctx.document_root;
+    job->context.file_path = ctx.file_path;
+    job->origin = ctx.weak();
+    job->ticket = std::make_shared<PhpTicket>();
+    job->event_base = ctx.event_base;
+
+    auto ticket = job->ticket;
+    if (!php_pool || !php_pool->submit(std::move(job))) {
+        XLOG(WARN) << "PHP queue full, rejecting " << ctx.file_path;
+        if (cache_key) {
+            page_cache->abandon(*cache_key);
+        }
+        ctx.response->status(503, proxygen::HTTPMessage::getDefaultReason(503))
+                .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
+                .body(Utils::getErrorPage(503))
+                .sendWithEOM();
+        return ModuleResult::BREAK;
+    }
+
+    // The timer lives as long as the listener: until the last flush is delivered or the request goes away.
+    auto timeout = folly::AsyncTimeout::make(*ctx.event_base, [&ctx, ticket]() noexcept {
+        ticket->cancel();
+        XLOG(WARN) << "PHP request timed out: " << ctx.file_path;
+        if (ticket->headers_sent) {
+            ctx.response->rejectUpstream(); // part of the page is out; the client must not take it as whole
+            return;
+        }
+        ctx.response->status(504, proxygen::HTTPMessage::getDefaultReason(504))
+                .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
+                .body(Utils::getErrorPage(504))
+                .sendWithEOM();
+    });
+    timeout->scheduleTimeout(std::chrono::duration_cast<std::chrono::milliseconds>(php_pool->timeout()));
+    ctx.close_listener = [ticket, timeout = std::move(timeout)] {
+        ticket->close();
+    };
+    ticket->setPaused(ctx.egress_paused);
+    ctx.egress_listener = [ticket](bool paused) {
+        ticket->setPaused(paused);
+    };
+
+    // The response is streamed by flush_php_output() from the worker running the script.
+    return ModuleResult::BREAK;
 }
 
 static Module PHPModule = {
     "PHPModule",
     "2.0.0",
-    0, //
+    10, // after FastCGIModule, which takes the extensions it is configured for
     true, // enabled
     nullptr,
     PHPModule_pre_response,
-    PHPModule_post_response,
+    nullptr,
     PHPModule_init,
-    PHPModule_cleanup
+    PHPModule_cleanup,
+    PHPModule_file_changed,
+    nullptr,
+    true, // skips cache hits, only scripts are theirs
+    nullptr
 };
 
 REGISTER_MODULE(PHPModule);
@@ -0,0 +1,629 @@
+#include "server/module.h"
+#include <folly/logging/xlog.h>
+#include <proxygen/lib/http/HTTPConnector.h>
+#include <proxygen/lib/http/HTTPMessage.h>
+#include <proxygen/lib/http/connpool/SessionPool.h>
+#include <proxygen/lib/http/session/HTTPTransaction.h>
+#include <proxygen/lib/http/session/HTTPUpstreamSession.h>
+#include <proxygen/httpserver/ResponseBuilder.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <folly/SocketAddress.h>
+#include <folly/String.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/io/async/EventBaseLocal.h>
+
+#include "utils/config.h"
+#include "utils/utils.h"
+
+using namespace ModuleManage;
+
+static constexpr std::chrono::milliseconds PROXY_CONNECT_TIMEOUT(5000);
+// Idle keep-alive sessions are closed after this long.
+static constexpr std::chrono::seconds PROXY_IDLE_TIMEOUT(60);
+// Points per upstream on a consistent-hash ring; more spread keys more evenly.
+static constexpr uint32_t PROXY_HASH_POINTS = 160;
+// Request body held while the upstream isn't taking it before the client is paused.
+static constexpr size_t PROXY_BODY_BUFFER = 64 * 1024;
+
+enum class Balance : uint8_t {
+    ROUND_ROBIN,
+    LEAST_CONN,
+    HASH,
+};
+
+// Shared by every event loop. The counters only steer balancing and health, so relaxed updates do.
+struct ProxyUpstream {
+    folly::SocketAddress address;
+    std::string name;
+    std::atomic<uint32_t> active{0}; // requests in flight
+    std::atomic<uint32_t> fails{0}; // consecutive failures
+    std::atomic<int64_t> down_until{0}; // steady_clock ticks
+};
+
+struct ProxyRoute {
+    std::string prefix;
+    std::vector<std::unique_ptr<ProxyUpstream> > upstreams;
+    Balance balance = Balance::ROUND_ROBIN;
+    std::string hash_header;
+    bool h2c = false;
+    std::vector<std::pair<uint64_t, uint32_t> > ring; // (point, upstream), sorted
+    std::atomic<uint64_t> next{0};
+};
+
+struct ProxyTable {
+    // By hash of the virtual host's "hostname:port" name; longest prefix first.
+    std::unordered_map<XXH64_hash_t, std::vector<std::unique_ptr<ProxyRoute> > > routes_by_host;
+};
+
+// Replaced as a whole on reload; a request keeps the table its route came from.
+static std::mutex proxy_table_mutex;
+static std::shared_ptr<ProxyTable> proxy_table;
+static std::atomic<uint64_t> proxy_table_generation{0};
+static thread_local std::shared_ptr<ProxyTable> tl_proxy_table;
+static thread_local uint64_t tl_proxy_table_generation = 0;
+
+static const std::shared_ptr<ProxyTable> &current_proxy_table() {
+    // Workers only take the lock after a publish; otherwise this is a single atomic load.
+    const uint64_t generation = proxy_table_generation.load(std::memory_order_acquire);
+    if (generation != tl_proxy_table_generation) {
+        std::lock_guard lock(proxy_table_mutex);
+        tl_proxy_table = proxy_table;
+        tl_proxy_table_generation = proxy_table_generation.load(std::memory_order_relaxed);
+    }
+    return tl_proxy_table;
+}
+
+static void publish_proxy_table(std::shared_ptr<ProxyTable> table) {
+    std::lock_guard lock(proxy_table_mutex);
+    proxy_table = std::move(table);
+    proxy_table_generation.fetch_add(1, std::memory_order_release);
+}
+
+static uint32_t proxy_idle_connections = 32;
+static std::chrono::milliseconds proxy_timeout(60000);
+static uint32_t proxy_max_fails = 3;
+static std::chrono::seconds proxy_fail_timeout(10);
+
+static int64_t now_ticks() {
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// Passive health: enough failures in a row take the upstream out of rotation for a while, any success
+// resets the count.
+static void report(ProxyUpstream &upstream, bool success) {
+    if (success) {
+        upstream.fails.store(0, std::memory_order_relaxed);
+        return;
+    }
+    if (upstream.fails.fetch_add(1, std::memory_order_relaxed) + 1 >= proxy_max_fails) {
+        upstream.fails.store(0, std::memory_order_relaxed);
+        upstream.down_until.store(
+            now_ticks() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(proxy_fail_timeout).count(),
+            std::memory_order_relaxed);
+        XLOG(WARN) << "Proxy upstream " << upstream.name << " failed " << proxy_max_fails
+                << " times in a row, skipping it for " << proxy_fail_timeout.count() << "s";
+    }
+}
+
+// An upstream not tried yet for this request, preferring those that are up. When all of them are down
+// they are tried anyway rather than failing the route outright.
+static ProxyUpstream *choose(ProxyRoute &route, uint64_t hash, const std::vector<bool> &tried) {
+    const size_t count = route.upstreams.size();
+    const int64_t now = now_ticks();
+
+    for (const bool only_up: {true, false}) {
+        const auto eligible = [&](size_t index) {
+            return !tried[index] &&
+                   (!only_up || route.upstreams[index]->down_until.load(std::memory_order_relaxed) <= now);
+        };
+
+        switch (route.balance) {
+            case Balance::ROUND_ROBIN: {
+                const uint64_t start = route.next.fetch_add(1, std::memory_order_relaxed);
+                for (size_t i = 0; i < count; ++i) {
+                    const size_t index = (start + i) % count;
+                    if (eligible(index)) return route.upstreams[index].get();
+                }
+                break;
+            }
+            case Balance::LEAST_CONN: {
+                ProxyUpstream *best = nullptr;
+                for (size_t index = 0; index < count; ++index) {
+                    if (!eligible(index)) continue;
+                    ProxyUpstream *upstream = route.upstreams[index].get();
+                    if (!best || upstream->active.load(std::memory_order_relaxed) <
+                                 best->active.load(std::memory_order_relaxed)) {
+                        best = upstream;
+                    }
+                }
+                if (best) return best;
+                break;
+            }
+            case Balance::HASH: {
+                // The first eligible point clockwise of the key; keys only move when their upstream does.
+                auto it = std::ranges::lower_bound(route.ring, std::make_pair(hash, uint32_t{0}));
+                for (size_t i = 0; i < route.ring.size(); ++i, ++it) {
+                    if (it == route.ring.end()) it = route.ring.begin();
+                    if (eligible(it->second)) return route.upstreams[it->second].get();
+                }
+                break;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Hop-by-hop headers apply to one connection only, including any the Connection header names.
+static void strip_hop_by_hop(proxygen::HTTPHeaders &headers) {
+    const std::string connection = headers.combine(proxygen::HTTP_HEADER_CONNECTION);
+    folly::StringPiece tokens(connection);
+    while (!tokens.empty()) {
+        const size_t comma = tokens.find(',');
+        const folly::StringPiece token = folly::trimWhitespace(tokens.subpiece(0, comma));
+        tokens = comma == folly::StringPiece::npos ? folly::StringPiece() : tokens.subpiece(comma + 1);
+        if (!token.empty()) {
+            headers.remove(token);
+        }
+    }
+    for (const auto code: {
+             proxygen::HTTP_HEADER_CONNECTION, proxygen::HTTP_HEADER_KEEP_ALIVE,
+             proxygen::HTTP_HEADER_PROXY_CONNECTION, proxygen::HTTP_HEADER_PROXY_AUTHORIZATION,
+             proxygen::HTTP_HEADER_TE, proxygen::HTTP_HEADER_TRAILER, proxygen::HTTP_HEADER_TRANSFER_ENCODING,
+             proxygen::HTTP_HEADER_UPGRADE
+         }) {
+        headers.remove(code);
+    }
+}
+
+// The keep-alive sessions of one EventBase, per upstream address, so that they survive a reload.
+struct ProxyPools {
+    std::unordered_map<std::string, std::unique_ptr<proxygen::SessionPool> > pools;
+
+    proxygen::SessionPool &get(const ProxyUpstream *upstream) {
+        auto &pool = pools[upstream->name];
+        if (!pool) {
+            pool = std::make_unique<proxygen::SessionPool>(nullptr, proxy_idle_connections, PROXY_IDLE_TIMEOUT);
+        }
+        return *pool;
+    }
+};
+
+static folly::EventBaseLocal<ProxyPools> proxy_pools;
+
+// One proxied request, from the ROUTE hook until both the client and the upstream are done with it. The
+// body streams both ways: the client's as it arrives, paused once the upstream falls behind by
+// PROXY_BODY_BUFFER, and the upstream's as it arrives, paused while the client isn't reading. Lives on
+// the request's EventBase and deletes itself.
+class ProxyRequest : public proxygen::HTTPTransactionHandler, public proxygen::HTTPConnector::Callback {
+public:
+    ProxyRequest(ModuleContext &ctx, std::shared_ptr<ProxyTable> table, ProxyRoute &route)
+        : ctx_(&ctx), table_(std::move(table)), route_(route), event_base_(ctx.event_base), request_(*ctx.request),
+          tried_(route.upstreams.size(), false) {
+        const proxygen::HTTPMessage &request = *ctx.request;
+        const auto method = request.getMethod();
+        idempotent_ = method == proxygen::HTTPMethod::GET || method == proxygen::HTTPMethod::HEAD ||
+                      method == proxygen::HTTPMethod::OPTIONS;
+        if (route.balance == Balance::HASH) {
+            const std::string &key = route.hash_header.empty()
+                                         ? request.getClientIP()
+                                         : request.getHeaders().getSingleOrEmpty(route.hash_header);
+            hash_ = Utils::computeXXH64Hash(key);
+        }
+
+        proxygen::HTTPHeaders &headers = request_.getHeaders();
+        strip_hop_by_hop(headers);
+        std::string forwarded_for = headers.combine(proxygen::HTTP_HEADER_X_FORWARDED_FOR);
+        forwarded_for += forwarded_for.empty() ? "" : ", ";
+        forwarded_for += request.getClientIP();
+        headers.set(proxygen::HTTP_HEADER_X_FORWARDED_FOR, forwarded_for);
+        headers.set(proxygen::HTTP_HEADER_X_FORWARDED_PROTO, request.isSecure() ? "https" : "http");
+        request_.setHTTPVersion(1, 1);
+
+        ctx.body_listener = [this](std::unique_ptr<folly::IOBuf> chunk) { onClientBody(std::move(chunk)); };
+        ctx.egress_listener = [this](bool paused) {
+            if (!txn_) return;
+            paused ? txn_->pauseIngress() : txn_->resumeIngress();
+        };
+        ctx.close_listener = [this] { onClientGone(); };
+    }
+
+    void start() {
+        const ProxyRoute &route = route_;
+        upstream_ = choose(route_, hash_, tried_);
+        if (!upstream_) {
+            XLOG(ERR) << "No proxy upstream left for " << request_.getURL() << " (" << route.prefix << ")";
+            fail(502);
+            return;
+        }
+        tried_[std::ranges::find_if(route.upstreams, [&](const auto &u) { return u.get() == upstream_; }) -
+               route.upstreams.begin()] = true;
+        upstream_->active.fetch_add(1, std::memory_order_relaxed);
+        counted_ = true;
+
+        proxygen::SessionPool &pool = proxy_pools.try_emplace(*event_base_).get(upstream_);
+        if (pool.getTransaction(this)) {
+            sendRequest();
+            return;
+        }
+
+        connector_ = std::make_unique<proxygen::HTTPConnector>(
+            this, proxygen::WheelTimerInstance(PROXY_CONNECT_TIMEOUT, event_base_));
+        if (route.h2c) {
+            connector_->setPlaintextProtocol("h2c");
+        }
+        connector_->connect(event_base_, upstream_->address, PROXY_CONNECT_TIMEOUT);
+    }
+
+    void connectSuccess(proxygen::HTTPUpstreamSession *session) override {
+        proxygen::SessionPool &pool = proxy_pools.try_emplace(*event_base_).get(upstream_);
+        pool.putSession(session);
+        if (!ctx_) {
+            release();
+            maybeDelete();
+            return;
+        }
+        if (!pool.getTransaction(this)) {
+            XLOG(WARN) << "Proxy upstream " << upstream_->name << " refused a new stream";
+            retryOrFail(502);
+            return;
+        }
+        sendRequest();
+    }
+
+    void connectError(const folly::AsyncSocketException &error) override {
+        XLOG(WARN) << "Can't connect to proxy upstream " << upstream_->name << ": " << error.what();
+        report(*upstream_, false);
+        if (!ctx_) {
+            release();
+            maybeDelete();
+            return;
+        }
+        // Nothing reached the upstream; any request may go to the next one.
+        retryOrFail(502, true);
+    }
+
+    void setTransaction(proxygen::HTTPTransaction *txn) noexcept override {
+        txn_ = txn;
+    }
+
+    void detachTransaction() noexcept override {
+        txn_ = nullptr;
+        if (retry_pending_) {
+            retry_pending_ = false;
+            // The client may have left while the failed transaction was winding down.
+            if (ctx_) {
+                start();
+                return;
+            }
+        }
+        release();
+        maybeDelete();
+    }
+
+    void onHeadersComplete(std::unique_ptr<proxygen::HTTPMessage> message) noexcept override {
+        const uint16_t status = message->getStatusCode();
+        if (status >= 100 && status < 200) {
+            return; // interim responses stay between us and the upstream
+        }
+        report(*upstream_, status < 502 || status > 504);
+        if (!ctx_) return;
+
+        strip_hop_by_hop(message->getHeaders());
+        ctx_->response->status(status, message->getStatusMessage());
+        message->getHeaders().forEach([&](const std::string &name, const std::string &value) {
+            ctx_->response->header(name, value);
+        });
+        ctx_->response->send();
+        headers_sent_ = true;
+    }
+
+    void onBody(std::unique_ptr<folly::IOBuf> chain) noexcept override {
+        if (ctx_) {
+            ctx_->response->body(std::move(chain)).send();
+        }
+    }
+
+    void onTrailers(std::unique_ptr<proxygen::HTTPHeaders> /*trailers*/) noexcept override {
+    }
+
+    void onEOM() noexcept override {
+        if (!ctx_) return;
+        finish()->response->sendWithEOM();
+        if (txn_ && !eom_sent_) {
+            // Answered before taking the whole request body (413 and the like); stop sending it.
+            txn_->sendAbort();
+        }
+    }
+
+    void onUpgrade(proxygen::UpgradeProtocol /*protocol*/) noexcept override {
+    }
+
+    void onError(const proxygen::HTTPException &error) noexcept override {
+        if (!ctx_) return;
+        report(*upstream_, false);
+        const bool timeout = error.getProxygenError() == proxygen::kErrorTimeout;
+        XLOG(WARN) << "Proxy upstream " << upstream_->name << (timeout ? " timed out" : " failed") << " on "
+                << request_.getURL() << ": " << error.what();
+
+        if (headers_sent_) {
+            // The client already has part of the response; make sure it doesn't take it for all of it.
+            finish()->downstream->sendAbort();
+            return;
+        }
+        // Retried once the failed transaction detaches.
+        if (!timeout && idempotent_ && !body_sent_ && hasUntried()) {
+            retry_pending_ = true;
+            release();
+            eom_sent_ = false;
+            return;
+        }
+        fail(timeout ? 504 : 502);
+    }
+
+    void onEgressPaused() noexcept override {
+        upstream_paused_ = true;
+    }
+
+    void onEgressResumed() noexcept override {
+        upstream_paused_ = false;
+        flushBody();
+    }
+
+private:
+    void sendRequest() {
+        txn_->setIdleTimeout(proxy_timeout);
+        txn_->sendHeaders(request_);
+        flushBody();
+    }
+
+    void onClientBody(std::unique_ptr<folly::IOBuf> chunk) {
+        if (chunk) {
+            body_.append(std::move(chunk));
+        } else {
+            body_complete_ = true;
+        }
+        flushBody();
+        if (ctx_ && !ingress_paused_ && body_.chainLength() >= PROXY_BODY_BUFFER) {
+            ctx_->downstream->pauseIngress();
+            ingress_paused_ = true;
+        }
+    }
+
+    void flushBody() {
+        if (!txn_ || upstream_paused_) return;
+        if (!body_.empty()) {
+            body_sent_ = true;
+            txn_->sendBody(body_.move());
+        }
+        if (body_complete_ && !eom_sent_) {
+            eom_sent_ = true;
+            txn_->sendEOM();
+        }
+        if (ctx_ && ingress_paused_) {
+            ctx_->downstream->resumeIngress();
+            ingress_paused_ = false;
+        }
+    }
+
+    bool hasUntried() const {
+        return std::ranges::find(tried_, false) != tried_.end();
+    }
+
+    void retryOrFail(int status, bool any_method = false) {
+        release();
+        connector_.reset();
+        if ((any_method || idempotent_) && hasUntried()) {
+            start();
+        } else {
+            fail(status);
+        }
+    }
+
+    void fail(int status) {
+        if (!ctx_) {
+            maybeDelete();
+            return;
+        }
+        finish()->response->status(status, proxygen::HTTPMessage::getDefaultReason(status))
+                .header(proxygen::HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8")
+                .body(Utils::getErrorPage(status))
+                .sendWithEOM();
+        if (txn_) {
+            txn_->sendAbort();
+        } else {
+            maybeDelete();
+        }
+    }
+
+    // The client side is complete; from here on only the upstream transaction may keep this alive. Returns
+    // the context for the final send, which may end the client's request on the spot and must come last.
+    ModuleContext *finish() {
+        ModuleContext *ctx = ctx_;
+        ctx->body_listener = nullptr;
+        ctx->egress_listener = nullptr;
+        ctx->close_listener = nullptr;
+        ctx_ = nullptr;
+        if (ingress_paused_) {
+            // Nobody reads the rest of the body any more; let it drain so the request can end.
+            ingress_paused_ = false;
+            ctx->downstream->resumeIngress();
+        }
+        return ctx;
+    }
+
+    void onClientGone() {
+        ctx_ = nullptr;
+        if (txn_) {
+            txn_->sendAbort(); // detaches, and that deletes
+            return;
+        }
+        connector_.reset();
+        release();
+        maybeDelete();
+    }
+
+    void release() {
+        if (counted_) {
+            upstream_->active.fetch_sub(1, std::memory_order_relaxed);
+            counted_ = false;
+        }
+    }
+
+    void maybeDelete() {
+        if (!ctx_ && !txn_ && !retry_pending_ && !(connector_ && connector_->isBusy())) {
+            delete this;
+        }
+    }
+
+    ModuleContext *ctx_;
+    std::shared_ptr<ProxyTable> table_; // keeps route_ alive across a reload
+    ProxyRoute &route_;
+    folly::EventBase *event_base_;
+    proxygen::HTTPMessage request_; // as sent upstream
+    std::vector<bool> tried_;
+    uint64_t hash_ = 0;
+    ProxyUpstream *upstream_ = nullptr;
+    std::unique_ptr<proxygen::HTTPConnector> connector_;
+    proxygen::HTTPTransaction *txn_ = nullptr;
+    folly::IOBufQueue body_{folly::IOBufQueue::cacheChainLength()}; // client body the upstream hasn't taken
+    bool idempotent_ = false;
+    bool counted_ = false; // included in upstream_->active
+    bool body_complete_ = false;
+    bool body_sent_ = false;
+    bool eom_sent_ = false;
+    bool upstream_paused_ = false;
+    bool ingress_paused_ = false;
+    bool headers_sent_ = false;
+    bool retry_pending_ = false;
+};
+
+// Builds the routes of Config::proxy_routes; nullptr when one of them is invalid.
+static std::shared_ptr<ProxyTable> build_proxy_table() {
+    auto table = std::make_shared<ProxyTable>();
+    for (const auto &[host, configured]: Config::proxy_routes) {
+        auto &routes = table->routes_by_host[Utils::computeXXH64Hash(host)];
+        for (const auto &item: configured) {
+            auto route = std::make_unique<ProxyRoute>();
+            route->prefix = item.prefix;
+            route->hash_header = item.hash_header;
+            route->h2c = item.protocol == "h2c";
+            if (item.balance == "least_conn") {
+                route->balance = Balance::LEAST_CONN;
+            } else if (item.balance == "hash") {
+                route->balance = Balance::HASH;
+            } else if (item.balance != "round_robin") {
+                XLOG(ERR) << "Unknown proxy balance " << item.balance << " for " << host << item.prefix;
+                return nullptr;
+            }
+
+            for (const auto &name: item.upstreams) {
+                auto upstream = std::make_unique<ProxyUpstream>();
+                upstream->name = name;
+                try {
+                    if (folly::StringPiece(name).startsWith("unix:")) {
+                        upstream->address.setFromPath(folly::StringPiece(name).subpiece(5));
+                    } else {
+                        upstream->address.setFromHostPort(name);
+                    }
+                } catch (const std::exception &e) {
+                    XLOG(ERR) << "Invalid proxy upstream " << name << ": " << e.what();
+                    return nullptr;
+                }
+                route->upstreams.push_back(std::move(upstream));
+            }
+            if (route->upstreams.empty()) {
+                XLOG(ERR) << "Proxy route " << host << item.prefix << " has no upstreams";
+                return nullptr;
+            }
+
+            if (route->balance == Balance::HASH) {
+                for (uint32_t index = 0; index < route->upstreams.size(); ++index) {
+                    for (uint32_t point = 0; point < PROXY_HASH_POINTS; ++point) {
+                        const std::string label = route->upstreams[index]->name + '#' + std::to_string(point);
+                        route->ring.emplace_back(Utils::computeXXH64Hash(label), index);
+                    }
+                }
+                std::ranges::sort(route->ring);
+            }
+            routes.push_back(std::move(route));
+        }
+        std::ranges::sort(routes, [](const auto &a, const auto &b) { return a->prefix.size() > b->prefix.size(); });
+        XLOG(INFO) << "Proxying " << routes.size() << " routes for " << host;
+    }
+    return table;
+}
+
+static bool ProxyModule_init() {
+    const Config::ServerConfig *config = Config::server_config;
+    if (config) {
+        proxy_idle_connections = static_cast<uint32_t>(config->proxy_connections);
+        proxy_timeout = std::chrono::seconds(config->proxy_timeout_seconds);
+        proxy_max_fails = std::max(config->proxy_max_fails, 1u);
+        proxy_fail_timeout = std::chrono::seconds(config->proxy_fail_timeout_seconds);
+    }
+
+    auto table = build_proxy_table();
+    if (!table) {
+        return false;
+    }
+    publish_proxy_table(std::move(table));
+    return true;
+}
+
+// Requests in flight finish on the old routes; upstream health starts over with the new ones.
+static void ProxyModule_config_reloaded() {
+    auto table = build_proxy_table();
+    if (!table) {
+        XLOG(ERR) << "Keeping the previous proxy routes";
+        return;
+    }
+    publish_proxy_table(std::move(table));
+}
+
+static ModuleResult ProxyModule_route(ModuleContext &ctx) {
+    const std::shared_ptr<ProxyTable> &table = current_proxy_table();
+    if (!table || table->routes_by_host.empty() || !ctx.vhost) {
+        return ModuleResult::CONTINUE;
+    }
+    const auto it = table->routes_by_host.find(Utils::computeXXH64Hash(ctx.vhost->name));
+    if (it == table->routes_by_host.end()) {
+        return ModuleResult::CONTINUE;
+    }
+
+    const folly::StringPiece path = ctx.request->getPathAsStringPiece();
+    for (const auto &route: it->second) {
+        if (path.startsWith(route->prefix)) {
+            (new ProxyRequest(ctx, table, *route))->start();
+            return ModuleResult::BREAK;
+        }
+    }
+    return ModuleResult::CONTINUE;
+}
+
+static Module ProxyModule = {
+    "ProxyModule",
+    "1.0.0",
+    0,
+    true, // enabled
+    nullptr,
+    nullptr,
+    nullptr,
+    ProxyModule_init,
+    nullptr,
+    nullptr,
+    ProxyModule_route,
+    false,
+    ProxyModule_config_reloaded
+};
+
+REGISTER_MODULE(ProxyModule);
@@ -1,192 +1,1106 @@
 #include "core.h"
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <folly/Conv.h>
+#include <folly/FileUtil.h>
+#include <folly/executors/GlobalExecutor.h>
+#include <folly/io/Cursor.h>
 #include <folly/logging/xlog.h>
 #include <proxygen/httpserver/ResponseBuilder.h>
-#include <folly/executors/GlobalExecutor.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "file_io.h"
 #include "utils/defines.h"
+#include "utils/route_index.h"
 #include "utils/utils.h"
+#include "utils/validators.h"
 
 using namespace proxygen;
 
+namespace {
+    // One per worker, each on a cache line of its own, so counting a request never leaves the thread.
+    struct alignas(64) RequestCounter {
+        std::atomic<size_t> count{0};
+    };
+
+    std::mutex g_request_counters_mutex;
+    std::vector<std::unique_ptr<RequestCounter> > g_request_counters;
+}
+
+std::atomic<size_t> &ServerHandler::requestCounter() {
+    thread_local RequestCounter *counter = [] {
+        std::lock_guard lock(g_request_counters_mutex);
+        g_request_counters.push_back(std::make_unique<RequestCounter>());
+        return g_request_counters.back().get();
+    }();
+    return counter->count;
+}
+
+size_t requestsInFlight() {
+    size_t total = 0;
+    std::lock_guard lock(g_request_counters_mutex);
+    for (const auto &counter: g_request_counters) {
+        total += counter->count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+ServerHandler::~ServerHandler() {
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    if (leading_) {
+        endFlight(false);
+    }
+    PathBuffers::give(std::move(ctx_.document_root));
+    PathBuffers::give(std::move(ctx_.file_path));
+}
+
+using HandlerBlocks = Utils::FreeList<sizeof(ServerHandler)>;
+
+void *ServerHandler::operator new(size_t size) {
+    return size == sizeof(ServerHandler) ? HandlerBlocks::allocate() : ::operator new(size);
+}
+
+void ServerHandler::operator delete(void *block) noexcept {
+    HandlerBlocks::deallocate(block);
+}
 
 void ServerHandler::onRequest(std::unique_ptr<HTTPMessage> message) noexcept {
     ctx_.request = std::move(message);
     event_base_ = folly::EventBaseManager::get()->getEventBase();
+    ctx_.event_base = event_base_;
 
-    const folly::StringPiece host_header = ctx_.request->getHeaders().getSingleOrEmpty(HTTP_HEADER_HOST);
-    const folly::StringPiece path_piece = ctx_.request->getPathAsStringPiece();
+    // Held for the whole request, so the host survives a reload that publishes a new table.
+    const Routing::HostTable *hosts = hosts_.acquire();
+    const Cache::VirtualHostConfig *vhost = hosts ? hosts->find(
+        ctx_.request->getHeaders().getSingleOrEmpty(HTTP_HEADER_HOST),
+        ctx_.request->getDstAddress().getPort()) : nullptr;
+    if (!vhost) {
+        sendNotFound();
+        return;
+    }
 
-    const XXH64_hash_t host_hash = Utils::computeXXH64Hash(host_header);
-    const auto vhost_it = host_config_cache_->find(host_hash);
-    if (vhost_it == host_config_cache_->end()) {
-        ResponseBuilder(downstream_)
-                .status(STATUS_404)
-                .body(Utils::getErrorPage(404))
-                .sendWithEOM();
+    ctx_.vhost = vhost;
+    ctx_.document_root = vhost->web_root_directory;
+
+    if (g_moduleSystem.has_hooks(ModuleManage::HookStage::ROUTE)) {
+        ctx_.response = std::make_unique<ResponseBuilder>(downstream_);
+        ctx_.downstream = downstream_;
+        const auto result = g_moduleSystem.execute_hooks(ModuleManage::HookStage::ROUTE, ctx_);
+        if (result == ModuleManage::ModuleResult::DEFER) [[unlikely]] {
+            deferHooks([this](ModuleManage::ModuleResult routed) { routeRequest(routed); });
+            return;
+        }
+        routeRequest(result);
         return;
     }
 
-    const folly::fbstring &doc_root = vhost_it->second.web_root_directory;
-    ctx_.document_root = doc_root;
+    mapRequest();
+}
+
+void ServerHandler::routeRequest(ModuleManage::ModuleResult result) {
+    if (result == ModuleManage::ModuleResult::BREAK) {
+        routed_ = true;
+        return;
+    }
+    ctx_.downstream = nullptr;
+    mapRequest();
+}
 
-    folly::fbstring full_path;
+// Maps the path below the document root to a file, resolving directories to their index page.
+void ServerHandler::mapRequest() {
+    const folly::fbstring &doc_root = ctx_.document_root;
+    const folly::StringPiece path_piece = ctx_.request->getPathAsStringPiece();
+
+    // Built in place, in whatever capacity the buffer was recycled with.
+    folly::fbstring &full_path = ctx_.file_path;
+    full_path.clear();
     full_path.reserve(doc_root.size() + path_piece.size());
     full_path.append(doc_root);
     full_path.append(path_piece.begin(), path_piece.end());
 
     if (!path_piece.empty() && path_piece.back() == '/') {
-        const XXH64_hash_t redirect_hash = Utils::computeXXH64Hash(doc_root, path_piece);
-        auto redirect_it = directory_redirect_cache_->find(redirect_hash);
-        if (redirect_it == directory_redirect_cache_->end()) {
-            ResponseBuilder(downstream_)
-                    .status(STATUS_404)
-                    .body(Utils::getErrorPage(404))
-                    .sendWithEOM();
+        full_path.pop_back();
+
+        const Routing::Index &index = Routing::current();
+        const auto *directory = index.find(full_path);
+        const folly::StringPiece index_page = directory ? index.indexPage(*directory) : folly::StringPiece();
+        if (!index_page.empty()) {
+            ctx_.file_path.assign(index_page.data(), index_page.size());
+        } else if (auto resolved = directory_cache_->get(full_path)) {
+            if (resolved->empty()) {
+                sendNotFound();
+                return;
+            }
+            ctx_.file_path = std::move(*resolved);
+        } else {
+            // Not known to the index (or it had no index page at scan time): look on disk.
+            auto lookup = std::make_shared<IndexLookup>();
+            lookup->directory = std::move(full_path);
+            lookup->index_pages = ctx_.vhost->index_page_files;
+            resolving_ = true;
+            resolveIndexPage(std::move(lookup));
             return;
         }
-        ctx_.file_path = redirect_it->second;
-    } else {
-        ctx_.file_path = std::move(full_path);
     }
 
-    g_moduleSystem.execute_hooks(ModuleManage::HookStage::PRE_REQUEST, ctx_);
+    dispatchRequest();
+}
+
+// A hook went asynchronous. The request, body and EOM included, waits until the stage resumes.
+void ServerHandler::deferHooks(folly::Function<void(ModuleManage::ModuleResult)> then) {
+    deferred_ = true;
+    downstream_->pauseIngress();
+    ctx_.resume_listener = [this, then = std::move(then)](ModuleManage::ModuleResult result) mutable {
+        deferred_ = false;
+        if (!spilling_) {
+            downstream_->resumeIngress();
+        }
+        then(result);
+        if (eom_received_ && !deferred_ && !resolving_) {
+            eom_received_ = false;
+            onEOM();
+        }
+    };
+}
+
+void ServerHandler::dispatchRequest() {
+    if (g_moduleSystem.execute_hooks(ModuleManage::HookStage::PRE_REQUEST, ctx_) ==
+        ModuleManage::ModuleResult::DEFER) [[unlikely]] {
+        deferHooks([this](ModuleManage::ModuleResult) { serveRequest(); });
+        return;
+    }
+    serveRequest();
+}
+
+void ServerHandler::serveRequest() {
+    cached_content_type_ = Utils::getContentType(ctx_.file_path);
 
     if (ctx_.request->getMethod() == HTTPMethod::GET) {
-        const XXH64_hash_t file_path_hash = Utils::computeXXH64Hash(ctx_.file_path);
-        auto cached_it = cache_->find(file_path_hash);
-        if (cached_it != cache_->end()) {
-            ctx_.response = std::make_unique<ResponseBuilder>(downstream_);
+        if (Compression::isCompressible(cached_content_type_)) {
+            compressible_ = true;
+            accepted_encodings_ = Compression::parseAcceptEncoding(
+                ctx_.request->getHeaders().getSingleOrEmpty(HTTP_HEADER_ACCEPT_ENCODING));
+        }
 
-            g_moduleSystem.execute_hooks(ModuleManage::HookStage::PRE_RESPONSE, ctx_);
+        // Variants without data record that the coding did not pay off for this file. Codings the client
+        // likes less than the best one cached don't matter; the better ones missing are still built.
+        uint8_t missing_encodings = 0;
+        Cache::CachedResponse best;
+        Compression::Encoding best_encoding = Compression::Encoding::IDENTITY;
+        for (const auto encoding: Compression::PREFERRED_ENCODINGS) {
+            if (!(accepted_encodings_ & Compression::bit(encoding))) continue;
 
-            ctx_.response->status(STATUS_200)
-                    .header(HTTP_HEADER_CONTENT_TYPE, cached_it->second.content_type)
-                    .body(cached_it->second.data->clone())
-                    .sendWithEOM();
+            auto variant = lookupCached(Compression::variantKey(ctx_.file_path, encoding));
+            if (!variant) {
+                missing_encodings |= Compression::bit(encoding);
+            } else if (variant->data) {
+                best = std::move(variant);
+                best_encoding = encoding;
+                break;
+            }
+        }
 
-            g_moduleSystem.execute_hooks(ModuleManage::HookStage::POST_RESPONSE, ctx_);
-            handled_from_cache_ = true;
+        if (best && !missing_encodings) {
+            serveCached(std::move(best), best_encoding);
+            return;
+        }
+        const auto cached = lookupCached(Compression::variantKey(ctx_.file_path, Compression::Encoding::IDENTITY));
+        if (cached) {
+            scheduleCompression(cached, missing_encodings);
+        }
+        if (best) {
+            serveCached(std::move(best), best_encoding);
+            return;
+        }
+        if (cached) {
+            serveCached(cached, Compression::Encoding::IDENTITY);
             return;
         }
     }
 
     ctx_.response = std::make_unique<ResponseBuilder>(downstream_);
     error_ = false;
-    cached_content_type_ = Utils::getContentType(ctx_.file_path);
 }
 
+// Tries the virtual host's index pages in order, one stat at a time, and remembers the outcome.
+void ServerHandler::resolveIndexPage(std::shared_ptr<IndexLookup> lookup) {
+    if (lookup->next == lookup->index_pages.size()) {
+        onIndexPageResolved(*lookup, folly::fbstring());
+        return;
+    }
+
+    folly::fbstring candidate = lookup->directory + '/' + lookup->index_pages[lookup->next++];
+    io_pending_++;
+    FileIO::backend().stat(event_base_, candidate,
+                           [this, lookup = std::move(lookup), candidate](FileIO::OpenResult result) mutable {
+                               io_pending_--;
+                               if (checkForCompletion()) return;
+
+                               if (result.error == 0 && !result.metadata.is_directory) {
+                                   onIndexPageResolved(*lookup, std::move(candidate));
+                               } else {
+                                   resolveIndexPage(std::move(lookup));
+                               }
+                           });
+}
+
+void ServerHandler::onIndexPageResolved(const IndexLookup &lookup, folly::fbstring index_page) {
+    resolving_ = false;
+    directory_cache_->set(lookup.directory, index_page);
+
+    if (error_ || finished_) {
+        return;
+    }
+    if (index_page.empty()) {
+        sendNotFound();
+        return;
+    }
+
+    ctx_.file_path = std::move(index_page);
+    dispatchRequest();
+    if (eom_received_) {
+        eom_received_ = false;
+        onEOM();
+    }
+}
+
+void ServerHandler::sendNotFound() {
+    ResponseBuilder(downstream_)
+            .status(STATUS_404)
+            .body(Utils::getErrorPage(404))
+            .sendWithEOM();
+    handled_ = true;
+}
+
+// Hits are trusted as they are. Only when no file watcher runs, one request per period checks the file in
+// the background and keeps serving the entry meanwhile.
+Cache::CachedResponse ServerHandler::lookupCached(XXH64_hash_t key) {
+    bool revalidate = false;
+    auto cached = cache_->get(key, &revalidate);
+    if (cached && revalidate) {
+        // The callback only touches the cache, so it may outlive the handler.
+        FileIO::backend().stat(event_base_, ctx_.file_path,
+                               [cache = cache_, key, metadata = cached->metadata](FileIO::OpenResult result) {
+                                   if (result.error == 0 && result.metadata.sameFile(metadata)) {
+                                       cache->validated(key);
+                                   } else {
+                                       cache->erase(key);
+                                   }
+                               });
+    }
+    return cached;
+}
+
+void ServerHandler::serveCached(Cache::CachedResponse cached, Compression::Encoding encoding) {
+    handled_ = true;
+    if (sendPrerendered(*cached)) [[likely]] {
+        return;
+    }
+    ctx_.response = std::make_unique<ResponseBuilder>(downstream_);
+
+    if (g_moduleSystem.execute_hooks(ModuleManage::HookStage::PRE_RESPONSE, ctx_) ==
+        ModuleManage::ModuleResult::DEFER) [[unlikely]] {
+        deferHooks([this, cached = std::move(cached), encoding](ModuleManage::ModuleResult) {
+            sendCached(*cached, encoding);
+        });
+        return;
+    }
+    sendCached(*cached, encoding);
+}
+
+// A plain GET of a cached entry that no module wants to see: a copy of the rendered head and the shared
+// body go out as they are, without a ResponseBuilder or any header formatting.
+bool ServerHandler::sendPrerendered(const Cache::ResponseData &cached) {
+    if (!cached.headers || g_moduleSystem.has_cache_hit_hooks()) {
+        return false;
+    }
+    const HTTPHeaders &headers = ctx_.request->getHeaders();
+    if (headers.exists(HTTP_HEADER_RANGE) || headers.exists(HTTP_HEADER_IF_NONE_MATCH) ||
+        headers.exists(HTTP_HEADER_IF_MODIFIED_SINCE)) {
+        return false;
+    }
+
+    // The codecs may touch the message they send (lazily parsed fields, HTTP/2 pseudo-headers), so each
+    // hit sends its own copy of the shared head; the header formatting is what is saved.
+    HTTPMessage head(*cached.headers);
+    downstream_->sendHeaders(head);
+    downstream_->sendBody(cached.data->clone());
+    downstream_->sendEOM();
+    return true;
+}
+
+void ServerHandler::sendCached(const Cache::ResponseData &cached, Compression::Encoding encoding) {
+    if (prepareStaticResponse(cached.metadata, encoding, cached.data->computeChainDataLength())) {
+        // Ranges are slices of the cached chain, nothing is copied.
+        folly::IOBufQueue body{folly::IOBufQueue::cacheChainLength()};
+        for (auto &piece: stream_pieces_) {
+            if (piece.literal) {
+                body.append(std::move(piece.literal));
+                continue;
+            }
+            folly::io::Cursor cursor(cached.data.get());
+            cursor.skip(piece.file_offset);
+            std::unique_ptr<folly::IOBuf> slice;
+            cursor.clone(slice, piece.length);
+            body.append(std::move(slice));
+        }
+        stream_pieces_.clear();
+
+        if (!body.empty()) {
+            ctx_.response->body(body.move());
+        }
+        ctx_.response->sendWithEOM();
+    }
+
+    g_moduleSystem.execute_hooks(ModuleManage::HookStage::POST_RESPONSE, ctx_);
+}
+
+// Starts a static response: answers conditional requests with 304, unsatisfiable ranges with 416, and
+// otherwise sets the 200/206 headers and lays the body out in stream_pieces_. Returns false when the
+// response is already complete.
+bool ServerHandler::prepareStaticResponse(const Cache::FileSystemMetadata &metadata,
+                                          Compression::Encoding encoding, uint64_t size) {
+    const HTTPHeaders &headers = ctx_.request->getHeaders();
+    const bool get = ctx_.request->getMethod() == HTTPMethod::GET;
+    const bool head = ctx_.request->getMethod() == HTTPMethod::HEAD;
+
+    const folly::fbstring etag = Validators::formatETag(metadata, encoding);
+    const folly::fbstring last_modified = Validators::formatHttpDate(metadata.mtimeSeconds());
+
+    if ((get || head) && Validators::isNotModified(headers, etag, metadata.mtimeSeconds())) {
+        ctx_.response->status(STATUS_304)
+                .header(HTTP_HEADER_ETAG, etag)
+                .header(HTTP_HEADER_LAST_MODIFIED, last_modified);
+        if (compressible_) {
+            ctx_.response->header(HTTP_HEADER_VARY, "Accept-Encoding");
+        }
+        ctx_.response->sendWithEOM();
+        return false;
+    }
+
+    std::vector<Validators::ByteRange> ranges;
+    const auto range_result = get
+                                  ? Validators::parseRange(headers, etag, last_modified, size, ranges)
+                                  : Validators::RangeResult::FULL;
+
+    if (range_result == Validators::RangeResult::UNSATISFIABLE) {
+        ctx_.response->status(STATUS_416)
+                .header(HTTP_HEADER_CONTENT_RANGE, folly::to<std::string>("bytes */", size))
+                .header(HTTP_HEADER_CONTENT_LENGTH, "0")
+                .sendWithEOM();
+        return false;
+    }
+
+    stream_pieces_.clear();
+    stream_length_ = 0;
+    partial_ = range_result == Validators::RangeResult::PARTIAL;
+
+    if (partial_) {
+        ctx_.response->status(STATUS_206);
+    } else {
+        ctx_.response->status(STATUS_200);
+    }
+    if (ranges.size() > 1) {
+        for (const auto &range: ranges) {
+            StreamPiece part_header;
+            part_header.literal = folly::IOBuf::copyBuffer(
+                Validators::multipartPartHeader(cached_content_type_, range, size));
+            stream_length_ += part_header.literal->length();
+            stream_pieces_.push_back(std::move(part_header));
+            stream_pieces_.push_back(StreamPiece{nullptr, range.first, range.length});
+            stream_length_ += range.length;
+        }
+        StreamPiece trailer;
+        trailer.literal = folly::IOBuf::copyBuffer(Validators::multipartTrailer());
+        stream_length_ += trailer.literal->length();
+        stream_pieces_.push_back(std::move(trailer));
+
+        ctx_.response->header(HTTP_HEADER_CONTENT_TYPE,
+                              folly::to<std::string>("multipart/byteranges; boundary=",
+                                                     Validators::multipartBoundary()));
+    } else {
+        if (ranges.size() == 1) {
+            ctx_.response->header(HTTP_HEADER_CONTENT_RANGE, Validators::formatContentRange(ranges[0], size));
+            stream_pieces_.push_back(StreamPiece{nullptr, ranges[0].first, ranges[0].length});
+            stream_length_ = ranges[0].length;
+        } else if (size > 0) {
+            stream_pieces_.push_back(StreamPiece{nullptr, 0, size});
+            stream_length_ = size;
+        }
+        ctx_.response->header(HTTP_HEADER_CONTENT_TYPE, cached_content_type_);
+    }
+
+    if (encoding != Compression::Encoding::IDENTITY) {
+        ctx_.response->header(HTTP_HEADER_CONTENT_ENCODING, Compression::name(encoding));
+    }
+    if (compressible_) {
+        ctx_.response->header(HTTP_HEADER_VARY, "Accept-Encoding");
+    }
+    // The body is laid out before anything is sent, so the length can be announced up front.
+    ctx_.response->header(HTTP_HEADER_CONTENT_LENGTH, folly::to<std::string>(stream_length_))
+            .header(HTTP_HEADER_ACCEPT_RANGES, "bytes")
+            .header(HTTP_HEADER_ETAG, etag)
+            .header(HTTP_HEADER_LAST_MODIFIED, last_modified);
+    return true;
+}
+
+// The head of a plain 200 for a cache entry, in the order prepareStaticResponse() sends it.
+static std::shared_ptr<const HTTPMessage> renderHeaders(const Cache::ResponseData &row, Compression::Encoding encoding) {
+    auto message = std::make_shared<HTTPMessage>();
+    message->setHTTPVersion(1, 1);
+    message->setStatusCode(200);
+    message->setStatusMessage(HTTPMessage::getDefaultReason(200));
+
+    HTTPHeaders &headers = message->getHeaders();
+    headers.add(HTTP_HEADER_CONTENT_TYPE, row.content_type);
+    if (encoding != Compression::Encoding::IDENTITY) {
+        headers.add(HTTP_HEADER_CONTENT_ENCODING, Compression::name(encoding));
+    }
+    if (Compression::isCompressible(row.content_type)) {
+        headers.add(HTTP_HEADER_VARY, "Accept-Encoding");
+    }
+    headers.add(HTTP_HEADER_CONTENT_LENGTH, folly::to<std::string>(row.data->computeChainDataLength()));
+    headers.add(HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    headers.add(HTTP_HEADER_ETAG, Validators::formatETag(row.metadata, encoding).toStdString());
+    headers.add(HTTP_HEADER_LAST_MODIFIED, Validators::formatHttpDate(row.metadata.mtimeSeconds()).toStdString());
+    return message;
+}
+
+// Builds an encoded copy of a cached file: a precompressed sibling ("style.css.br") that is at least as
+// new as the file wins, otherwise the cached body is compressed. Runs on the CPU executor.
+static std::unique_ptr<folly::IOBuf> buildVariant(const folly::fbstring &path, Compression::Encoding encoding,
+                                                  const Cache::ResponseData &identity) {
+    const folly::fbstring sibling = path + Compression::extension(encoding);
+    struct stat st{};
+    if (stat(sibling.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+        Cache::FileSystemMetadata::fromStat(st).mtime_ns >= identity.metadata.mtime_ns) {
+        std::string contents;
+        if (folly::readFile(sibling.c_str(), contents)) {
+            return folly::IOBuf::copyBuffer(contents);
+        }
+    }
+
+    if (!(Compression::supportedEncodings() & Compression::bit(encoding))) {
+        return nullptr;
+    }
+
+    auto compressed = Compression::compress(encoding, *identity.data);
+    // Not worth a Content-Encoding if it saves less than a tenth.
+    if (compressed && compressed->computeChainDataLength() * 10 >= identity.data->computeChainDataLength() * 9) {
+        return nullptr;
+    }
+    return compressed;
+}
+
+void ServerHandler::scheduleCompression(const Cache::CachedResponse &identity, uint8_t missing_encodings) {
+    for (const auto encoding: Compression::PREFERRED_ENCODINGS) {
+        if (!(missing_encodings & Compression::bit(encoding))) continue;
+
+        const XXH64_hash_t key = Compression::variantKey(ctx_.file_path, encoding);
+        if (!Compression::beginJob(key)) return;
+
+        // The watcher erases the variants with the file; one built from the old contents must not land after.
+        const uint64_t generation = cache_->generation(key);
+        Compression::executor().add(
+            [cache = cache_, key, generation, encoding, path = ctx_.file_path, identity]() {
+                Cache::ResponseData variant;
+                variant.content_type = identity->content_type;
+                variant.metadata = identity->metadata;
+                variant.data = buildVariant(path, encoding, *identity);
+                if (variant.data) {
+                    variant.headers = renderHeaders(variant, encoding);
+                }
+                cache->set(key, std::move(variant), {}, generation);
+                Compression::endJob(key);
+            });
+        // One variant per request; the next miss schedules the next coding.
+        return;
+    }
+}
+
+
+void warmResponseCache(Cache::ResponseCache *cache, std::vector<std::string> paths) {
+    if (paths.empty()) {
+        return;
+    }
+    folly::getUnsafeMutableGlobalCPUExecutor()->add([cache, paths = std::move(paths)] {
+        size_t warmed = 0;
+        for (const auto &path: paths) {
+            const XXH64_hash_t key = Utils::computeXXH64Hash(path);
+            // Taken before the file is opened: if the watcher reports a change while it is read, the
+            // old contents are not stored.
+            const uint64_t generation = cache->generation(key);
+            const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            // The metadata and the contents both come from the file that was opened.
+            struct stat st{};
+            std::string contents;
+            const bool loaded = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                                static_cast<size_t>(st.st_size) <= cache->max_object_bytes() &&
+                                folly::readFile(fd, contents, static_cast<size_t>(st.st_size));
+            close(fd);
+            if (!loaded) {
+                continue;
+            }
+
+            Cache::ResponseData row;
+            row.content_type = Utils::getContentType(folly::fbstring(path));
+            row.data = folly::IOBuf::copyBuffer(contents);
+            row.metadata = Cache::FileSystemMetadata::fromStat(st);
+            row.headers = renderHeaders(row, Compression::Encoding::IDENTITY);
+            if (cache->set(key, std::move(row), path, generation)) {
+                warmed++;
+            }
+        }
+        XLOG(INFO) << "Warmed the response cache with " << warmed << " of " << paths.size() << " files";
+    });
+}
 
 void ServerHandler::handleStaticFile() {
-    try {
-        file_ = std::make_unique<folly::File>(ctx_.file_path);
-    } catch (const std::system_error &) {
-        event_base_->runInEventBaseThread([this]() {
-            if (error_ || finished_) return;
+    const auto method = ctx_.request->getMethod();
+    if (!conditional_checked_ && (method == HTTPMethod::GET || method == HTTPMethod::HEAD)) {
+        conditional_checked_ = true;
+        const HTTPHeaders &headers = ctx_.request->getHeaders();
+        if (headers.exists(HTTP_HEADER_IF_NONE_MATCH) || headers.exists(HTTP_HEADER_IF_MODIFIED_SINCE)) {
+            // A revalidation is answered from the metadata alone, without opening the file.
+            checkNotModified();
+            return;
+        }
+    }
+
+    if (!flight_checked_ && (method == HTTPMethod::GET || method == HTTPMethod::HEAD)) {
+        flight_checked_ = true;
+        // Concurrent misses for one file share a single read. Only a plain GET reads all of it, so only
+        // such a request may lead.
+        const bool may_lead = method == HTTPMethod::GET && !ctx_.request->getHeaders().exists(HTTP_HEADER_RANGE);
+        flight_ = flights_->join(Compression::variantKey(ctx_.file_path, Compression::Encoding::IDENTITY), may_lead,
+                                 leading_);
+        if (flight_ && !leading_) {
+            static_state_ = StaticState::OPENING;
+            followFlight();
+            return;
+        }
+    }
+
+    static_state_ = StaticState::OPENING;
+    // Taken before the file is opened: an invalidation from here on keeps what is read out of the cache.
+    fill_generation_ = cache_->generation(Utils::computeXXH64Hash(ctx_.file_path));
+    io_pending_++;
+    FileIO::backend().open(event_base_, ctx_.file_path, [this](FileIO::OpenResult result) {
+        io_pending_--;
+        if (checkForCompletion()) {
+            if (result.fd >= 0) close(result.fd);
+            return;
+        }
 
+        if (result.fd < 0 || result.metadata.is_directory) {
+            if (result.fd >= 0) close(result.fd);
+            if (leading_) endFlight(false);
+            static_state_ = StaticState::DONE;
             ctx_.response->status(STATUS_404)
                     .body(Utils::getErrorPage(404))
                     .sendWithEOM();
-        });
+            return;
+        }
+
+        file_ = std::make_unique<folly::File>(result.fd, true);
+        file_metadata_ = result.metadata;
+
+        if (compressible_ && accepted_encodings_ && file_metadata_.size > cache_->max_object_bytes()) {
+            // Too large to be cached and compressed here, but a precompressed sibling still beats the file.
+            openPrecompressed(0);
+            return;
+        }
+        startStaticFile(Compression::Encoding::IDENTITY, file_metadata_);
+    });
+}
+
+void ServerHandler::checkNotModified() {
+    static_state_ = StaticState::OPENING;
+    io_pending_++;
+    FileIO::backend().stat(event_base_, ctx_.file_path, [this](FileIO::OpenResult result) {
+        io_pending_--;
+        if (checkForCompletion()) return;
+
+        const auto &metadata = result.metadata;
+        if (result.error == 0 && !metadata.is_directory &&
+            Validators::isNotModified(ctx_.request->getHeaders(),
+                                      Validators::formatETag(metadata, Compression::Encoding::IDENTITY),
+                                      metadata.mtimeSeconds())) {
+            static_state_ = StaticState::DONE;
+            // Sends the 304.
+            prepareStaticResponse(metadata, Compression::Encoding::IDENTITY, metadata.size);
+            return;
+        }
+        handleStaticFile();
+    });
+}
+
+// Tries the siblings ("big.js.br", ...) of an uncacheable file in the client's order of preference, from
+// Compression::PREFERRED_ENCODINGS[next] on. One older than the file is ignored.
+void ServerHandler::openPrecompressed(size_t next) {
+    while (next < Compression::PREFERRED_ENCODINGS.size() &&
+           !(accepted_encodings_ & Compression::bit(Compression::PREFERRED_ENCODINGS[next]))) {
+        next++;
+    }
+    if (next == Compression::PREFERRED_ENCODINGS.size()) {
+        startStaticFile(Compression::Encoding::IDENTITY, file_metadata_);
         return;
     }
 
-    event_base_->runInEventBaseThread([this]() {
-        if (error_ || finished_) return;
-
-        ctx_.response->status(STATUS_200)
-                .header("Content-Type", cached_content_type_)
-                .send();
-
-        readFileScheduled_ = true;
-        folly::getUnsafeMutableGlobalCPUExecutor()->add([this]() {
-            folly::IOBufQueue buf(folly::IOBufQueue::cacheChainLength());
-            std::vector<std::unique_ptr<folly::IOBuf> > chunks;
-
-            while (file_ && !paused_ && !error_ && !finished_) {
-                auto data = buf.preallocate(4000, 4000);
-                auto rc = folly::readNoInt(file_->fd(), data.first, data.second);
-
-                if (rc < 0) {
-                    break;
-                } else if (rc == 0) {
-                    if (!chunks.empty()) {
-                        auto complete_buf = folly::IOBuf::create(0);
-                        for (auto &chunk: chunks) {
-                            complete_buf->prependChain(std::move(chunk));
-                        }
-
-                        Cache::ResponseData row;
-                        row.content_type = cached_content_type_;
-                        row.data = std::move(complete_buf);
-
-                        // Move cache operation to event base thread
-                        event_base_->runInEventBaseThread([this, row = std::move(row)]() mutable {
-                            if (!error_ && !finished_) {
-                                cache_->set(Utils::computeXXH64Hash(ctx_.file_path), std::move(row));
-                                ctx_.response->sendWithEOM();
-                            }
-                        });
-                    } else {
-                        // No chunks to cache, just send EOM
-                        event_base_->runInEventBaseThread([this]() {
-                            if (!error_ && !finished_) {
-                                ctx_.response->sendWithEOM();
-                            }
-                        });
+    const auto encoding = Compression::PREFERRED_ENCODINGS[next];
+    io_pending_++;
+    FileIO::backend().open(event_base_, ctx_.file_path + Compression::extension(encoding),
+                           [this, next, encoding](FileIO::OpenResult result) {
+                               io_pending_--;
+                               if (checkForCompletion()) {
+                                   if (result.fd >= 0) close(result.fd);
+                                   return;
+                               }
+
+                               if (result.fd < 0 || result.metadata.is_directory ||
+                                   result.metadata.mtime_ns < file_metadata_.mtime_ns) {
+                                   if (result.fd >= 0) close(result.fd);
+                                   openPrecompressed(next + 1);
+                                   return;
+                               }
+                               file_ = std::make_unique<folly::File>(result.fd, true);
+                               startStaticFile(encoding, result.metadata);
+                           });
+}
+
+// Sends the headers and starts the body of file_, whose contents are `body`: the file itself, or a
+// precompressed sibling of it.
+void ServerHandler::startStaticFile(Compression::Encoding encoding, const Cache::FileSystemMetadata &body) {
+    // Validators stay those of the file, prepareStaticResponse() tells the codings apart.
+    if (!prepareStaticResponse(file_metadata_, encoding, body.size)) {
+        if (leading_) endFlight(false);
+        static_state_ = StaticState::DONE;
+        file_.reset();
+        return;
+    }
+
+    // Only read-only files are mapped: one truncated in place would fault the process on SIGBUS.
+    if (server_config_->zero_copy_min_bytes && body.size >= server_config_->zero_copy_min_bytes &&
+        body.read_only && mapFile(body.size)) {
+        static_state_ = StaticState::MAPPED;
+    } else {
+        static_state_ = StaticState::STREAMING;
+        // Only a complete body can be cached; ranges are cut from it on later hits.
+        cacheable_ = encoding == Compression::Encoding::IDENTITY && !partial_ &&
+                     file_metadata_.size <= cache_->max_object_bytes();
+    }
+    if (leading_) {
+        // Followers only share loads that end up in the cache; a mapped file is cheap to map again.
+        if (cacheable_) {
+            flight_->opened(file_metadata_);
+        } else {
+            endFlight(false);
+        }
+    }
+    ctx_.response->send();
+    pumpStaticFile();
+}
+
+// Walks stream_pieces_ in order. File ranges are read in chunks (or sliced from the mapping), multipart
+// framing is queued as-is, and everything is handed to the transport by its offset in the body.
+void ServerHandler::pumpStaticFile() {
+    const bool mapped = static_state_ == StaticState::MAPPED;
+    const size_t chunk_size = mapped ? MAPPED_SLICE_SIZE : READ_CHUNK_SIZE;
+    const size_t window = std::max(server_config_->stream_window_bytes, chunk_size);
+
+    for (;;) {
+        while (!paused_ && !ready_chunks_.empty() && ready_chunks_.begin()->first == send_offset_) {
+            auto chunk = std::move(ready_chunks_.begin()->second);
+            ready_chunks_.erase(ready_chunks_.begin());
+
+            const size_t length = chunk->length();
+            send_offset_ += length;
+            inflight_bytes_ -= length;
+
+            if (cacheable_) {
+                cache_body_.append(chunk->clone());
+            }
+            // May re-enter onEgressPaused(), which holds further chunks until onEgressResumed().
+            ctx_.response->body(std::move(chunk)).send();
+        }
+
+        if (send_offset_ == stream_length_) {
+            finishStaticFile();
+            return;
+        }
+
+        // Reads are issued while egress is open and the bytes not yet handed to the transport stay inside
+        // the window; completions may arrive out of order.
+        bool produced = false;
+        while (!paused_ && piece_index_ < stream_pieces_.size() && inflight_bytes_ + chunk_size <= window) {
+            StreamPiece &piece = stream_pieces_[piece_index_];
+            const uint64_t offset = read_offset_;
+
+            if (piece.literal) {
+                const size_t length = piece.literal->length();
+                read_offset_ += length;
+                inflight_bytes_ += length;
+                ready_chunks_.emplace(offset, std::move(piece.literal));
+                piece_index_++;
+                produced = true;
+                continue;
+            }
+
+            const uint64_t file_offset = piece.file_offset + piece_offset_;
+            const size_t length = static_cast<size_t>(std::min<uint64_t>(chunk_size, piece.length - piece_offset_));
+
+            std::unique_ptr<folly::IOBuf> followed;
+            if (flight_ && !leading_) {
+                followed = flight_->read(file_offset, length);
+                if (!followed) {
+                    if (waitForFlight(file_offset + length)) break;
+                    followed = flight_->read(file_offset, length);
+                    if (!followed) {
+                        resumeFromDisk();
+                        return;
                     }
-                    break;
-                } else {
-                    buf.postallocate(rc);
-                    auto chunk = buf.move();
-
-                    // Store clone for caching, send original
-                    chunks.push_back(chunk->clone());
-
-                    event_base_->runInEventBaseThread([this, chunk = std::move(chunk)]() mutable {
-                        if (!error_ && !finished_) {
-                            ctx_.response->body(std::move(chunk)).send();
-                        }
-                    });
                 }
             }
+
+            piece_offset_ += length;
+            if (piece_offset_ == piece.length) {
+                piece_index_++;
+                piece_offset_ = 0;
+            }
+            read_offset_ += length;
+            inflight_bytes_ += length;
+
+            if (followed) {
+                ready_chunks_.emplace(offset, std::move(followed));
+                produced = true;
+                continue;
+            }
+
+            if (mapped) {
+                auto slice = mapped_file_->cloneOne();
+                slice->trimStart(file_offset);
+                slice->trimEnd(slice->length() - length);
+
+                // Start readahead for the next slice so the write doesn't fault on cold pages.
+                const uint64_t next = file_offset + length;
+                if (next < mapped_file_->length()) {
+                    madvise(const_cast<uint8_t *>(mapped_file_->data()) + next,
+                            std::min<uint64_t>(MAPPED_SLICE_SIZE, mapped_file_->length() - next), MADV_WILLNEED);
+                }
+                ready_chunks_.emplace(offset, std::move(slice));
+                produced = true;
+                continue;
+            }
+
+            io_pending_++;
+            FileIO::backend().read(event_base_, file_->fd(), file_offset, length,
+                                   [this, offset, length](std::unique_ptr<folly::IOBuf> chunk, int error) {
+                                       io_pending_--;
+                                       if (checkForCompletion()) return;
+                                       onChunkRead(offset, length, std::move(chunk), error);
+                                   });
+        }
+
+        if (!produced) {
+            return;
+        }
+    }
+}
+
+void ServerHandler::onChunkRead(uint64_t offset, size_t length, std::unique_ptr<folly::IOBuf> chunk, int error) {
+    if (static_state_ != StaticState::STREAMING) {
+        return;
+    }
+
+    if (!chunk || chunk->length() != length) {
+        // A short read means the file shrank after Content-Length was sent.
+        XLOG(ERR) << "Read failed for " << ctx_.file_path << ": "
+                << (chunk ? "file truncated while serving" : strerror(error));
+        abortStaticFile();
+        return;
+    }
+
+    if (leading_) {
+        flight_->append(offset, *chunk);
+    }
+    ready_chunks_.emplace(offset, std::move(chunk));
+    pumpStaticFile();
+}
+
+// Serves the file from another request's load: headers once the leader has opened it, then the body as
+// its chunks arrive. A load that fails before the headers went out is replaced by reading the file here.
+void ServerHandler::followFlight() {
+    while (static_state_ == StaticState::OPENING) {
+        Cache::FileSystemMetadata metadata;
+        const auto status = flight_->status(metadata);
+        if (status == Cache::Flight::Status::FAILED) {
+            flight_.reset();
+            handleStaticFile();
+            return;
+        }
+        if (status == Cache::Flight::Status::OPENING) {
+            if (waitForFlight(0)) return;
+            continue;
+        }
+
+        file_metadata_ = metadata;
+        if (!prepareStaticResponse(file_metadata_, Compression::Encoding::IDENTITY, file_metadata_.size)) {
+            static_state_ = StaticState::DONE;
+            flight_.reset();
+            return;
+        }
+        static_state_ = StaticState::STREAMING;
+        ctx_.response->send();
+    }
+    pumpStaticFile();
+}
+
+// Returns false when there is nothing to wait for: the data is there or the flight is over.
+bool ServerHandler::waitForFlight(uint64_t until) {
+    if (waiting_for_flight_) {
+        return true;
+    }
+
+    // The waiter runs on the leader's thread and only posts back to this one.
+    flight_waiter_ = flight_->wait(until, [this, evb = event_base_] {
+        evb->runInEventBaseThread([this] {
+            io_pending_--;
+            waiting_for_flight_ = false;
+            flight_waiter_ = 0;
+            if (flight_stall_) {
+                flight_stall_->cancelTimeout();
+            }
+            if (checkForCompletion()) return;
+
+            if (static_state_ == StaticState::OPENING && flight_) {
+                followFlight();
+            } else if (static_state_ == StaticState::STREAMING) {
+                pumpStaticFile();
+            }
         });
     });
+    if (flight_waiter_ == 0) {
+        return false;
+    }
+    io_pending_++;
+    waiting_for_flight_ = true;
+
+    // Opening only takes the leader's disk; the body comes at the pace of the leader's client.
+    if (static_state_ == StaticState::STREAMING) {
+        if (!flight_stall_) {
+            flight_stall_ = folly::AsyncTimeout::make(*event_base_, [this]() noexcept { onFlightStalled(); });
+        }
+        flight_stall_->scheduleTimeout(FLIGHT_STALL_TIMEOUT);
+    }
+    return true;
+}
+
+// The leader's client is slower than ours. Unless the waiter is already on its way back, leave the flight
+// and read the rest of the file here.
+void ServerHandler::onFlightStalled() {
+    if (finished_ || !leaveFlight()) {
+        return;
+    }
+    resumeFromDisk();
 }
 
+// Drops our waiter from the flight. False if there is none, or it already runs and will post back.
+bool ServerHandler::leaveFlight() {
+    if (!waiting_for_flight_ || !flight_ || !flight_->cancel(flight_waiter_)) {
+        return false;
+    }
+    io_pending_--;
+    waiting_for_flight_ = false;
+    flight_waiter_ = 0;
+    if (flight_stall_) {
+        flight_stall_->cancelTimeout();
+    }
+    return true;
+}
+
+// The leader gave up half way: continue from the file, provided it is still the one being served.
+void ServerHandler::resumeFromDisk() {
+    flight_.reset();
+    static_state_ = StaticState::OPENING;
+    io_pending_++;
+    FileIO::backend().open(event_base_, ctx_.file_path, [this](FileIO::OpenResult result) {
+        io_pending_--;
+        if (checkForCompletion()) {
+            if (result.fd >= 0) close(result.fd);
+            return;
+        }
+
+        if (result.fd < 0 || !result.metadata.sameFile(file_metadata_)) {
+            if (result.fd >= 0) close(result.fd);
+            abortStaticFile();
+            return;
+        }
+
+        file_ = std::make_unique<folly::File>(result.fd, true);
+        static_state_ = StaticState::STREAMING;
+        pumpStaticFile();
+    });
+}
+
+void ServerHandler::endFlight(bool complete) {
+    flight_->finish(complete);
+    flights_->remove(Compression::variantKey(ctx_.file_path, Compression::Encoding::IDENTITY), flight_.get());
+    flight_.reset();
+    leading_ = false;
+}
+
+void ServerHandler::finishStaticFile() {
+    static_state_ = StaticState::DONE;
+    file_.reset();
+    mapped_file_.reset();
+
+    if (cacheable_ && !cache_body_.empty()) {
+        Cache::ResponseData row;
+        row.content_type = cached_content_type_;
+        row.data = cache_body_.move();
+        row.metadata = file_metadata_;
+        row.headers = renderHeaders(row, Compression::Encoding::IDENTITY);
+        if (const auto stored = cache_->set(Utils::computeXXH64Hash(ctx_.file_path), std::move(row),
+                                            ctx_.file_path, fill_generation_)) {
+            scheduleCompression(stored, accepted_encodings_);
+        }
+    }
+    // Requests arriving from here on hit the cache.
+    if (leading_) {
+        endFlight(true);
+    }
+
+    ctx_.response->sendWithEOM();
+}
+
+void ServerHandler::abortStaticFile() {
+    // The descriptor stays open until the handler goes away, reads may still be queued against it.
+    static_state_ = StaticState::DONE;
+    ready_chunks_.clear();
+    cache_body_.move();
+    if (leading_) {
+        endFlight(false);
+    }
+    flight_.reset();
+    downstream_->sendAbort();
+}
+
+bool ServerHandler::mapFile(size_t size) {
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, file_->fd(), 0);
+    if (addr == MAP_FAILED) {
+        XLOG(WARN) << "mmap failed for " << ctx_.file_path << ", falling back to read(): " << strerror(errno);
+        return false;
+    }
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    // The socket writes straight from the page cache and the file never enters the heap or the response
+    // cache. Slices handed to proxygen share this buffer, so the mapping outlives the handler if the
+    // transport still holds unsent data. Truncating a mapped file raises SIGBUS on the next read of the
+    // lost pages, which is why writable files are streamed with pread() instead.
+    mapped_file_ = folly::IOBuf::takeOwnership(
+        addr, size,
+        [](void *buf, void *length) { munmap(buf, reinterpret_cast<size_t>(length)); },
+        reinterpret_cast<void *>(size));
+    return true;
+}
 
 void ServerHandler::onEgressPaused() noexcept {
     paused_ = true;
+    ctx_.egress_paused = true;
+    if (ctx_.egress_listener) {
+        ctx_.egress_listener(true);
+    }
 }
 
 void ServerHandler::onEgressResumed() noexcept {
     paused_ = false;
+    ctx_.egress_paused = false;
+    if (ctx_.egress_listener) {
+        ctx_.egress_listener(false);
+    }
 
-    if (handled_from_cache_) {
-        finished_ = true;
-        checkForCompletion();
+    if (static_state_ == StaticState::STREAMING || static_state_ == StaticState::MAPPED) {
+        pumpStaticFile();
     }
 }
 
 void ServerHandler::onEOM() noexcept {
-    if (!handled_from_cache_) {
-        ctx_.request_body = body_;
+    if (routed_) {
+        if (ctx_.body_listener) {
+            ctx_.body_listener(nullptr);
+        }
+        return;
+    }
+    if (resolving_ || deferred_ || spilling_) {
+        // Picked up once the index page is known, the hooks resume or the body is written out.
+        eom_received_ = true;
+        return;
+    }
+    if (!handled_) {
+        const auto result = g_moduleSystem.execute_hooks(ModuleManage::HookStage::PRE_RESPONSE, ctx_);
+        if (result == ModuleManage::ModuleResult::DEFER) [[unlikely]] {
+            deferHooks([this](ModuleManage::ModuleResult response) { respond(response); });
+            return;
+        }
+        respond(result);
+    }
+}
 
-        auto result = g_moduleSystem.execute_hooks(ModuleManage::HookStage::PRE_RESPONSE, ctx_);
+void ServerHandler::respond(ModuleManage::ModuleResult result) {
+    if (result != ModuleManage::ModuleResult::BREAK)
+        handleStaticFile();
 
-        if (result != ModuleManage::ModuleResult::BREAK)
-            handleStaticFile();
+    g_moduleSystem.execute_hooks(ModuleManage::HookStage::POST_RESPONSE, ctx_);
+}
 
-        g_moduleSystem.execute_hooks(ModuleManage::HookStage::POST_RESPONSE, ctx_);
+void ServerHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {
+    if (routed_) {
+        if (ctx_.body_listener) {
+            ctx_.body_listener(std::move(body));
+        }
+        return;
     }
+    ctx_.request_body.append(std::move(body));
+    spillRequestBody();
 }
 
-void ServerHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {
-    if (body_) {
-        body_->prependChain(std::move(body));
-    } else {
-        body_ = std::move(body);
+// A body past the spill threshold goes to a temp file as it arrives, written off the loop. Ingress waits
+// while a write is out, so what piles up in memory meanwhile stays around one read's worth.
+void ServerHandler::spillRequestBody() {
+    Utils::RequestBody &body = ctx_.request_body;
+    const size_t threshold = server_config_->request_body_spill_bytes;
+    if (spilling_ || threshold == 0 || body.size() <= threshold || body.buffered() == 0 || !body.spillable()) {
+        return;
     }
+
+    spilling_ = true;
+    downstream_->pauseIngress();
+    io_pending_++;
+    body.spill(event_base_, *folly::getUnsafeMutableGlobalCPUExecutor(), server_config_->request_body_temp_dir,
+               [this](bool /*written*/) {
+                   io_pending_--;
+                   spilling_ = false;
+                   if (checkForCompletion() || finished_) return;
+
+                   spillRequestBody(); // whatever arrived during the write
+                   if (spilling_) return;
+                   if (!deferred_) {
+                       downstream_->resumeIngress();
+                   }
+                   if (eom_received_) {
+                       eom_received_ = false;
+                       onEOM();
+                   }
+               });
 }
 
 void ServerHandler::onUpgrade(UpgradeProtocol protocol) noexcept {
@@ -195,6 +1109,8 @@ void ServerHandler::onUpgrade(UpgradeProtocol protocol) noexcept {
 void ServerHandler::requestComplete() noexcept {
     finished_ = true;
     paused_ = true;
+    // A follower doesn't wait for a leader that may take a while with a client nobody serves.
+    leaveFlight();
     checkForCompletion();
 }
 
@@ -202,11 +1118,13 @@ void ServerHandler::onError(ProxygenError /*err*/) noexcept {
     error_ = true;
     finished_ = true;
     paused_ = true;
+    leaveFlight();
     checkForCompletion();
 }
 
 bool ServerHandler::checkForCompletion() {
-    if (finished_) {
+    // Outstanding file I/O completes on this EventBase and still refers to the handler.
+    if (finished_ && io_pending_ == 0) {
         delete this;
         return true;
     }
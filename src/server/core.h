@@ -1,21 +1,47 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
 #include "utils/config.h"
 #include <folly/io/IOBufQueue.h>
+#include <folly/io/async/AsyncTimeout.h>
 #include <proxygen/httpserver/ResponseBuilder.h>
 #include "module.h"
 #include "utils/cache.h"
+#include "utils/compression.h"
+#include "utils/flight_table.h"
+#include "utils/free_list.h"
+#include "utils/host_table.h"
+#include "utils/response_cache.h"
+#include "utils/route_index.h"
 
 class ServerHandler : public proxygen::RequestHandler {
 public:
     explicit ServerHandler(
-        folly::EvictingCacheMap<XXH64_hash_t, Cache::ResponseData> *cache,
-        folly::EvictingCacheMap<XXH64_hash_t, Cache::VirtualHostConfig> *host_config_cache,
-        folly::EvictingCacheMap<XXH64_hash_t, folly::fbstring> *directory_redirect_cache) : cache_(cache),
-        host_config_cache_(host_config_cache),
-        directory_redirect_cache_(directory_redirect_cache) {
+        Cache::ResponseCache *cache,
+        const Config::ServerConfig *server_config,
+        Routing::DirectoryCache *directory_cache,
+        Cache::FlightTable *flights) : in_flight_(requestCounter()),
+        cache_(cache),
+        server_config_(server_config),
+        directory_cache_(directory_cache),
+        flights_(flights) {
+        in_flight_.fetch_add(1, std::memory_order_relaxed);
+        ctx_.document_root = PathBuffers::take();
+        ctx_.file_path = PathBuffers::take();
     }
 
+    ~ServerHandler() override;
+
+    // Handlers come and go once per request on their EventBase; their memory is recycled per thread.
+    static void *operator new(size_t size);
+
+    static void operator delete(void *block) noexcept;
+
     void onRequest(std::unique_ptr<proxygen::HTTPMessage> message) noexcept override;
 
     void onUpgrade(proxygen::UpgradeProtocol proto) noexcept override;
@@ -33,22 +59,155 @@ public:
     void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override;
 
 private:
+    using PathBuffers = Utils::SpareBuffers<folly::fbstring>;
+
+    struct IndexLookup {
+        folly::fbstring directory;
+        std::vector<std::string> index_pages;
+        size_t next = 0;
+    };
+
     bool checkForCompletion();
 
+    void spillRequestBody();
+
+    void routeRequest(ModuleManage::ModuleResult result);
+
+    void mapRequest();
+
+    void deferHooks(folly::Function<void(ModuleManage::ModuleResult)> then);
+
+    void dispatchRequest();
+
+    void serveRequest();
+
+    void respond(ModuleManage::ModuleResult result);
+
+    void resolveIndexPage(std::shared_ptr<IndexLookup> lookup);
+
+    void onIndexPageResolved(const IndexLookup &lookup, folly::fbstring index_page);
+
+    void sendNotFound();
+
+    Cache::CachedResponse lookupCached(XXH64_hash_t key);
+
+    void serveCached(Cache::CachedResponse cached, Compression::Encoding encoding);
+
+    bool sendPrerendered(const Cache::ResponseData &cached);
+
+    void sendCached(const Cache::ResponseData &cached, Compression::Encoding encoding);
+
+    bool prepareStaticResponse(const Cache::FileSystemMetadata &metadata, Compression::Encoding encoding,
+                               uint64_t size);
+
+    void scheduleCompression(const Cache::CachedResponse &identity, uint8_t missing_encodings);
+
     void handleStaticFile();
 
+    void checkNotModified();
+
+    void openPrecompressed(size_t next);
+
+    void startStaticFile(Compression::Encoding encoding, const Cache::FileSystemMetadata &body);
+
+    void followFlight();
+
+    bool waitForFlight(uint64_t until);
+
+    void onFlightStalled();
+
+    bool leaveFlight();
+
+    void resumeFromDisk();
+
+    void endFlight(bool complete);
+
+    void pumpStaticFile();
+
+    void onChunkRead(uint64_t offset, size_t length, std::unique_ptr<folly::IOBuf> chunk, int error);
+
+    void finishStaticFile();
+
+    void abortStaticFile();
+
+    bool mapFile(size_t size);
+
+    // Static responses only ever advance on the handler's EventBase:
+    // IDLE -> OPENING -> STREAMING | MAPPED -> DONE.
+    enum class StaticState : uint8_t {
+        IDLE,
+        OPENING,
+        STREAMING,
+        MAPPED,
+        DONE,
+    };
+
+    static constexpr size_t MAPPED_SLICE_SIZE = 1 << 20;
+    static constexpr size_t READ_CHUNK_SIZE = 64 * 1024;
+    // A follower waiting this long for the leader's next chunk reads the rest of the file itself.
+    static constexpr std::chrono::milliseconds FLIGHT_STALL_TIMEOUT{100};
+
+    // One part of a static body: a byte range of the file or literal multipart framing.
+    struct StreamPiece {
+        std::unique_ptr<folly::IOBuf> literal;
+        uint64_t file_offset = 0;
+        uint64_t length = 0;
+    };
+
+    // This thread's count of live handlers, see requestsInFlight().
+    static std::atomic<size_t> &requestCounter();
+
+    std::atomic<size_t> &in_flight_;
     const char *cached_content_type_;
+    Cache::FileSystemMetadata file_metadata_;
     ModuleManage::ModuleContext ctx_;
 
     std::unique_ptr<folly::File> file_;
-    std::shared_ptr<folly::IOBuf> body_;
-    folly::EvictingCacheMap<XXH64_hash_t, Cache::ResponseData> *cache_;
-    folly::EvictingCacheMap<XXH64_hash_t, Cache::VirtualHostConfig> *host_config_cache_;
-    folly::EvictingCacheMap<XXH64_hash_t, folly::fbstring> *directory_redirect_cache_;
-    bool readFileScheduled_ = false;
+    std::unique_ptr<folly::IOBuf> mapped_file_;
+    std::vector<StreamPiece> stream_pieces_;
+    size_t piece_index_ = 0;
+    uint64_t piece_offset_ = 0;
+    uint64_t stream_length_ = 0;
+    uint64_t fill_generation_ = 0; // cache generation of the file when it was opened
+    uint64_t read_offset_ = 0;
+    uint64_t send_offset_ = 0;
+    size_t inflight_bytes_ = 0;
+    std::map<uint64_t, std::unique_ptr<folly::IOBuf> > ready_chunks_;
+    folly::IOBufQueue cache_body_{folly::IOBufQueue::cacheChainLength()};
+    Cache::ResponseCache *cache_;
+    const Config::ServerConfig *server_config_;
+    Routing::HostLease hosts_;
+    Routing::DirectoryCache *directory_cache_;
+    Cache::FlightTable *flights_;
+    // The load of this file into the cache that this request leads or follows.
+    std::shared_ptr<Cache::Flight> flight_;
+    uint64_t flight_waiter_ = 0;
+    std::unique_ptr<folly::AsyncTimeout> flight_stall_;
+    uint32_t io_pending_ = 0;
+    StaticState static_state_ = StaticState::IDLE;
+    bool cacheable_ = false;
+    bool partial_ = false;
+    bool compressible_ = false;
+    uint8_t accepted_encodings_ = 0;
     bool paused_ = false;
     bool finished_ = false;
-    bool handled_from_cache_ = false;
+    bool handled_ = false; // answered before the body arrived (cache hit, 404)
+    bool routed_ = false; // taken over by a module in the ROUTE stage
+    bool resolving_ = false;
+    bool deferred_ = false; // a module hook is finishing asynchronously, ingress is paused
+    bool spilling_ = false; // part of the request body is being written out, ingress is paused
+    bool eom_received_ = false;
+    bool flight_checked_ = false;
+    bool conditional_checked_ = false;
+    bool leading_ = false;
+    bool waiting_for_flight_ = false;
     bool error_ = false;
     folly::EventBase *event_base_;
 };
+
+// Requests being handled by all workers; an upgraded process exits once this drops to zero.
+size_t requestsInFlight();
+
+// Loads `paths` into the cache on the CPU executor, as if each had just been served. Files that are gone
+// or too large for the cache are skipped.
+void warmResponseCache(Cache::ResponseCache *cache, std::vector<std::string> paths);
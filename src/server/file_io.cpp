@@ -0,0 +1,411 @@
+#include "file_io.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <folly/executors/GlobalExecutor.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/logging/xlog.h>
+
+#ifdef WBSRV_HAVE_IO_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <folly/io/async/EventBaseLocal.h>
+#include <folly/io/async/EventHandler.h>
+#endif
+
+namespace FileIO {
+    namespace {
+        class ThreadPoolBackend final : public Backend {
+        public:
+            const char *name() const noexcept override {
+                return "threads";
+            }
+
+            void open(folly::EventBase *evb, const folly::fbstring &path, OpenCallback callback) override {
+                folly::getUnsafeMutableGlobalCPUExecutor()->add(
+                    [evb, path = path, callback = std::move(callback)]() mutable {
+                        OpenResult result;
+                        result.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                        struct stat st{};
+                        if (result.fd < 0) {
+                            result.error = errno;
+                        } else if (fstat(result.fd, &st) != 0) {
+                            result.error = errno;
+                            close(result.fd);
+                            result.fd = -1;
+                        } else {
+                            result.metadata = Cache::FileSystemMetadata::fromStat(st);
+                        }
+
+                        evb->runInEventBaseThread([callback = std::move(callback), result]() mutable {
+                            callback(result);
+                        });
+                    });
+            }
+
+            void stat(folly::EventBase *evb, const folly::fbstring &path, OpenCallback callback) override {
+                folly::getUnsafeMutableGlobalCPUExecutor()->add(
+                    [evb, path = path, callback = std::move(callback)]() mutable {
+                        OpenResult result;
+                        struct stat st{};
+                        if (::stat(path.c_str(), &st) != 0) {
+                            result.error = errno;
+                        } else {
+                            result.metadata = Cache::FileSystemMetadata::fromStat(st);
+                        }
+
+                        evb->runInEventBaseThread([callback = std::move(callback), result]() mutable {
+                            callback(result);
+                        });
+                    });
+            }
+
+            void read(folly::EventBase *evb, int fd, uint64_t offset, size_t length, ReadCallback callback) override {
+                folly::getUnsafeMutableGlobalCPUExecutor()->add(
+                    [evb, fd, offset, length, callback = std::move(callback)]() mutable {
+                        auto buffer = folly::IOBuf::create(length);
+                        const ssize_t rc = pread(fd, buffer->writableData(), length, static_cast<off_t>(offset));
+                        const int error = rc < 0 ? errno : 0;
+                        if (rc >= 0) {
+                            buffer->append(static_cast<size_t>(rc));
+                        } else {
+                            buffer.reset();
+                        }
+
+                        evb->runInEventBaseThread(
+                            [callback = std::move(callback), buffer = std::move(buffer), error]() mutable {
+                                callback(std::move(buffer), error);
+                            });
+                    });
+            }
+        };
+
+#ifdef WBSRV_HAVE_IO_URING
+        Cache::FileSystemMetadata fromStatx(const struct statx &stx) noexcept {
+            Cache::FileSystemMetadata meta;
+            meta.is_directory = S_ISDIR(stx.stx_mode);
+            meta.read_only = !(stx.stx_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+            meta.size = stx.stx_size;
+            meta.mtime_ns = static_cast<int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+            meta.inode = stx.stx_ino;
+            meta.computeETag();
+            return meta;
+        }
+
+        // One ring per EventBase. Submissions made during a loop iteration are batched into a single
+        // io_uring_submit() from a loop callback; completions are signalled through an eventfd that the
+        // EventBase polls, so callbacks run on the loop that issued them without any thread hops.
+        class Ring final : public folly::EventHandler, public folly::EventBase::LoopCallback {
+        public:
+            explicit Ring(folly::EventBase *evb) : folly::EventHandler(evb), evb_(evb) {
+            }
+
+            ~Ring() override {
+                if (!initialized_) {
+                    return;
+                }
+
+                unregisterHandler();
+                cancelLoopCallback();
+
+                // The kernel may still write into buffers owned by in-flight requests.
+                io_uring_submit(&ring_);
+                while (inflight_ > 0) {
+                    io_uring_cqe *cqe = nullptr;
+                    if (io_uring_wait_cqe(&ring_, &cqe) < 0) break;
+                    discard(cqe->user_data, cqe->res);
+                    io_uring_cqe_seen(&ring_, cqe);
+                    inflight_--;
+                }
+
+                io_uring_queue_exit(&ring_);
+                close(event_fd_);
+            }
+
+            bool initialize(unsigned depth) {
+                if (io_uring_queue_init(depth, &ring_, 0) < 0) {
+                    return false;
+                }
+
+                event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (event_fd_ < 0 || io_uring_register_eventfd(&ring_, event_fd_) < 0) {
+                    if (event_fd_ >= 0) close(event_fd_);
+                    io_uring_queue_exit(&ring_);
+                    return false;
+                }
+
+                changeHandlerFD(folly::NetworkSocket::fromFd(event_fd_));
+                registerHandler(folly::EventHandler::READ | folly::EventHandler::PERSIST);
+                initialized_ = true;
+                return true;
+            }
+
+            // These return false, leaving `callback` alone, when the submission queue has no room even after
+            // a flush; the caller then takes the thread pool instead.
+            bool open(const folly::fbstring &path, OpenCallback &callback) {
+                io_uring_sqe *sqe = next_sqe();
+                if (!sqe) [[unlikely]] {
+                    return false;
+                }
+                auto *request = new OpenRequest{path.toStdString(), {}, -1, std::move(callback)};
+
+                // The statx follows once the descriptor exists, on the descriptor itself, so the metadata
+                // always belongs to the file that was opened even if the path is renamed in between.
+                io_uring_prep_openat(sqe, AT_FDCWD, request->path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+                io_uring_sqe_set_data64(sqe, tag(request, OPEN));
+                return true;
+            }
+
+            bool stat(const folly::fbstring &path, OpenCallback &callback) {
+                io_uring_sqe *sqe = next_sqe();
+                if (!sqe) [[unlikely]] {
+                    return false;
+                }
+                auto *request = new OpenRequest{path.toStdString(), {}, -1, std::move(callback)};
+
+                io_uring_prep_statx(sqe, AT_FDCWD, request->path.c_str(), 0, STATX_MASK, &request->stx);
+                io_uring_sqe_set_data64(sqe, tag(request, STAT));
+                return true;
+            }
+
+            bool read(int fd, uint64_t offset, size_t length, ReadCallback &callback) {
+                io_uring_sqe *sqe = next_sqe();
+                if (!sqe) [[unlikely]] {
+                    return false;
+                }
+                auto *request = new ReadRequest{folly::IOBuf::create(length), std::move(callback)};
+
+                io_uring_prep_read(sqe, fd, request->buffer->writableData(), length, offset);
+                io_uring_sqe_set_data64(sqe, tag(request, READ));
+                return true;
+            }
+
+            void runLoopCallback() noexcept override {
+                io_uring_submit(&ring_);
+            }
+
+            void handlerReady(uint16_t /*events*/) noexcept override {
+                uint64_t count;
+                [[maybe_unused]] auto rc = ::read(event_fd_, &count, sizeof(count));
+
+                io_uring_cqe *cqe = nullptr;
+                while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+                    const uint64_t data = cqe->user_data;
+                    const int res = cqe->res;
+                    io_uring_cqe_seen(&ring_, cqe);
+                    inflight_--;
+                    complete(data, res);
+                }
+            }
+
+        private:
+            enum Kind : uint64_t {
+                OPEN = 0,
+                STATX = 1, // statx of the descriptor an OPEN returned
+                READ = 2,
+                STAT = 3, // statx without an open
+            };
+
+            static constexpr uint64_t KIND_MASK = 3;
+            static constexpr unsigned STATX_MASK = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO;
+
+            struct OpenRequest {
+                std::string path;
+                struct statx stx;
+                int fd;
+                OpenCallback callback;
+            };
+
+            struct ReadRequest {
+                std::unique_ptr<folly::IOBuf> buffer;
+                ReadCallback callback;
+            };
+
+            static uint64_t tag(void *request, Kind kind) noexcept {
+                return reinterpret_cast<uint64_t>(request) | kind;
+            }
+
+            // Null when the queue stays full, e.g. because the kernel refused the flush.
+            io_uring_sqe *next_sqe() {
+                io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+                if (!sqe) [[unlikely]] {
+                    // Queue full: flush what we have, submission consumes every queued entry.
+                    io_uring_submit(&ring_);
+                    sqe = io_uring_get_sqe(&ring_);
+                    if (!sqe) {
+                        return nullptr;
+                    }
+                }
+                inflight_++;
+                if (!isLoopCallbackScheduled()) {
+                    evb_->runInLoop(this);
+                }
+                return sqe;
+            }
+
+            void complete(uint64_t data, int res) {
+                const auto kind = static_cast<Kind>(data & KIND_MASK);
+
+                if (kind == READ) {
+                    std::unique_ptr<ReadRequest> request(reinterpret_cast<ReadRequest *>(data & ~KIND_MASK));
+                    if (res < 0) {
+                        request->callback(nullptr, -res);
+                    } else {
+                        request->buffer->append(static_cast<size_t>(res));
+                        request->callback(std::move(request->buffer), 0);
+                    }
+                    return;
+                }
+
+                auto *request = reinterpret_cast<OpenRequest *>(data & ~KIND_MASK);
+                if (kind == OPEN && res >= 0) {
+                    request->fd = res;
+                    if (io_uring_sqe *sqe = next_sqe()) {
+                        io_uring_prep_statx(sqe, res, "", AT_EMPTY_PATH, STATX_MASK, &request->stx);
+                        io_uring_sqe_set_data64(sqe, tag(request, STATX));
+                        return;
+                    }
+                    // No room for the statx: the inode of a file just opened is in memory, fstat() won't block.
+                    struct stat st{};
+                    res = fstat(res, &st) == 0 ? 0 : -errno;
+                    if (res == 0) {
+                        std::unique_ptr<OpenRequest> owned(request);
+                        OpenResult result;
+                        result.fd = owned->fd;
+                        result.metadata = Cache::FileSystemMetadata::fromStat(st);
+                        owned->callback(result);
+                        return;
+                    }
+                }
+
+                std::unique_ptr<OpenRequest> owned(request);
+                OpenResult result;
+                if (res < 0) {
+                    if (owned->fd >= 0) close(owned->fd);
+                    result.error = -res;
+                } else {
+                    result.fd = owned->fd;
+                    result.metadata = fromStatx(owned->stx);
+                }
+                owned->callback(result);
+            }
+
+            static void discard(uint64_t data, int res) {
+                const auto kind = static_cast<Kind>(data & KIND_MASK);
+                if (kind == READ) {
+                    delete reinterpret_cast<ReadRequest *>(data & ~KIND_MASK);
+                    return;
+                }
+                auto *request = reinterpret_cast<OpenRequest *>(data & ~KIND_MASK);
+                if (kind == OPEN && res >= 0) {
+                    close(res);
+                } else if (request->fd >= 0) {
+                    close(request->fd);
+                }
+                delete request;
+            }
+
+            folly::EventBase *evb_;
+            io_uring ring_{};
+            int event_fd_ = -1;
+            size_t inflight_ = 0;
+            bool initialized_ = false;
+        };
+
+        class IoUringBackend final : public Backend {
+        public:
+            explicit IoUringBackend(unsigned queue_depth) : queue_depth_(queue_depth) {
+            }
+
+            const char *name() const noexcept override {
+                return "io_uring";
+            }
+
+            void open(folly::EventBase *evb, const folly::fbstring &path, OpenCallback callback) override {
+                Ring *ring = ring_for(evb);
+                if (!ring || !ring->open(path, callback)) {
+                    fallback_.open(evb, path, std::move(callback));
+                }
+            }
+
+            void stat(folly::EventBase *evb, const folly::fbstring &path, OpenCallback callback) override {
+                Ring *ring = ring_for(evb);
+                if (!ring || !ring->stat(path, callback)) {
+                    fallback_.stat(evb, path, std::move(callback));
+                }
+            }
+
+            void read(folly::EventBase *evb, int fd, uint64_t offset, size_t length, ReadCallback callback) override {
+                Ring *ring = ring_for(evb);
+                if (!ring || !ring->read(fd, offset, length, callback)) {
+                    fallback_.read(evb, fd, offset, length, std::move(callback));
+                }
+            }
+
+        private:
+            Ring *ring_for(folly::EventBase *evb) {
+                if (auto *ring = rings_.get(*evb)) {
+                    return ring->get();
+                }
+
+                auto ring = std::make_unique<Ring>(evb);
+                if (!ring->initialize(queue_depth_)) {
+                    // e.g. RLIMIT_MEMLOCK exhausted; remember it and keep this loop on the thread pool.
+                    XLOG(WARN) << "io_uring setup failed on an event loop, using the thread pool there";
+                    ring.reset();
+                }
+                return rings_.emplace(*evb, std::move(ring)).get();
+            }
+
+            unsigned queue_depth_;
+            folly::EventBaseLocal<std::unique_ptr<Ring> > rings_;
+            ThreadPoolBackend fallback_;
+        };
+
+        // A ring alone is not enough: kernels before 5.6 have io_uring without OPENAT, STATX and READ, and
+        // would fail every file with EINVAL. They also lack the probe itself, which answers for them.
+        bool io_uring_supported(unsigned queue_depth) {
+            io_uring ring{};
+            if (io_uring_queue_init(queue_depth, &ring, 0) < 0) {
+                return false;
+            }
+            io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+            const bool supported = probe && io_uring_opcode_supported(probe, IORING_OP_OPENAT) &&
+                                   io_uring_opcode_supported(probe, IORING_OP_STATX) &&
+                                   io_uring_opcode_supported(probe, IORING_OP_READ);
+            if (probe) {
+                io_uring_free_probe(probe);
+            }
+            io_uring_queue_exit(&ring);
+            return supported;
+        }
+#endif
+
+        std::unique_ptr<Backend> g_backend;
+    } // namespace
+
+    void initialize(const std::string &name, [[maybe_unused]] unsigned queue_depth) {
+#ifdef WBSRV_HAVE_IO_URING
+        if (name == "io_uring") {
+            if (io_uring_supported(queue_depth)) {
+                g_backend = std::make_unique<IoUringBackend>(queue_depth);
+            } else {
+                XLOG(WARN) << "io_uring is not available on this kernel, falling back to the thread pool";
+            }
+        }
+#else
+        if (name == "io_uring") {
+            XLOG(WARN) << "Built without liburing, falling back to the thread pool for file I/O";
+        }
+#endif
+        if (!g_backend) {
+            g_backend = std::make_unique<ThreadPoolBackend>();
+        }
+        XLOG(INFO) << "Static file I/O backend: " << g_backend->name();
+    }
+
+    Backend &backend() {
+        return *g_backend;
+    }
+} // namespace FileIO
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <folly/FBString.h>
+#include <folly/Function.h>
+#include <folly/io/IOBuf.h>
+
+#include "utils/cache.h"
+
+namespace folly {
+    class EventBase;
+}
+
+namespace FileIO {
+    struct OpenResult {
+        int fd = -1; // owned by the callback
+        int error = 0; // errno value on failure
+        Cache::FileSystemMetadata metadata;
+    };
+
+    using OpenCallback = folly::Function<void(OpenResult)>;
+    // An empty buffer means end of file; on failure the buffer is null and error holds errno.
+    using ReadCallback = folly::Function<void(std::unique_ptr<folly::IOBuf> data, int error)>;
+
+    // Asynchronous file access for the static path. Requests are issued from an EventBase thread and
+    // their callbacks run on that same EventBase.
+    class Backend {
+    public:
+        virtual ~Backend() = default;
+
+        virtual const char *name() const noexcept = 0;
+
+        // Opens `path` read-only and stats it.
+        virtual void open(folly::EventBase *evb, const folly::fbstring &path, OpenCallback callback) = 0;
+
+        // Stats `path` without opening it; the result carries no descriptor.
+        virtual void stat(folly::EventBase *evb, const folly::fbstring &path, OpenCallback callback) = 0;
+
+        // Reads up to `length` bytes at `offset`.
+        virtual void read(folly::EventBase *evb, int fd, uint64_t offset, size_t length, ReadCallback callback) = 0;
+    };
+
+    // Picks the process-wide backend: "io_uring" (when compiled in and supported by the kernel) or
+    // "threads", which runs blocking syscalls on the global CPU executor.
+    void initialize(const std::string &name, unsigned queue_depth);
+
+    Backend &backend();
+} // namespace FileIO
@@ -9,6 +9,14 @@ namespace ModuleManage {
     inline void System<MAX_MODULES>::sort_modules() noexcept {
         Module *__restrict__ modules = modules_.data();
 
+        cache_hit_hooks_ = 0;
+        for (size_t i = 0; i < module_count_; ++i) {
+            if (modules[i].enabled && !modules[i].skips_cache_hits &&
+                (modules[i].pre_response_hook || modules[i].post_response_hook)) {
+                cache_hit_hooks_++;
+            }
+        }
+
         for (size_t stage = 0; stage < static_cast<size_t>(HookStage::HOOK_STAGE_COUNT); ++stage) {
             hook_count_[stage] = 0;
             uint8_t *__restrict__ order = execution_order_[stage].data();
@@ -43,6 +51,7 @@ namespace ModuleManage {
             case HookStage::PRE_REQUEST: return module.pre_request_hook;
             case HookStage::PRE_RESPONSE: return module.pre_response_hook;
             case HookStage::POST_RESPONSE: return module.post_response_hook;
+            case HookStage::ROUTE: return module.route_hook;
             default: return nullptr;
         }
     }
@@ -83,47 +92,89 @@ namespace ModuleManage {
         }
     }
 
+    template<size_t MAX_MODULES>
+    void System<MAX_MODULES>::notify_file_changed(const std::string &path) noexcept {
+        const Module *__restrict__ modules = modules_.data();
+
+        for (size_t i = 0; i < module_count_; ++i) {
+            if (modules[i].enabled && modules[i].file_changed) {
+                modules[i].file_changed(path);
+            }
+        }
+    }
+
+    template<size_t MAX_MODULES>
+    void System<MAX_MODULES>::notify_config_reloaded() noexcept {
+        const Module *__restrict__ modules = modules_.data();
+
+        for (size_t i = 0; i < module_count_; ++i) {
+            if (modules[i].enabled && modules[i].config_reloaded) {
+                modules[i].config_reloaded();
+            }
+        }
+    }
+
     template<size_t MAX_MODULES>
     [[gnu::hot]] [[gnu::flatten]]
     inline ModuleResult System<MAX_MODULES>::execute_hooks(HookStage stage, ModuleContext &ctx) noexcept {
-        const size_t stage_idx = static_cast<size_t>(stage);
-        const size_t count = hook_count_[stage_idx];
-
         // Early exit for empty hook lists
-        if (count == 0) [[unlikely]] {
+        if (hook_count_[static_cast<size_t>(stage)] == 0) [[unlikely]] {
             return ModuleResult::CONTINUE;
         }
+        return run_hooks(stage, ctx, 0);
+    }
+
+    template<size_t MAX_MODULES>
+    [[gnu::hot]]
+    inline ModuleResult System<MAX_MODULES>::run_hooks(HookStage stage, ModuleContext &ctx, size_t first) noexcept {
+        const size_t stage_idx = static_cast<size_t>(stage);
+        const size_t count = hook_count_[stage_idx];
 
         // Use restrict pointers for better optimization
         const uint8_t *__restrict__ order = execution_order_[stage_idx].data();
         const Module *__restrict__ modules = modules_.data();
 
-        // Unroll small loops for better performance
-        if (count <= 4) {
-            for (size_t i = 0; i < count; ++i) {
-                const uint8_t idx = order[i];
-                const ModuleHook hook = get_hook_direct(modules[idx], stage);
+        for (size_t i = first; i < count; ++i) {
+            const uint8_t idx = order[i];
+            const ModuleHook hook = get_hook_direct(modules[idx], stage);
 
-                const ModuleResult result = hook(ctx);
-                if (result != ModuleResult::CONTINUE) [[unlikely]] {
-                    return result;
-                }
-            }
-        } else {
-            // Standard loop for larger hook counts
-            for (size_t i = 0; i < count; ++i) {
-                const uint8_t idx = order[i];
-                const ModuleHook hook = get_hook_direct(modules[idx], stage);
-
-                const ModuleResult result = hook(ctx);
-                if (result != ModuleResult::CONTINUE) [[unlikely]] {
-                    return result;
+            const ModuleResult result = hook(ctx);
+            if (result != ModuleResult::CONTINUE) [[unlikely]] {
+                if (result == ModuleResult::DEFER) {
+                    ctx.deferred_stage_ = stage;
+                    ctx.deferred_next_ = static_cast<uint8_t>(i + 1);
                 }
+                return result;
             }
         }
 
         return ModuleResult::CONTINUE;
     }
 
+    template<size_t MAX_MODULES>
+    void System<MAX_MODULES>::resume_hooks(ModuleContext &ctx, ModuleResult result) noexcept {
+        const HookStage stage = ctx.deferred_stage_;
+        if (stage == HookStage::HOOK_STAGE_COUNT) [[unlikely]] {
+            XLOG(ERR) << "Module hooks resumed without a deferred stage";
+            return;
+        }
+        ctx.deferred_stage_ = HookStage::HOOK_STAGE_COUNT;
+
+        if (result == ModuleResult::CONTINUE) {
+            result = run_hooks(stage, ctx, ctx.deferred_next_);
+        }
+        if (result == ModuleResult::DEFER || !ctx.resume_listener) {
+            return;
+        }
+        // The listener may set up the next deferral, so it is released before it runs.
+        auto listener = std::move(ctx.resume_listener);
+        ctx.resume_listener = nullptr;
+        listener(result);
+    }
+
+    void ModuleContext::resume(ModuleResult result) noexcept {
+        g_moduleSystem.resume_hooks(*this, result);
+    }
+
     template class System<32>;
 } // namespace ModuleManage
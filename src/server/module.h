@@ -3,52 +3,117 @@
 #include <array>
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <folly/Function.h>
 #include <folly/io/IOBuf.h>
 #include <proxygen/httpserver/ResponseBuilder.h>
 
+#include "utils/request_body.h"
+
+namespace folly {
+    class EventBase;
+}
+
 namespace proxygen {
     class ResponseBuilder;
     class HTTPMessage;
 }
 
+namespace Cache {
+    struct VirtualHostConfig;
+}
+
 namespace ModuleManage {
     enum class HookStage : uint8_t {
         PRE_REQUEST = 0,
         PRE_RESPONSE = 1,
         POST_RESPONSE = 2,
-        HOOK_STAGE_COUNT = 3
+        // Once the virtual host is known, before the path is mapped to a file. A module returning BREAK
+        // takes the request over, including its body as it arrives.
+        ROUTE = 3,
+        HOOK_STAGE_COUNT = 4
     };
 
     enum class ModuleResult : uint8_t {
         CONTINUE = 0,
         BREAK = 1,
+        // The hook finished its work asynchronously and will call ModuleContext::resume() with its real
+        // result. The stage stops there and execute_hooks() returns DEFER to the caller.
+        DEFER = 2,
     };
 
+    template<size_t MAX_MODULES>
+    class System;
+
     struct ModuleContext {
+        // The virtual host the request was routed to; valid until the request goes away.
+        const Cache::VirtualHostConfig *vhost = nullptr;
         folly::fbstring document_root;
         folly::fbstring file_path;
         uint64_t file_path_hash;
-        std::shared_ptr<folly::IOBuf> request_body;
+        Utils::RequestBody request_body; // complete once PRE_RESPONSE runs
         std::unique_ptr<proxygen::HTTPMessage> request;
         std::unique_ptr<proxygen::ResponseBuilder> response;
+        // Loop that owns the request; `response` may only be used there.
+        folly::EventBase *event_base = nullptr;
+        // Whether the client is currently taking response data. A module that streams a response can stop
+        // producing while it is paused; `egress_listener` is told whenever that changes.
+        bool egress_paused = false;
+        folly::Function<void(bool paused)> egress_listener;
+
+        // Only set for requests taken over in ROUTE. `downstream` is there for ingress flow control and
+        // aborts; `body_listener` gets the body a chunk at a time, then nullptr at its end.
+        proxygen::ResponseHandler *downstream = nullptr;
+        folly::Function<void(std::unique_ptr<folly::IOBuf> chunk)> body_listener;
+        // Called when the request goes away; it must not touch the context any more.
+        folly::Function<void()> close_listener;
+        // Set by whoever got DEFER from execute_hooks(): receives the stage's result once it completes.
+        folly::Function<void(ModuleResult result)> resume_listener;
 
         ~ModuleContext() noexcept {
+            if (close_listener) {
+                close_listener();
+            }
+        }
+
+        // Handle for work that completes off the request path: lock it on `event_base` before touching the
+        // context. It expires when the request goes away (client disconnect, handler teardown).
+        std::weak_ptr<ModuleContext> weak() {
+            if (!self_) {
+                self_.reset(this, [](ModuleContext *) {
+                });
+            }
+            return self_;
         }
 
         inline bool hasRequestBody() const noexcept {
-            return request_body && !request_body->empty();
+            return !request_body.empty();
         }
 
-        inline folly::fbstring getRequestBody() const noexcept {
+        // Copies the whole body; large bodies are better consumed with a Utils::RequestBody::Reader.
+        inline folly::fbstring getRequestBody() const {
             if (!hasRequestBody()) {
                 return {};
             }
-            return request_body->moveToFbString();
+            return request_body.toString();
         }
 
         inline size_t getRequestBodySize() const noexcept {
-            return request_body ? request_body->computeChainDataLength() : 0;
+            return request_body.size();
         }
+
+        // Continues the stage a hook DEFERred. Call it once, on `event_base`, after the hook has returned;
+        // CONTINUE runs the rest of the stage's hooks, anything else ends the stage with that result.
+        void resume(ModuleResult result) noexcept;
+
+    private:
+        template<size_t MAX_MODULES>
+        friend class System;
+
+        std::shared_ptr<ModuleContext> self_;
+        // Where a deferred stage picks up again.
+        HookStage deferred_stage_ = HookStage::HOOK_STAGE_COUNT;
+        uint8_t deferred_next_ = 0;
     };
 
     using ModuleHook = ModuleResult(*)(ModuleContext &);
@@ -66,6 +131,19 @@ namespace ModuleManage {
         bool (*init)(void);
 
         void (*cleanup)(void);
+
+        // A file below a document root changed; an empty path means anything may have. Called on the
+        // file watcher thread.
+        void (*file_changed)(const std::string &path);
+
+        ModuleHook route_hook;
+
+        // The response hooks never act on static files served from the cache, so cache hits may skip them.
+        bool skips_cache_hits;
+
+        // The host files were reloaded (SIGHUP): Config::virtual_hosts and Config::proxy_routes are new.
+        // Called on the reload thread while requests keep running.
+        void (*config_reloaded)(void);
     };
 
     template<size_t MAX_MODULES = 32>
@@ -76,11 +154,15 @@ namespace ModuleManage {
         execution_order_;
         alignas(64) std::array<size_t, static_cast<size_t>(HookStage::HOOK_STAGE_COUNT)> hook_count_;
         size_t module_count_;
+        size_t cache_hit_hooks_ = 0;
 
         inline void sort_modules() noexcept;
 
         constexpr inline ModuleHook get_hook_direct(const Module &module, HookStage stage) noexcept;
 
+        [[gnu::hot]]
+        inline ModuleResult run_hooks(HookStage stage, ModuleContext &ctx, size_t first) noexcept;
+
     public:
         System() noexcept : module_count_(0) {
             hook_count_.fill(0);
@@ -92,8 +174,24 @@ namespace ModuleManage {
 
         void cleanup() noexcept;
 
+        void notify_file_changed(const std::string &path) noexcept;
+
+        void notify_config_reloaded() noexcept;
+
+        bool has_hooks(HookStage stage) const noexcept {
+            return hook_count_[static_cast<size_t>(stage)] != 0;
+        }
+
+        // Whether a cache hit has to go through the response stages at all.
+        bool has_cache_hit_hooks() const noexcept {
+            return cache_hit_hooks_ != 0;
+        }
+
         [[gnu::hot]] [[gnu::flatten]]
         inline ModuleResult execute_hooks(HookStage stage, ModuleContext &ctx) noexcept;
+
+        // Picks up a stage left with DEFER; see ModuleContext::resume().
+        void resume_hooks(ModuleContext &ctx, ModuleResult result) noexcept;
     };
 } // namespace ModuleManage
 
@@ -0,0 +1,397 @@
+#include "upgrade.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <folly/logging/xlog.h>
+
+namespace Upgrade {
+    namespace {
+        constexpr uint32_t MAGIC = 0x77627375; // "wbsu"
+        constexpr char ACCEPTING = 'A';
+        constexpr size_t MAX_SOCKETS = 64;
+        constexpr size_t MAX_WARM_LIST_BYTES = 64 << 20;
+        // Reads by the new process. The old one waits longer for the acknowledgement, which only comes
+        // after the new process has loaded its hosts and modules.
+        constexpr timeval REPLY_TIMEOUT{10, 0};
+        constexpr timeval ACCEPTING_TIMEOUT{120, 0};
+        // For the connecting side to say what it wants.
+        constexpr timeval HELLO_TIMEOUT{5, 0};
+
+        // Sent first by whoever connects. Nothing is handed over without a TAKEOVER.
+        enum Intent : uint32_t {
+            TAKEOVER = 1,
+            PING = 2, // only checks that a server is waiting on the path
+        };
+
+        struct Hello {
+            uint32_t magic;
+            uint32_t intent;
+        };
+
+        // Sent with the descriptors attached, followed by `addresses_bytes` of addresses and
+        // `warm_list_bytes` of paths, each list separated by newlines.
+        struct Header {
+            uint32_t magic;
+            uint32_t sockets;
+            uint32_t addresses_bytes;
+            uint32_t warm_list_bytes;
+        };
+
+        bool unix_address(const std::string &path, sockaddr_un &address) {
+            if (path.size() >= sizeof(address.sun_path)) {
+                XLOG(ERR) << "Upgrade socket path " << path << " is too long";
+                return false;
+            }
+            address = {};
+            address.sun_family = AF_UNIX;
+            std::memcpy(address.sun_path, path.data(), path.size());
+            return true;
+        }
+
+        void set_timeout(int fd, const timeval &timeout) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+
+        void close_all(const std::vector<int> &fds) {
+            for (const int fd: fds) {
+                close(fd);
+            }
+        }
+    }
+
+    std::optional<Takeover> Takeover::request(const std::string &path,
+                                              const std::vector<folly::SocketAddress> &addresses) {
+        sockaddr_un address;
+        if (!unix_address(path, address)) {
+            return std::nullopt;
+        }
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return std::nullopt;
+        }
+        if (connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+            // Nothing running, or a socket left behind by a process that is gone.
+            close(fd);
+            return std::nullopt;
+        }
+        set_timeout(fd, REPLY_TIMEOUT);
+        Takeover takeover(fd);
+        const Hello hello{MAGIC, TAKEOVER};
+        if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(hello))) {
+            XLOG(ERR) << "Upgrade handoff on " << path << " failed: " << strerror(errno);
+            return std::nullopt;
+        }
+
+        Header header{};
+        iovec iov{&header, sizeof(header)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_SOCKETS)];
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        const ssize_t received = recvmsg(fd, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+        std::vector<int> received_fds;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const auto *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                received_fds.insert(received_fds.end(), fds, fds + count);
+            }
+        }
+        if (received != sizeof(header) || header.magic != MAGIC || (message.msg_flags & MSG_CTRUNC) ||
+            header.sockets != received_fds.size() || header.warm_list_bytes > MAX_WARM_LIST_BYTES) {
+            XLOG(ERR) << "Malformed upgrade handoff on " << path << ", binding the listeners instead";
+            close_all(received_fds);
+            return std::nullopt;
+        }
+
+        std::string listed(header.addresses_bytes, '\0');
+        std::string warm_list(header.warm_list_bytes, '\0');
+        if (folly::readFull(fd, listed.data(), listed.size()) != static_cast<ssize_t>(listed.size()) ||
+            folly::readFull(fd, warm_list.data(), warm_list.size()) != static_cast<ssize_t>(warm_list.size())) {
+            XLOG(ERR) << "Upgrade handoff on " << path << " was cut short: " << strerror(errno);
+            close_all(received_fds);
+            return std::nullopt;
+        }
+
+        std::vector<std::string> offered;
+        folly::split('\n', listed, offered, true);
+        if (offered.size() != received_fds.size()) {
+            XLOG(ERR) << "Malformed upgrade handoff on " << path << ", binding the listeners instead";
+            close_all(received_fds);
+            return std::nullopt;
+        }
+
+        // Listeners this configuration no longer has are simply closed.
+        std::vector<bool> used(received_fds.size(), false);
+        for (const auto &wanted: addresses) {
+            const auto it = std::ranges::find(offered, wanted.describe());
+            if (it == offered.end()) {
+                XLOG(ERR) << "The running server does not listen on " << wanted.describe()
+                        << ", restart it instead of upgrading";
+                close_all(received_fds);
+                return std::nullopt;
+            }
+            const size_t index = it - offered.begin();
+            used[index] = true;
+            takeover.sockets_.push_back(received_fds[index]);
+        }
+        for (size_t i = 0; i < received_fds.size(); ++i) {
+            if (!used[i]) close(received_fds[i]);
+        }
+
+        folly::split('\n', warm_list, takeover.warm_paths, true);
+        XLOG(INFO) << "Took over " << takeover.sockets_.size() << " listening sockets and a warm list of "
+                << takeover.warm_paths.size() << " files from the running server";
+        return takeover;
+    }
+
+    Takeover::Takeover(Takeover &&other) noexcept : warm_paths(std::move(other.warm_paths)),
+                                                     connection_(std::exchange(other.connection_, -1)),
+                                                     sockets_(std::move(other.sockets_)) {
+    }
+
+    Takeover &Takeover::operator=(Takeover &&other) noexcept {
+        if (this != &other) {
+            if (connection_ >= 0) {
+                close(connection_);
+            }
+            warm_paths = std::move(other.warm_paths);
+            connection_ = std::exchange(other.connection_, -1);
+            sockets_ = std::move(other.sockets_);
+        }
+        return *this;
+    }
+
+    Takeover::~Takeover() {
+        if (connection_ >= 0) {
+            close(connection_);
+        }
+    }
+
+    void Takeover::complete() {
+        if (connection_ < 0) {
+            return;
+        }
+        if (folly::writeFull(connection_, &ACCEPTING, 1) == 1) {
+            // The old process closes the connection after it let go of the path.
+            char byte;
+            while (read(connection_, &byte, 1) > 0) {
+            }
+        }
+        close(connection_);
+        connection_ = -1;
+    }
+
+    Handoff::~Handoff() {
+        stop();
+    }
+
+    bool Handoff::start(const std::string &path) {
+        sockaddr_un address;
+        if (!unix_address(path, address)) {
+            return false;
+        }
+
+        socket_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (socket_fd_ < 0) {
+            XLOG(ERR) << "Failed to create the upgrade socket: " << strerror(errno);
+            return false;
+        }
+        // A socket file that refuses connections was left behind by a process that is gone and may be
+        // replaced; one that answers belongs to a server that is still running.
+        if (const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0); probe >= 0) {
+            const bool answered = connect(probe, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+            const bool stale = !answered && errno == ECONNREFUSED;
+            if (answered) {
+                const Hello hello{MAGIC, PING};
+                [[maybe_unused]] auto rc = send(probe, &hello, sizeof(hello), MSG_NOSIGNAL);
+            }
+            close(probe);
+            if (answered) {
+                XLOG(ERR) << "Another server is waiting for upgrades on " << path << ", not taking it over";
+                close(socket_fd_);
+                socket_fd_ = -1;
+                return false;
+            }
+            if (stale) {
+                unlink(path.c_str());
+            }
+        }
+        if (bind(socket_fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+            XLOG(ERR) << "Failed to bind upgrade socket " << path << ": " << strerror(errno);
+            close(socket_fd_);
+            socket_fd_ = -1;
+            return false;
+        }
+        // Whoever connects gets the listeners, so only the owner may; serve() checks the peer as well.
+        if (chmod(path.c_str(), 0600) != 0 || listen(socket_fd_, 1) != 0) {
+            XLOG(ERR) << "Failed to listen on upgrade socket " << path << ": " << strerror(errno);
+            close(socket_fd_);
+            socket_fd_ = -1;
+            unlink(path.c_str());
+            return false;
+        }
+
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            close(socket_fd_);
+            socket_fd_ = -1;
+            unlink(path.c_str());
+            return false;
+        }
+
+        path_ = path;
+        owns_path_ = true;
+        running_ = true;
+        thread_ = std::thread([this]() { run(); });
+        XLOG(INFO) << "Waiting for upgrades on " << path_;
+        return true;
+    }
+
+    void Handoff::stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+
+        const uint64_t one = 1;
+        [[maybe_unused]] auto rc = write(wake_fd_, &one, sizeof(one));
+        thread_.join();
+
+        if (socket_fd_ >= 0) {
+            close(socket_fd_);
+            socket_fd_ = -1;
+        }
+        if (owns_path_) {
+            unlink(path_.c_str());
+            owns_path_ = false;
+        }
+        close(wake_fd_);
+        wake_fd_ = -1;
+    }
+
+    void Handoff::run() {
+        pollfd fds[2] = {{socket_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+
+        while (running_) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                XLOG(ERR) << "Upgrade socket poll failed: " << strerror(errno);
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                break;
+            }
+            if (!(fds[0].revents & POLLIN)) {
+                continue;
+            }
+
+            const int connection = accept4(socket_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (connection < 0) {
+                continue;
+            }
+            if (!serve(connection)) {
+                close(connection);
+                continue;
+            }
+
+            // Give up the path before the new process hears back, so it can wait there itself.
+            unlink(path_.c_str());
+            owns_path_ = false;
+            close(socket_fd_);
+            socket_fd_ = -1;
+            close(connection);
+            on_handed_over_();
+            break;
+        }
+    }
+
+    bool Handoff::serve(int connection) {
+        ucred peer{};
+        socklen_t peer_length = sizeof(peer);
+        if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) != 0 ||
+            (peer.uid != 0 && peer.uid != geteuid())) {
+            XLOG(WARN) << "Refusing an upgrade from uid " << peer.uid;
+            return false;
+        }
+        set_timeout(connection, HELLO_TIMEOUT);
+        Hello hello{};
+        if (folly::readFull(connection, &hello, sizeof(hello)) != static_cast<ssize_t>(sizeof(hello)) ||
+            hello.magic != MAGIC) {
+            XLOG(WARN) << "Ignoring a connection on the upgrade socket that did not ask for an upgrade";
+            return false;
+        }
+        if (hello.intent != TAKEOVER) {
+            return false; // a ping from a server checking whether this path is taken
+        }
+        set_timeout(connection, ACCEPTING_TIMEOUT);
+
+        const std::vector<Listener> listeners = listeners_();
+        if (listeners.empty() || listeners.size() > MAX_SOCKETS) {
+            XLOG(ERR) << "Cannot hand over " << listeners.size() << " listening sockets";
+            return false;
+        }
+        std::string addresses;
+        for (const auto &listener: listeners) {
+            addresses += listener.address.describe();
+            addresses += '\n';
+        }
+        std::string warm_list;
+        for (const auto &path: warm_paths_()) {
+            if (warm_list.size() + path.size() + 1 > MAX_WARM_LIST_BYTES) break;
+            warm_list += path;
+            warm_list += '\n';
+        }
+
+        Header header{
+            MAGIC, static_cast<uint32_t>(listeners.size()), static_cast<uint32_t>(addresses.size()),
+            static_cast<uint32_t>(warm_list.size())
+        };
+        iovec iov{&header, sizeof(header)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_SOCKETS)] = {};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * listeners.size());
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listeners.size());
+        auto *fds = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+        for (size_t i = 0; i < listeners.size(); ++i) {
+            fds[i] = listeners[i].fd;
+        }
+
+        const auto write_all = [connection](const std::string &bytes) {
+            return folly::writeFull(connection, bytes.data(), bytes.size()) == static_cast<ssize_t>(bytes.size());
+        };
+        if (sendmsg(connection, &message, MSG_NOSIGNAL) != sizeof(header) || !write_all(addresses) ||
+            !write_all(warm_list)) {
+            XLOG(ERR) << "Failed to hand over the listening sockets: " << strerror(errno);
+            return false;
+        }
+        XLOG(INFO) << "Handed " << listeners.size() << " listening sockets to a new process, waiting for it";
+
+        // Until the new process accepts, this one keeps serving as if nothing happened.
+        char reply = 0;
+        if (folly::readFull(connection, &reply, 1) != 1 || reply != ACCEPTING) {
+            XLOG(WARN) << "The new process did not start, keeping the listeners";
+            return false;
+        }
+        return true;
+    }
+} // namespace Upgrade
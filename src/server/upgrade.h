@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <folly/SocketAddress.h>
+
+// Binary upgrades without refusing a connection: the new process connects to the running one over a Unix
+// socket and receives its listening sockets with SCM_RIGHTS, together with the paths of the files it had
+// cached. Once the new process accepts on them, the old one stops accepting, finishes the connections it
+// has and exits. Both accept from the same kernel queues in between, so no connection is lost.
+namespace Upgrade {
+    // The new process's end.
+    class Takeover {
+    public:
+        // Asks the server waiting on `path` for its sockets listening on `addresses`. nullopt when nothing
+        // answers there or that server does not listen on all of them; the caller then binds them itself.
+        static std::optional<Takeover> request(const std::string &path,
+                                               const std::vector<folly::SocketAddress> &addresses);
+
+        Takeover(Takeover &&other) noexcept;
+
+        Takeover &operator=(Takeover &&other) noexcept;
+
+        // Without complete() the old process keeps serving on its sockets.
+        ~Takeover();
+
+        // In the order of the requested addresses. The server owns them once it has started on them.
+        const std::vector<int> &sockets() const noexcept {
+            return sockets_;
+        }
+
+        // Files the old process had cached, hottest first.
+        std::vector<std::string> warm_paths;
+
+        // Call once accepting on sockets(). Returns when the old process has stopped accepting and given up
+        // `path`, so that this process can wait on it for the next upgrade.
+        void complete();
+
+    private:
+        explicit Takeover(int connection) : connection_(connection) {
+        }
+
+        int connection_;
+        std::vector<int> sockets_;
+    };
+
+    // The running process's end. Waits on a Unix socket for a new process and hands it the listeners.
+    // The callbacks run on the handoff thread; `on_handed_over` once the new process accepts on them.
+    class Handoff {
+    public:
+        struct Listener {
+            folly::SocketAddress address;
+            int fd;
+        };
+
+        Handoff(std::function<std::vector<Listener>()> listeners,
+                std::function<std::vector<std::string>()> warm_paths,
+                std::function<void()> on_handed_over)
+            : listeners_(std::move(listeners)), warm_paths_(std::move(warm_paths)),
+              on_handed_over_(std::move(on_handed_over)) {
+        }
+
+        ~Handoff();
+
+        Handoff(const Handoff &) = delete;
+
+        Handoff &operator=(const Handoff &) = delete;
+
+        bool start(const std::string &path);
+
+        void stop();
+
+    private:
+        void run();
+
+        bool serve(int connection);
+
+        std::function<std::vector<Listener>()> listeners_;
+        std::function<std::vector<std::string>()> warm_paths_;
+        std::function<void()> on_handed_over_;
+        std::string path_;
+        std::thread thread_;
+        int socket_fd_ = -1;
+        int wake_fd_ = -1;
+        bool owns_path_ = false; // false once handed over, the path is the new process's then
+        std::atomic<bool> running_{false};
+    };
+} // namespace Upgrade
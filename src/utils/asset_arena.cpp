@@ -0,0 +1,178 @@
+#include "asset_arena.h"
+
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <folly/io/IOBuf.h>
+#include <folly/logging/xlog.h>
+
+namespace Cache {
+    static size_t align_up(size_t value, size_t alignment) noexcept {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    AssetArena::~AssetArena() {
+        if (current_) {
+            release(current_);
+        }
+    }
+
+    size_t AssetArena::footprint(size_t length) noexcept {
+        return length > MAX_PACKED
+                   ? align_up(length, static_cast<size_t>(getpagesize()))
+                   : align_up(length, ALIGNMENT);
+    }
+
+    AssetArena::Block *AssetArena::map_block() {
+        void *addr = MAP_FAILED;
+
+        if (hugepages_) {
+            // Reserved hugepages first, those mappings are aligned to the hugepage size.
+            addr = mmap(nullptr, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                        -1, 0);
+        }
+        if (addr == MAP_FAILED) {
+            // Over-map and trim to a BLOCK_SIZE boundary, which also lets transparent hugepages back it.
+            void *raw = mmap(nullptr, BLOCK_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw != MAP_FAILED) {
+                const auto start = reinterpret_cast<uintptr_t>(raw);
+                const uintptr_t aligned = align_up(start, BLOCK_SIZE);
+                if (aligned > start) {
+                    munmap(raw, aligned - start);
+                }
+                if (const size_t tail = BLOCK_SIZE - (aligned - start)) {
+                    munmap(reinterpret_cast<void *>(aligned + BLOCK_SIZE), tail);
+                }
+                addr = reinterpret_cast<void *>(aligned);
+                if (hugepages_) {
+                    madvise(addr, BLOCK_SIZE, MADV_HUGEPAGE);
+                }
+            }
+        }
+
+        if (addr == MAP_FAILED) {
+            XLOG(WARN) << "Asset arena block mapping failed: " << strerror(errno);
+            return nullptr;
+        }
+
+        block_bytes_.fetch_add(BLOCK_SIZE, std::memory_order_relaxed);
+        return new(addr) Block{this, {1}, {0}};
+    }
+
+    uint8_t *AssetArena::map_body(size_t size) {
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            XLOG(WARN) << "Asset arena mapping of " << size << " bytes failed: " << strerror(errno);
+            return nullptr;
+        }
+        return static_cast<uint8_t *>(addr);
+    }
+
+    void AssetArena::release(Block *block) noexcept {
+        if (block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        {
+            std::lock_guard lock(mutex_);
+            blocks_.erase(block);
+        }
+        block_bytes_.fetch_sub(BLOCK_SIZE, std::memory_order_relaxed);
+        block->~Block();
+        munmap(block, BLOCK_SIZE);
+    }
+
+    void AssetArena::free_body(void *buf, void *footprint) noexcept {
+        Block *block = block_of(buf);
+        const auto bytes = reinterpret_cast<size_t>(footprint);
+        block->live.fetch_sub(bytes, std::memory_order_relaxed);
+        block->arena->live_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+        block->arena->release(block);
+    }
+
+    void AssetArena::free_mapping(void *buf, void *size) noexcept {
+        munmap(buf, reinterpret_cast<size_t>(size));
+    }
+
+    bool AssetArena::sparse(const folly::IOBuf &body) const {
+        if (body.length() == 0 || body.length() > MAX_PACKED) {
+            return false;
+        }
+        Block *block = block_of(body.data());
+        std::lock_guard lock(mutex_);
+        // Heap copies made while mappings failed belong to no block.
+        return block != current_ && blocks_.contains(block) &&
+               block->live.load(std::memory_order_relaxed) < (BLOCK_SIZE - BLOCK_HEADER) / 2;
+    }
+
+    bool AssetArena::fragmented() const noexcept {
+        const size_t mapped = block_bytes_.load(std::memory_order_relaxed);
+        const size_t live = live_bytes_.load(std::memory_order_relaxed);
+        return mapped > live + live / 4 && mapped - live > BLOCK_SIZE * 2;
+    }
+
+    std::shared_ptr<folly::IOBuf> AssetArena::store(const folly::IOBuf &data) {
+        const size_t length = data.computeChainDataLength();
+        if (length == 0) {
+            return folly::IOBuf::create(0);
+        }
+        const size_t charge = footprint(length);
+
+        Block *block = nullptr;
+        uint8_t *target = nullptr;
+
+        if (length > MAX_PACKED) {
+            target = map_body(charge);
+        } else {
+            Block *retired = nullptr;
+            {
+                std::lock_guard lock(mutex_);
+                if (!current_ || used_ + charge > BLOCK_SIZE) {
+                    // The old block lives on for as long as its bodies are referenced. Its last reference
+                    // may be ours, and dropping it takes the lock, so that waits until the lock is released.
+                    retired = current_;
+                    current_ = map_block();
+                    used_ = BLOCK_HEADER;
+                    if (current_) {
+                        blocks_.insert(current_);
+                    }
+                }
+                if (current_) {
+                    block = current_;
+                    block->refs.fetch_add(1, std::memory_order_relaxed);
+                    block->live.fetch_add(charge, std::memory_order_relaxed);
+                    live_bytes_.fetch_add(charge, std::memory_order_relaxed);
+                    target = reinterpret_cast<uint8_t *>(block) + used_;
+                    used_ += charge;
+                }
+            }
+            if (retired) {
+                release(retired);
+            }
+        }
+
+        std::unique_ptr<folly::IOBuf> heap;
+        if (!target) {
+            // Out of address space: a plain heap copy still gives a single buffer.
+            heap = folly::IOBuf::create(length);
+            target = heap->writableData();
+        }
+
+        // The reserved range belongs to this body alone, so the copy needs no lock.
+        size_t offset = 0;
+        for (const folly::ByteRange range: data) {
+            memcpy(target + offset, range.data(), range.size());
+            offset += range.size();
+        }
+
+        if (heap) {
+            heap->append(length);
+            return heap;
+        }
+        if (!block) {
+            return folly::IOBuf::takeOwnership(target, length, &AssetArena::free_mapping,
+                                               reinterpret_cast<void *>(charge));
+        }
+        return folly::IOBuf::takeOwnership(target, length, &AssetArena::free_body, reinterpret_cast<void *>(charge));
+    }
+} // namespace Cache
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+namespace folly {
+    class IOBuf;
+}
+
+namespace Cache {
+    // Backing store for cached response bodies.
+    //
+    // Small bodies are packed back to back into 2 MB blocks carved from anonymous mappings (hugepages
+    // when enabled), so hot assets share TLB entries and cache lines instead of being spread over many
+    // malloc'd chunks. Every stored body is exactly one IOBuf; clones share the block, and a block is
+    // unmapped once nothing refers to it any more. Bodies above a quarter block get a page-aligned mapping
+    // of their own, never a hugepage, so they cost at most a page of slack.
+    //
+    // A single surviving body keeps its whole block mapped. Blocks track how much of them is still alive,
+    // and the cache moves the bodies out of mostly dead blocks (sparse()) once fragmented() says the
+    // mapped blocks have grown well past the bodies in them.
+    class AssetArena {
+    public:
+        static constexpr size_t BLOCK_SIZE = 2 << 20;
+        static constexpr size_t ALIGNMENT = 64;
+        static constexpr size_t MAX_PACKED = BLOCK_SIZE / 4;
+
+        explicit AssetArena(bool hugepages = false) : hugepages_(hugepages) {
+        }
+
+        ~AssetArena();
+
+        AssetArena(const AssetArena &) = delete;
+
+        AssetArena &operator=(const AssetArena &) = delete;
+
+        // Copies `data` into the arena and returns a single, unchained buffer viewing it.
+        std::shared_ptr<folly::IOBuf> store(const folly::IOBuf &data);
+
+        // Memory a body of `length` bytes takes up, alignment and page rounding included.
+        static size_t footprint(size_t length) noexcept;
+
+        // Whether `body` (from store()) lives in a block other than the current one that is less than half
+        // used. Storing it again moves it into the current block.
+        bool sparse(const folly::IOBuf &body) const;
+
+        // Mapped blocks exceed the bodies alive in them by a quarter and by more than two blocks.
+        bool fragmented() const noexcept;
+
+    private:
+        // Sits at the start of its BLOCK_SIZE aligned mapping, so a body finds its block by address.
+        struct Block {
+            AssetArena *arena;
+            std::atomic<size_t> refs;
+            std::atomic<size_t> live; // footprint of the bodies still referenced
+        };
+
+        static constexpr size_t BLOCK_HEADER = (sizeof(Block) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+        static Block *block_of(const void *body) noexcept {
+            return reinterpret_cast<Block *>(reinterpret_cast<uintptr_t>(body) & ~(BLOCK_SIZE - 1));
+        }
+
+        Block *map_block();
+
+        static uint8_t *map_body(size_t size);
+
+        void release(Block *block) noexcept;
+
+        static void free_body(void *buf, void *footprint) noexcept;
+
+        static void free_mapping(void *buf, void *size) noexcept;
+
+        mutable std::mutex mutex_;
+        std::unordered_set<Block *> blocks_; // every block still mapped
+        Block *current_ = nullptr; // the arena holds one reference while it still allocates from it
+        size_t used_ = 0;
+        std::atomic<size_t> block_bytes_{0};
+        std::atomic<size_t> live_bytes_{0};
+        bool hugepages_;
+    };
+} // namespace Cache
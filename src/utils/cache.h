@@ -1,33 +1,78 @@
 #pragma once
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <xxhash.h>
 #include <folly/FBString.h>
 
 namespace folly {
     class IOBuf;
 }
 
+namespace proxygen {
+    class HTTPMessage;
+}
+
 namespace Cache {
     struct VirtualHostConfig {
+        std::string name; // "hostname:port" as configured
         folly::fbstring web_root_directory;
         std::vector<std::string> index_page_files;
+        std::string php_preload; // script run once at PHP startup, empty for none
 
         VirtualHostConfig() = default;
 
-        VirtualHostConfig(const std::string &web_root, std::vector<std::string> index_files)
+        VirtualHostConfig(const std::string &web_root, std::vector<std::string> index_files,
+                          std::string preload = {})
             : web_root_directory(web_root)
-              , index_page_files(std::move(index_files)) {
+              , index_page_files(std::move(index_files))
+              , php_preload(std::move(preload)) {
         }
     };
 
     struct FileSystemMetadata {
-        bool is_directory;
-        // TODO: Add more metadata fields as needed
+        bool is_directory = false;
+        bool read_only = false; // nobody may write it, so it can't be truncated under a mapping
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        uint64_t inode = 0;
+        // Validator for ETag; derived from size and mtime, so a 304 never needs the body and every server
+        // behind a load balancer that got the same deploy hands out the same tag.
+        uint64_t etag = 0;
+
+        static FileSystemMetadata fromStat(const struct stat &st) noexcept {
+            FileSystemMetadata meta;
+            meta.is_directory = S_ISDIR(st.st_mode);
+            meta.read_only = !(st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+            meta.size = static_cast<uint64_t>(st.st_size);
+            meta.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            meta.inode = static_cast<uint64_t>(st.st_ino);
+            meta.computeETag();
+            return meta;
+        }
+
+        void computeETag() noexcept {
+            const uint64_t identity[2] = {size, static_cast<uint64_t>(mtime_ns)};
+            etag = XXH3_64bits(identity, sizeof(identity));
+        }
+
+        int64_t mtimeSeconds() const noexcept {
+            return mtime_ns / 1000000000;
+        }
+
+        bool sameFile(const FileSystemMetadata &other) const noexcept {
+            return size == other.size && mtime_ns == other.mtime_ns && inode == other.inode;
+        }
     };
 
     struct ResponseData {
-        folly::fbstring content_type;
+        const char *content_type = nullptr; // from Utils::getContentType, never freed
         std::shared_ptr<folly::IOBuf> data;
+        FileSystemMetadata metadata;
+        // Head of a plain 200 for this entry, rendered when it is stored and copied by each hit that sends it.
+        std::shared_ptr<const proxygen::HTTPMessage> headers;
 
         ResponseData() = default;
     };
@@ -0,0 +1,225 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/executors/thread_factory/InitThreadFactory.h>
+#include <folly/executors/thread_factory/NamedThreadFactory.h>
+#include <folly/logging/xlog.h>
+
+#ifdef WBSRV_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WBSRV_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+namespace Compression {
+    // Static assets are compressed once and then served many times, so spend the CPU on ratio.
+    static constexpr int GZIP_LEVEL = 9;
+    static constexpr int ZSTD_LEVEL = 19;
+    static constexpr int BROTLI_QUALITY = 11;
+
+    // Below the event loops and the file I/O pool, which run at the default priority.
+    static constexpr int WORKER_NICE = 10;
+
+    static std::mutex jobs_mutex;
+    static std::unordered_set<XXH64_hash_t> jobs;
+    static std::unique_ptr<folly::CPUThreadPoolExecutor> workers;
+
+    const char *name(Encoding encoding) noexcept {
+        switch (encoding) {
+            case Encoding::BROTLI: return "br";
+            case Encoding::ZSTD: return "zstd";
+            case Encoding::GZIP: return "gzip";
+            default: return "identity";
+        }
+    }
+
+    const char *extension(Encoding encoding) noexcept {
+        switch (encoding) {
+            case Encoding::BROTLI: return ".br";
+            case Encoding::ZSTD: return ".zst";
+            case Encoding::GZIP: return ".gz";
+            default: return "";
+        }
+    }
+
+    uint8_t supportedEncodings() noexcept {
+        uint8_t mask = bit(Encoding::GZIP);
+#ifdef WBSRV_HAVE_ZSTD
+        mask |= bit(Encoding::ZSTD);
+#endif
+#ifdef WBSRV_HAVE_BROTLI
+        mask |= bit(Encoding::BROTLI);
+#endif
+        return mask;
+    }
+
+    uint8_t parseAcceptEncoding(folly::StringPiece header) noexcept {
+        uint8_t mask = 0;
+
+        while (!header.empty()) {
+            const size_t comma = header.find(',');
+            folly::StringPiece item = header.subpiece(0, comma);
+            header = comma == folly::StringPiece::npos ? folly::StringPiece() : header.subpiece(comma + 1);
+
+            folly::StringPiece params;
+            const size_t semicolon = item.find(';');
+            if (semicolon != folly::StringPiece::npos) {
+                params = item.subpiece(semicolon + 1);
+                item = item.subpiece(0, semicolon);
+            }
+
+            while (!item.empty() && isspace(item.front())) item.pop_front();
+            while (!item.empty() && isspace(item.back())) item.pop_back();
+
+            // "q=0", "q=0.0", ... turn the coding off.
+            const size_t q = params.find("q=");
+            if (q != folly::StringPiece::npos) {
+                folly::StringPiece value = params.subpiece(q + 2);
+                bool zero = !value.empty() && value.front() == '0';
+                for (size_t i = 1; zero && i < value.size() && value[i] != ',' && !isspace(value[i]); ++i) {
+                    zero = value[i] == '.' || value[i] == '0';
+                }
+                if (zero) continue;
+            }
+
+            if (item.equals("br", folly::AsciiCaseInsensitive())) {
+                mask |= bit(Encoding::BROTLI);
+            } else if (item.equals("zstd", folly::AsciiCaseInsensitive())) {
+                mask |= bit(Encoding::ZSTD);
+            } else if (item.equals("gzip", folly::AsciiCaseInsensitive())) {
+                mask |= bit(Encoding::GZIP);
+            } else if (item == "*") {
+                mask |= bit(Encoding::BROTLI) | bit(Encoding::ZSTD) | bit(Encoding::GZIP);
+            }
+        }
+
+        return mask;
+    }
+
+    bool isCompressible(folly::StringPiece content_type) noexcept {
+        return content_type.startsWith("text/") ||
+               content_type == "application/javascript" ||
+               content_type == "application/json" ||
+               content_type == "application/xml" ||
+               content_type == "image/svg+xml" ||
+               content_type == "image/vnd.microsoft.icon" ||
+               content_type == "image/bmp";
+    }
+
+    static std::string flatten(const folly::IOBuf &input) {
+        std::string flat;
+        flat.reserve(input.computeChainDataLength());
+        for (const folly::ByteRange range: input) {
+            flat.append(reinterpret_cast<const char *>(range.data()), range.size());
+        }
+        return flat;
+    }
+
+    static std::unique_ptr<folly::IOBuf> compressGzip(const std::string &input) {
+        z_stream stream{};
+        // 15 window bits + 16 selects the gzip wrapper.
+        if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return nullptr;
+        }
+
+        auto output = folly::IOBuf::create(deflateBound(&stream, input.size()));
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+        stream.avail_in = static_cast<uInt>(input.size());
+        stream.next_out = output->writableData();
+        stream.avail_out = static_cast<uInt>(output->capacity());
+
+        const int rc = deflate(&stream, Z_FINISH);
+        output->append(stream.total_out);
+        deflateEnd(&stream);
+
+        return rc == Z_STREAM_END ? std::move(output) : nullptr;
+    }
+
+#ifdef WBSRV_HAVE_ZSTD
+    static std::unique_ptr<folly::IOBuf> compressZstd(const std::string &input) {
+        auto output = folly::IOBuf::create(ZSTD_compressBound(input.size()));
+        const size_t rc = ZSTD_compress(output->writableData(), output->capacity(), input.data(), input.size(),
+                                        ZSTD_LEVEL);
+        if (ZSTD_isError(rc)) {
+            return nullptr;
+        }
+        output->append(rc);
+        return output;
+    }
+#endif
+
+#ifdef WBSRV_HAVE_BROTLI
+    static std::unique_ptr<folly::IOBuf> compressBrotli(const std::string &input) {
+        size_t length = BrotliEncoderMaxCompressedSize(input.size());
+        if (length == 0) {
+            return nullptr;
+        }
+
+        auto output = folly::IOBuf::create(length);
+        if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input.size(),
+                                   reinterpret_cast<const uint8_t *>(input.data()), &length,
+                                   output->writableData())) {
+            return nullptr;
+        }
+        output->append(length);
+        return output;
+    }
+#endif
+
+    std::unique_ptr<folly::IOBuf> compress(Encoding encoding, const folly::IOBuf &input) {
+        const std::string flat = flatten(input);
+
+        switch (encoding) {
+            case Encoding::GZIP:
+                return compressGzip(flat);
+#ifdef WBSRV_HAVE_ZSTD
+            case Encoding::ZSTD:
+                return compressZstd(flat);
+#endif
+#ifdef WBSRV_HAVE_BROTLI
+            case Encoding::BROTLI:
+                return compressBrotli(flat);
+#endif
+            default:
+                return nullptr;
+        }
+    }
+
+    void initialize(unsigned threads) {
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency() / 4, 1u);
+        }
+        auto factory = std::make_shared<folly::InitThreadFactory>(
+            std::make_shared<folly::NamedThreadFactory>("Compression"), [] {
+                // Per thread on Linux: only these threads drop their priority.
+                setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), WORKER_NICE);
+            });
+        workers = std::make_unique<folly::CPUThreadPoolExecutor>(threads, std::move(factory));
+        XLOG(INFO) << "Compressing static variants on " << threads << " low-priority threads";
+    }
+
+    folly::Executor &executor() {
+        return *workers;
+    }
+
+    bool beginJob(XXH64_hash_t key) {
+        std::lock_guard lock(jobs_mutex);
+        return jobs.insert(key).second;
+    }
+
+    void endJob(XXH64_hash_t key) {
+        std::lock_guard lock(jobs_mutex);
+        jobs.erase(key);
+    }
+} // namespace Compression
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <folly/Executor.h>
+#include <folly/Range.h>
+#include <folly/io/IOBuf.h>
+
+#include "utils/utils.h"
+
+namespace Compression {
+    enum class Encoding : uint8_t {
+        IDENTITY = 0,
+        BROTLI = 1,
+        ZSTD = 2,
+        GZIP = 3,
+        ENCODING_COUNT = 4
+    };
+
+    // Content codings in order of preference.
+    inline constexpr std::array<Encoding, 3> PREFERRED_ENCODINGS = {Encoding::BROTLI, Encoding::ZSTD, Encoding::GZIP};
+
+    inline constexpr uint8_t bit(Encoding encoding) noexcept {
+        return static_cast<uint8_t>(1u << static_cast<uint8_t>(encoding));
+    }
+
+    // Content-Encoding token ("br", "zstd", "gzip").
+    const char *name(Encoding encoding) noexcept;
+
+    // Suffix of a precompressed sibling file (".br", ".zst", ".gz").
+    const char *extension(Encoding encoding) noexcept;
+
+    // Codings this build can produce on its own.
+    uint8_t supportedEncodings() noexcept;
+
+    // Bitmask of the codings an Accept-Encoding header allows; q=0 excludes a coding.
+    uint8_t parseAcceptEncoding(folly::StringPiece header) noexcept;
+
+    bool isCompressible(folly::StringPiece content_type) noexcept;
+
+    // Returns nullptr when the coding is not compiled in or compression fails.
+    std::unique_ptr<folly::IOBuf> compress(Encoding encoding, const folly::IOBuf &input);
+
+    // Cache key of a response variant. The identity key is the plain path hash used everywhere else; the
+    // NUL separator keeps "a.css" + gzip apart from a real "a.css.gz".
+    template<typename Path>
+    XXH64_hash_t variantKey(const Path &path, Encoding encoding) {
+        if (encoding == Encoding::IDENTITY) {
+            return Utils::computeXXH64Hash(path);
+        }
+        return Utils::computeXXH64Hash(path, folly::StringPiece("\0", 1), folly::StringPiece(name(encoding)));
+    }
+
+    // Starts the low-priority threads variants are built on; 0 picks a quarter of the cores. Kept apart from
+    // the global CPU executor so that a burst of cold assets can't hold up file reads queued there.
+    void initialize(unsigned threads);
+
+    folly::Executor &executor();
+
+    // Guards against compressing the same variant on several threads at once.
+    bool beginJob(XXH64_hash_t key);
+
+    void endJob(XXH64_hash_t key);
+} // namespace Compression
@@ -8,6 +8,7 @@
 
 #include "server/core.h"
 #include "utils/defines.h"
+#include "utils/host_table.h"
 
 using namespace folly;
 using namespace Config;
@@ -17,6 +18,129 @@ bool ServerConfig::initialize() {
         YAML::Node config = YAML::LoadFile(path_ + "/server.yaml");
         if (!config.IsNull()) {
             threads = config["threads"].as<int>();
+            if (config["cache_size_mb"]) {
+                cache_max_bytes = config["cache_size_mb"].as<size_t>() << 20;
+            }
+            if (config["cache_max_object_kb"]) {
+                cache_max_object_bytes = config["cache_max_object_kb"].as<size_t>() << 10;
+            }
+            if (config["cache_hugepages"]) {
+                cache_hugepages = config["cache_hugepages"].as<bool>();
+            }
+            if (config["watch_files"]) {
+                watch_files = config["watch_files"].as<bool>();
+            }
+            if (config["zero_copy_min_kb"]) {
+                zero_copy_min_bytes = config["zero_copy_min_kb"].as<size_t>() << 10;
+            }
+            if (config["file_io"]) {
+                file_io = config["file_io"].as<std::string>();
+            }
+            if (config["io_uring_depth"]) {
+                io_uring_depth = config["io_uring_depth"].as<unsigned>();
+            }
+            if (config["stream_window_kb"]) {
+                stream_window_bytes = config["stream_window_kb"].as<size_t>() << 10;
+            }
+            if (config["compression_threads"]) {
+                compression_threads = config["compression_threads"].as<unsigned>();
+            }
+            if (config["routing_index"]) {
+                routing_index = config["routing_index"].as<bool>();
+            }
+            if (config["directory_cache_entries"]) {
+                directory_cache_entries = config["directory_cache_entries"].as<size_t>();
+            }
+            if (config["request_body_spill_kb"]) {
+                request_body_spill_bytes = config["request_body_spill_kb"].as<size_t>() << 10;
+            }
+            if (config["request_body_temp_dir"]) {
+                request_body_temp_dir = config["request_body_temp_dir"].as<std::string>();
+            }
+            if (config["php_workers"]) {
+                php_workers = config["php_workers"].as<unsigned>();
+            }
+            if (config["php_queue_size"]) {
+                php_queue_size = config["php_queue_size"].as<size_t>();
+            }
+            if (config["php_timeout"]) {
+                php_timeout_seconds = config["php_timeout"].as<unsigned>();
+            }
+            if (config["php_flush_kb"]) {
+                php_flush_bytes = config["php_flush_kb"].as<size_t>() << 10;
+            }
+            if (config["php_opcache"]) {
+                php_opcache = config["php_opcache"].as<bool>();
+            }
+            if (config["php_opcache_memory_mb"]) {
+                php_opcache_memory_mb = config["php_opcache_memory_mb"].as<size_t>();
+            }
+            if (config["php_jit"]) {
+                php_jit = config["php_jit"].as<std::string>();
+            }
+            if (config["php_jit_buffer_mb"]) {
+                php_jit_buffer_mb = config["php_jit_buffer_mb"].as<size_t>();
+            }
+            if (config["php_extension_dir"]) {
+                php_extension_dir = config["php_extension_dir"].as<std::string>();
+            }
+            if (config["php_preload_user"]) {
+                php_preload_user = config["php_preload_user"].as<std::string>();
+            }
+            if (config["php_cache_entries"]) {
+                php_cache_entries = config["php_cache_entries"].as<size_t>();
+            }
+            if (config["php_cache_ttl"]) {
+                php_cache_ttl_seconds = config["php_cache_ttl"].as<unsigned>();
+            }
+            if (config["php_cache_stale"]) {
+                php_cache_stale_seconds = config["php_cache_stale"].as<unsigned>();
+            }
+            if (config["php_cache_max_object_kb"]) {
+                php_cache_max_object_bytes = config["php_cache_max_object_kb"].as<size_t>() << 10;
+            }
+            if (config["php_cache_vary_headers"]) {
+                php_cache_vary_headers = config["php_cache_vary_headers"].as<std::vector<std::string> >();
+            }
+            if (config["php_cache_vary_cookies"]) {
+                php_cache_vary_cookies = config["php_cache_vary_cookies"].as<std::vector<std::string> >();
+            }
+            if (config["fastcgi_backends"]) {
+                fastcgi_backends = config["fastcgi_backends"].as<std::vector<std::string> >();
+            }
+            if (config["fastcgi_extensions"]) {
+                fastcgi_extensions = config["fastcgi_extensions"].as<std::vector<std::string> >();
+            }
+            if (config["fastcgi_connections"]) {
+                fastcgi_connections = config["fastcgi_connections"].as<size_t>();
+            }
+            if (config["fastcgi_queue_size"]) {
+                fastcgi_queue_size = config["fastcgi_queue_size"].as<size_t>();
+            }
+            if (config["fastcgi_timeout"]) {
+                fastcgi_timeout_seconds = config["fastcgi_timeout"].as<unsigned>();
+            }
+            if (config["proxy_connections"]) {
+                proxy_connections = config["proxy_connections"].as<size_t>();
+            }
+            if (config["proxy_timeout"]) {
+                proxy_timeout_seconds = config["proxy_timeout"].as<unsigned>();
+            }
+            if (config["proxy_max_fails"]) {
+                proxy_max_fails = config["proxy_max_fails"].as<unsigned>();
+            }
+            if (config["proxy_fail_timeout"]) {
+                proxy_fail_timeout_seconds = config["proxy_fail_timeout"].as<unsigned>();
+            }
+            if (config["upgrade_socket"]) {
+                upgrade_socket = config["upgrade_socket"].as<std::string>();
+            }
+            if (config["upgrade_drain"]) {
+                upgrade_drain_seconds = config["upgrade_drain"].as<unsigned>();
+            }
+            if (config["upgrade_warm_mb"]) {
+                upgrade_warm_bytes = config["upgrade_warm_mb"].as<size_t>() << 20;
+            }
             return true;
         }
         return false;
@@ -32,6 +156,12 @@ bool VirtualHost::initialize() {
     if (!config.IsNull()) {
         www_dir = config["www_dir"].as<std::string>();
         hostname = config["hostname"].as<std::string>();
+        if (config["aliases"]) {
+            aliases = config["aliases"].as<std::vector<std::string> >();
+        }
+        if (config["default"]) {
+            default_host = config["default"].as<bool>();
+        }
         ssl = config["ssl"].as<bool>();
         port = config["port"].as<int>();
         if (ssl) {
@@ -40,54 +170,100 @@ bool VirtualHost::initialize() {
             password = config["password"].as<std::string>();
         }
         index_page = config["index_page"].as<std::vector<std::string> >();
+        if (config["php_preload"]) {
+            php_preload = config["php_preload"].as<std::string>();
+        }
+        if (config["proxy"]) {
+            for (const auto &item: config["proxy"]) {
+                ProxyRoute route;
+                route.prefix = item["prefix"].as<std::string>();
+                route.upstreams = item["upstreams"].as<std::vector<std::string> >();
+                if (item["balance"]) {
+                    route.balance = item["balance"].as<std::string>();
+                }
+                if (item["hash_header"]) {
+                    route.hash_header = item["hash_header"].as<std::string>();
+                }
+                if (item["protocol"]) {
+                    route.protocol = item["protocol"].as<std::string>();
+                }
+                proxy.push_back(std::move(route));
+            }
+        }
         return true;
     }
     return false;
 }
 
 bool Config::load_virtual_host_configurations(std::vector<proxygen::HTTPServer::IPConfig> &config) {
+    // Sorted, so that the first host on a port (its default unless one says otherwise) is stable.
+    std::vector<std::filesystem::path> files;
     for (const auto &i: std::filesystem::directory_iterator(std::string(CONFIG_DIR) + "/hosts")) {
         if (i.path().extension() == ".yaml") {
-            Config::VirtualHost host(i.path().string());
-            if (host.initialize()) {
-                proxygen::HTTPServer::IPConfig vhost(folly::SocketAddress("0.0.0.0", host.port, false),
-                                                     proxygen::HTTPServer::Protocol::HTTP);
-
+            files.push_back(i.path());
+        }
+    }
+    std::ranges::sort(files);
 
-                if (host.ssl) {
-                    wangle::SSLContextConfig cert;
-                    cert.setCertificate(host.cert, host.private_key, host.password);
-                    cert.clientVerification = folly::SSLContext::VerifyClientCertificate::DO_NOT_REQUEST;
-                    vhost.sslConfigs.push_back(cert);
-                    vhost.sslConfigs[0].isDefault = true;
-                }
-                Cache::FileSystemMetadata rootMeta{};
-                rootMeta.is_directory = std::filesystem::is_directory(host.www_dir);
-                files_metadata[host.www_dir + "/"] = rootMeta;
+    // Built aside, so that a reload that fails leaves the running configuration alone.
+    std::unordered_map<std::string, Cache::VirtualHostConfig> hosts;
+    std::unordered_map<std::string, std::vector<ProxyRoute> > routes;
+    std::vector<Routing::HostTable::Host> routed;
+    for (const auto &file: files) {
+        Config::VirtualHost host(file.string());
+        if (!host.initialize()) {
+            continue;
+        }
+        if (!host.www_dir.empty() && host.www_dir.back() == '/') {
+            host.www_dir.pop_back();
+        }
 
-                if (rootMeta.is_directory) {
-                    for (const auto &entry: std::filesystem::recursive_directory_iterator(host.www_dir)) {
-                        Cache::FileSystemMetadata meta{};
-                        meta.is_directory = entry.is_directory();
-                        files_metadata[entry.path().string()] = meta;
-                    }
-                }
+        const std::string name = host.hostname + ':' + std::to_string(host.port);
+        Cache::VirtualHostConfig vhost_config(host.www_dir, host.index_page, host.php_preload);
+        vhost_config.name = name;
+        hosts[name] = vhost_config;
+        if (!host.proxy.empty()) {
+            routes[name] = std::move(host.proxy);
+        }
 
-                if (!host.www_dir.empty() && host.www_dir.back() == '/') {
-                    host.www_dir.pop_back();
-                }
+        Routing::HostTable::Host &entry = routed.emplace_back();
+        entry.names.push_back(host.hostname);
+        entry.names.insert(entry.names.end(), host.aliases.begin(), host.aliases.end());
+        entry.port = static_cast<uint16_t>(host.port);
+        entry.is_default = host.default_host;
+        entry.config = std::move(vhost_config);
 
-                virtual_hosts[host.hostname + ':' + std::to_string(host.port)] = Cache::VirtualHostConfig(
-                    host.www_dir,
-                    host.index_page
-                );
+        const folly::SocketAddress address("0.0.0.0", host.port, false);
+        auto listener = std::ranges::find_if(config, [&](const proxygen::HTTPServer::IPConfig &item) {
+            return item.address == address;
+        });
+        if (listener == config.end()) {
+            config.emplace_back(address, proxygen::HTTPServer::Protocol::HTTP);
+            listener = std::prev(config.end());
+        }
 
-                if (std::ranges::find_if(config, [vhost](const proxygen::HTTPServer::IPConfig &item) {
-                    return item.address == vhost.address;
-                }) == config.end())
-                    config.push_back(vhost);
+        // Every certificate on a port is offered, the one matching the client's SNI name wins.
+        if (host.ssl) {
+            wangle::SSLContextConfig cert;
+            cert.setCertificate(host.cert, host.private_key, host.password);
+            cert.clientVerification = folly::SSLContext::VerifyClientCertificate::DO_NOT_REQUEST;
+            cert.sniNames = entry.names;
+            const bool first = listener->sslConfigs.empty();
+            if (host.default_host) {
+                for (auto &other: listener->sslConfigs) {
+                    other.isDefault = false;
+                }
             }
+            cert.isDefault = first || host.default_host;
+            listener->sslConfigs.push_back(std::move(cert));
         }
     }
-    return !virtual_hosts.empty() && !config.empty();
+
+    if (hosts.empty() || config.empty()) {
+        return false;
+    }
+    virtual_hosts = std::move(hosts);
+    proxy_routes = std::move(routes);
+    Routing::publishHosts(Routing::HostTable::build(std::move(routed)));
+    return true;
 }
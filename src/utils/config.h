@@ -18,11 +18,61 @@ namespace Config {
         bool initialize();
 
         int threads = 0;
+        size_t cache_max_bytes = 256ull << 20;
+        size_t cache_max_object_bytes = 0; // 0 = derived from cache_max_bytes
+        bool cache_hugepages = false;
+        bool watch_files = true;
+        size_t zero_copy_min_bytes = 16ull << 20; // 0 disables the mmap path
+        std::string file_io = "io_uring"; // or "threads"
+        unsigned io_uring_depth = 256;
+        size_t stream_window_bytes = 256 * 1024; // read-ahead per streamed response
+        unsigned compression_threads = 0; // low-priority threads compressing static variants, 0 = cores / 4
+        bool routing_index = true; // scan the document roots at startup
+        size_t directory_cache_entries = 65536;
+        size_t request_body_spill_bytes = 1 << 20; // larger bodies go to a temp file, 0 = never
+        std::string request_body_temp_dir = "/tmp";
+        unsigned php_workers = 0; // 0 = one per core
+        size_t php_queue_size = 1024; // requests waiting for a worker before 503
+        unsigned php_timeout_seconds = 30;
+        size_t php_flush_bytes = 64 * 1024; // PHP output buffered before streaming, 0 = only on flush()
+        bool php_opcache = true;
+        size_t php_opcache_memory_mb = 128;
+        std::string php_jit = "disable"; // opcache.jit: disable, tracing, function, ...
+        size_t php_jit_buffer_mb = 64;
+        std::string php_extension_dir; // empty = PHP's compiled-in default
+        std::string php_preload_user; // opcache.preload_user, required to preload as root
+        size_t php_cache_entries = 0; // pages kept by the PHP response cache, 0 = disabled
+        unsigned php_cache_ttl_seconds = 1; // for responses without Cache-Control or Expires
+        unsigned php_cache_stale_seconds = 10; // served stale while one request regenerates
+        size_t php_cache_max_object_bytes = 1 << 20;
+        std::vector<std::string> php_cache_vary_headers; // request headers that are part of the key
+        std::vector<std::string> php_cache_vary_cookies; // cookies that are part of the key
+        std::vector<std::string> fastcgi_backends; // "unix:/path" or "host:port", empty = module disabled
+        std::vector<std::string> fastcgi_extensions = {".php"}; // files handed to the backends
+        size_t fastcgi_connections = 16; // per backend and event loop
+        size_t fastcgi_queue_size = 1024; // requests waiting for a connection, per event loop
+        unsigned fastcgi_timeout_seconds = 60; // without a byte from the backend
+        size_t proxy_connections = 32; // idle upstream connections kept per upstream and event loop
+        unsigned proxy_timeout_seconds = 60; // an upstream silent this long fails the request
+        unsigned proxy_max_fails = 3; // consecutive failures that take an upstream out of rotation
+        unsigned proxy_fail_timeout_seconds = 10; // for this long
+        std::string upgrade_socket; // Unix socket a new binary takes the listeners over from, empty = disabled
+        unsigned upgrade_drain_seconds = 30; // the old process finishes its connections for at most this long
+        size_t upgrade_warm_bytes = 64ull << 20; // cached files handed to the new process, 0 = none
 
     private:
         std::string path_;
     };
 
+    // URLs below `prefix` are forwarded to `upstreams` ("host:port" or "unix:/path").
+    struct ProxyRoute {
+        std::string prefix;
+        std::vector<std::string> upstreams;
+        std::string balance = "round_robin"; // round_robin, least_conn or hash
+        std::string hash_header; // hash: request header to hash on, the client address when empty
+        std::string protocol = "http1"; // or h2c
+    };
+
     class VirtualHost {
     public:
         explicit VirtualHost(std::string path) {
@@ -35,19 +85,29 @@ namespace Config {
         std::string cert;
         std::string password;
         std::string hostname;
+        std::vector<std::string> aliases; // more names for the host, "*.example.com" for any subdomain
         std::string www_dir;
         std::vector<std::string> index_page;
+        std::string php_preload;
+        std::vector<ProxyRoute> proxy;
 
 
         bool ssl = false;
         int port = 80;
+        bool default_host = false; // answers requests on its port that match no host name
 
     private:
         std::string path_;
     };
 
+    // By "hostname:port"; requests are routed through Routing::HostLease.
     inline std::unordered_map<std::string, Cache::VirtualHostConfig> virtual_hosts;
-    inline std::unordered_map<std::string, Cache::FileSystemMetadata> files_metadata;
+    // Proxied routes by "hostname:port", like virtual_hosts.
+    inline std::unordered_map<std::string, std::vector<ProxyRoute> > proxy_routes;
+    // The loaded server.yaml, for modules; set before the module system is initialized.
+    inline const ServerConfig *server_config = nullptr;
 
+    // Reads the host files. On success virtual_hosts and proxy_routes are replaced and the new host table is
+    // published; on failure nothing changes, so it also serves reloads.
     bool load_virtual_host_configurations(std::vector<proxygen::HTTPServer::IPConfig> &ip_configs);
 }
@@ -1,9 +1,12 @@
 #pragma once
 #define STATUS_101 101, "Switching Protocols"
 #define STATUS_200 200, "OK"
+#define STATUS_206 206, "Partial Content"
+#define STATUS_304 304, "Not Modified"
 #define STATUS_404 404, "Not found"
 #define STATUS_400 400, "Bad request"
 #define STATUS_405 405, "Method Not Allowed"
+#define STATUS_416 416, "Range Not Satisfiable"
 #define STATUS_500 500, "Internal server error"
 #define STATUS_501 501, "Not implemented"
 #define STATUS_502 502, "Bad response"
@@ -20,3 +23,4 @@
 #define NAME_N_VERSION "wbsrv rc"
 
 #define CACHE_TTL 300 // 5 minutes
+#define NEGATIVE_CACHE_TTL 10 // seconds a missing index page is remembered
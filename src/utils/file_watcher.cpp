@@ -0,0 +1,225 @@
+#include "file_watcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <folly/logging/xlog.h>
+
+namespace Cache {
+    static constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                           IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    FileWatcher::~FileWatcher() {
+        stop();
+    }
+
+    bool FileWatcher::start(std::vector<std::string> roots) {
+        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd_ < 0) {
+            XLOG(WARN) << "inotify is unavailable, cached files will only be revalidated by TTL";
+            return false;
+        }
+
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            close(inotify_fd_);
+            inotify_fd_ = -1;
+            return false;
+        }
+
+        roots_ = std::move(roots);
+        directories_.clear();
+        running_ = true;
+        thread_ = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void FileWatcher::set_roots(std::vector<std::string> roots) {
+        if (!running_) {
+            return;
+        }
+        {
+            std::lock_guard lock(pending_mutex_);
+            pending_roots_ = std::move(roots);
+        }
+        const uint64_t one = 1;
+        [[maybe_unused]] auto rc = write(wake_fd_, &one, sizeof(one));
+    }
+
+    void FileWatcher::stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+
+        const uint64_t one = 1;
+        [[maybe_unused]] auto rc = write(wake_fd_, &one, sizeof(one));
+        thread_.join();
+
+        close(inotify_fd_);
+        close(wake_fd_);
+        inotify_fd_ = -1;
+        wake_fd_ = -1;
+    }
+
+    void FileWatcher::run() {
+        // Registering watches walks the whole tree; doing it here keeps it off the startup path.
+        for (const auto &root: roots_) {
+            add_tree(root);
+        }
+        XLOG(INFO) << "Watching " << directories_.size() << " directories for changes";
+
+        alignas(inotify_event) char buffer[64 * 1024];
+        pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+
+        while (running_) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                XLOG(ERR) << "File watcher poll failed: " << strerror(errno);
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                uint64_t wakes;
+                [[maybe_unused]] auto rc = read(wake_fd_, &wakes, sizeof(wakes));
+                if (!running_) {
+                    break;
+                }
+                apply_roots();
+            }
+            if (!(fds[0].revents & POLLIN)) {
+                continue;
+            }
+
+            ssize_t length;
+            while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+                handle_events(buffer, static_cast<size_t>(length));
+            }
+        }
+    }
+
+    void FileWatcher::apply_roots() {
+        std::vector<std::string> roots;
+        {
+            std::lock_guard lock(pending_mutex_);
+            if (!pending_roots_) {
+                return;
+            }
+            roots = std::move(*pending_roots_);
+            pending_roots_.reset();
+        }
+
+        const auto below_any = [&](const std::string &dir) {
+            return std::ranges::any_of(roots, [&](const std::string &root) {
+                return dir.starts_with(root) && (dir.size() == root.size() || dir[root.size()] == '/');
+            });
+        };
+        bool dropped = false;
+        for (auto it = directories_.begin(); it != directories_.end();) {
+            if (below_any(it->second)) {
+                ++it;
+                continue;
+            }
+            inotify_rm_watch(inotify_fd_, it->first);
+            it = directories_.erase(it);
+            dropped = true;
+        }
+        for (const auto &root: roots) {
+            if (std::ranges::find(roots_, root) == roots_.end()) {
+                add_tree(root);
+            }
+        }
+        roots_ = std::move(roots);
+        XLOG(INFO) << "Watching " << directories_.size() << " directories for changes";
+
+        // Files cached from a dropped root would be trusted unwatched if it came back.
+        if (dropped) {
+            on_change_({}, Change::REMOVED);
+        }
+    }
+
+    void FileWatcher::add_tree(const std::string &root) {
+        std::error_code ec;
+        const auto watch = [this](const std::string &dir) {
+            const int wd = inotify_add_watch(inotify_fd_, dir.c_str(), WATCH_MASK);
+            if (wd < 0) {
+                XLOG_EVERY_MS(WARN, 10000) << "Can't watch " << dir << ": " << strerror(errno)
+                                           << ". Raise fs.inotify.max_user_watches; TTL revalidation still applies.";
+                return;
+            }
+            directories_[wd] = dir;
+        };
+
+        watch(root);
+        for (auto it = std::filesystem::recursive_directory_iterator(
+                 root, std::filesystem::directory_options::skip_permission_denied, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_directory(ec) && !it->is_symlink(ec)) {
+                watch(it->path().string());
+            }
+        }
+    }
+
+    void FileWatcher::handle_events(const char *buffer, size_t length) {
+        for (size_t offset = 0; offset < length;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                XLOG(WARN) << "inotify queue overflowed, dropping all cached files";
+                on_change_({}, Change::REMOVED);
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                directories_.erase(event->wd);
+                continue;
+            }
+
+            const auto dir_it = directories_.find(event->wd);
+            if (dir_it == directories_.end()) {
+                continue;
+            }
+
+            if (event->mask & IN_DELETE_SELF) {
+                // The files below were already reported one by one; IN_IGNORED drops the watch.
+                continue;
+            }
+
+            if (event->mask & IN_MOVE_SELF) {
+                // The watch would keep reporting under the old path.
+                inotify_rm_watch(inotify_fd_, event->wd);
+                directories_.erase(dir_it);
+                on_change_({}, Change::REMOVED);
+                continue;
+            }
+
+            std::string path = dir_it->second;
+            if (event->len > 0) {
+                path += '/';
+                path += event->name;
+            }
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    add_tree(path);
+                } else if (event->mask & IN_MOVED_FROM) {
+                    // Entries below a moved directory can't be enumerated by hash.
+                    on_change_({}, Change::REMOVED);
+                    continue;
+                }
+            }
+
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                on_change_(path, Change::CREATED);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                on_change_(path, Change::REMOVED);
+            } else {
+                on_change_(path, Change::CONTENTS);
+            }
+        }
+    }
+} // namespace Cache
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Cache {
+    // Watches document roots with inotify and reports paths whose contents may have changed.
+    //
+    // inotify is not recursive, so every directory below the roots gets its own watch; directories
+    // created later are picked up as they appear. The callback runs on the watcher thread. An empty
+    // path means the watcher lost track (queue overflow, a directory was moved or removed) and
+    // everything below the roots has to be considered stale.
+    class FileWatcher {
+    public:
+        enum class Change : uint8_t {
+            CONTENTS, // written or its attributes changed
+            CREATED, // created or moved in
+            REMOVED, // deleted or moved away
+        };
+
+        using Callback = std::function<void(const std::string &path, Change change)>;
+
+        explicit FileWatcher(Callback on_change) : on_change_(std::move(on_change)) {
+        }
+
+        ~FileWatcher();
+
+        FileWatcher(const FileWatcher &) = delete;
+
+        FileWatcher &operator=(const FileWatcher &) = delete;
+
+        bool start(std::vector<std::string> roots);
+
+        // Swaps the watched roots without stopping: directories below roots that stay keep their watches,
+        // so no change to them goes unreported. Ignored when not running.
+        void set_roots(std::vector<std::string> roots);
+
+        void stop();
+
+    private:
+        void run();
+
+        void apply_roots();
+
+        void add_tree(const std::string &root);
+
+        void handle_events(const char *buffer, size_t length);
+
+        Callback on_change_;
+        std::vector<std::string> roots_;
+        std::mutex pending_mutex_;
+        std::optional<std::vector<std::string> > pending_roots_; // for the watcher thread to apply
+        std::unordered_map<int, std::string> directories_;
+        std::thread thread_;
+        int inotify_fd_ = -1;
+        int wake_fd_ = -1;
+        std::atomic<bool> running_{false};
+    };
+} // namespace Cache
@@ -0,0 +1,121 @@
+#include "flight_table.h"
+
+#include <algorithm>
+#include <iterator>
+#include <folly/io/Cursor.h>
+#include <folly/io/IOBufQueue.h>
+
+namespace Cache {
+    void Flight::opened(const FileSystemMetadata &metadata) {
+        std::unique_lock lock(mutex_);
+        metadata_ = metadata;
+        status_ = Status::LOADING;
+        notify(lock);
+    }
+
+    void Flight::append(uint64_t offset, const folly::IOBuf &chunk) {
+        std::unique_lock lock(mutex_);
+        chunks_.emplace(offset, chunk.clone());
+
+        const uint64_t before = available_;
+        for (auto it = chunks_.find(available_); it != chunks_.end() && it->first == available_; ++it) {
+            available_ += it->second->computeChainDataLength();
+        }
+        if (available_ != before) {
+            notify(lock);
+        }
+    }
+
+    void Flight::finish(bool complete) {
+        std::unique_lock lock(mutex_);
+        status_ = complete ? Status::DONE : Status::FAILED;
+        notify(lock);
+    }
+
+    Flight::Status Flight::status(FileSystemMetadata &metadata) {
+        std::lock_guard lock(mutex_);
+        metadata = metadata_;
+        return status_;
+    }
+
+    std::unique_ptr<folly::IOBuf> Flight::read(uint64_t offset, size_t length) {
+        std::lock_guard lock(mutex_);
+        if (status_ == Status::FAILED || offset + length > available_) {
+            return nullptr;
+        }
+
+        folly::IOBufQueue result;
+        auto it = std::prev(chunks_.upper_bound(offset));
+        while (length > 0) {
+            const uint64_t skip = offset - it->first;
+            const size_t take = static_cast<size_t>(std::min<uint64_t>(
+                it->second->computeChainDataLength() - skip, length));
+            folly::io::Cursor cursor(it->second.get());
+            cursor.skip(skip);
+            std::unique_ptr<folly::IOBuf> slice;
+            cursor.clone(slice, take);
+            result.append(std::move(slice));
+            offset += take;
+            length -= take;
+            ++it;
+        }
+        return result.move();
+    }
+
+    uint64_t Flight::wait(uint64_t until, Waiter waiter) {
+        std::lock_guard lock(mutex_);
+        if (status_ == Status::DONE || status_ == Status::FAILED ||
+            (status_ == Status::LOADING && available_ >= until)) {
+            return 0;
+        }
+        const uint64_t id = next_waiter_++;
+        waiters_.emplace_back(id, std::move(waiter));
+        return id;
+    }
+
+    bool Flight::cancel(uint64_t id) {
+        std::lock_guard lock(mutex_);
+        const auto it = std::ranges::find(waiters_, id, &std::pair<uint64_t, Waiter>::first);
+        if (it == waiters_.end()) {
+            return false;
+        }
+        waiters_.erase(it);
+        return true;
+    }
+
+    void Flight::notify(std::unique_lock<std::mutex> &lock) {
+        auto waiters = std::move(waiters_);
+        waiters_.clear();
+        lock.unlock();
+        for (auto &[id, waiter]: waiters) {
+            waiter();
+        }
+    }
+
+    std::shared_ptr<Flight> FlightTable::join(XXH64_hash_t key, bool may_lead, bool &leader) {
+        Shard &shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+
+        leader = false;
+        if (const auto it = shard.flights.find(key); it != shard.flights.end()) {
+            return it->second;
+        }
+        if (!may_lead) {
+            return nullptr;
+        }
+        leader = true;
+        auto flight = std::make_shared<Flight>();
+        shard.flights.emplace(key, flight);
+        return flight;
+    }
+
+    void FlightTable::remove(XXH64_hash_t key, const Flight *flight) {
+        Shard &shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+
+        // Only ever drop the caller's own flight.
+        if (const auto it = shard.flights.find(key); it != shard.flights.end() && it->second.get() == flight) {
+            shard.flights.erase(it);
+        }
+    }
+} // namespace Cache
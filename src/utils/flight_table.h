@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <folly/Function.h>
+#include <folly/io/IOBuf.h>
+
+#include "cache.h"
+#include "utils/utils.h"
+
+namespace Cache {
+    // One request reading a file into the cache while others want the same file.
+    //
+    // The leader publishes the metadata once the file is open and every chunk as its read completes;
+    // followers slice what they need out of the published chunks instead of reading the file themselves.
+    // Chunks are never modified once published, so followers on other threads only clone them. The leader
+    // reads at its own client's pace, so a follower that waits too long cancels its wait and reads the rest
+    // of the file itself.
+    class Flight {
+    public:
+        enum class Status : uint8_t {
+            OPENING,
+            LOADING,
+            DONE,
+            FAILED, // followers read the rest from disk
+        };
+
+        // Called on the leader's thread; must not block.
+        using Waiter = folly::Function<void()>;
+
+        // Leader side.
+        void opened(const FileSystemMetadata &metadata);
+
+        void append(uint64_t offset, const folly::IOBuf &chunk);
+
+        void finish(bool complete);
+
+        // Follower side.
+        Status status(FileSystemMetadata &metadata);
+
+        // [offset, offset + length) once it has arrived, otherwise null.
+        std::unique_ptr<folly::IOBuf> read(uint64_t offset, size_t length);
+
+        // Registers `waiter` for the next change unless the first `until` bytes (or, while opening, the
+        // metadata) are already there or the flight is over. Returns the waiter's id, 0 if not registered.
+        uint64_t wait(uint64_t until, Waiter waiter);
+
+        // Drops a waiter that has not run yet; false if it already ran or is running.
+        bool cancel(uint64_t id);
+
+    private:
+        void notify(std::unique_lock<std::mutex> &lock);
+
+        std::mutex mutex_;
+        Status status_ = Status::OPENING;
+        FileSystemMetadata metadata_;
+        std::map<uint64_t, std::unique_ptr<folly::IOBuf> > chunks_; // by file offset
+        uint64_t available_ = 0; // contiguous bytes from the start of the file
+        std::vector<std::pair<uint64_t, Waiter> > waiters_;
+        uint64_t next_waiter_ = 1;
+    };
+
+    // Loads in progress, by cache key.
+    class FlightTable {
+    public:
+        static constexpr size_t SHARD_COUNT = 16;
+
+        // The flight loading `key`. Without one, a new flight is started with the caller as its leader
+        // when `may_lead` is set, and null is returned otherwise.
+        std::shared_ptr<Flight> join(XXH64_hash_t key, bool may_lead, bool &leader);
+
+        void remove(XXH64_hash_t key, const Flight *flight);
+
+    private:
+        struct alignas(64) Shard {
+            std::mutex mutex;
+            std::unordered_map<XXH64_hash_t, std::shared_ptr<Flight> > flights;
+        };
+
+        Shard &shard_for(XXH64_hash_t key) noexcept {
+            return shards_[key & (SHARD_COUNT - 1)];
+        }
+
+        Shard shards_[SHARD_COUNT];
+    };
+} // namespace Cache
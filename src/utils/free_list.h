@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace Utils {
+    // Per-thread free list of fixed-size blocks, for objects that are created and destroyed on the same
+    // EventBase at a high rate. Blocks are taken and returned without locks; one freed on another thread
+    // simply joins that thread's list. At most MAX_FREE blocks are kept per thread, the rest go back to
+    // the allocator.
+    template<size_t SIZE, size_t MAX_FREE = 1024>
+    class FreeList {
+    public:
+        static void *allocate() {
+            if (Node *node = head_) {
+                head_ = node->next;
+                free_count_--;
+                return node;
+            }
+            return ::operator new(SIZE);
+        }
+
+        static void deallocate(void *block) noexcept {
+            if (free_count_ >= MAX_FREE) {
+                ::operator delete(block);
+                return;
+            }
+            head_ = new(block) Node{head_};
+            free_count_++;
+        }
+
+    private:
+        struct Node {
+            Node *next;
+        };
+
+        static_assert(SIZE >= sizeof(Node));
+
+        static inline thread_local Node *head_ = nullptr;
+        static inline thread_local size_t free_count_ = 0;
+    };
+
+    // Per-thread spare buffers, so that a request can build strings in capacity an earlier one left
+    // behind. Buffers grown past MAX_CAPACITY are not kept.
+    template<typename String, size_t MAX_SPARE = 256, size_t MAX_CAPACITY = 4096>
+    class SpareBuffers {
+    public:
+        static String take() {
+            if (spare_.empty()) {
+                spare_.reserve(MAX_SPARE);
+                return String();
+            }
+            String buffer = std::move(spare_.back());
+            spare_.pop_back();
+            return buffer;
+        }
+
+        // take() reserved room for every spare buffer, so keeping one never allocates.
+        static void give(String &&buffer) noexcept {
+            if (spare_.size() >= spare_.capacity() || buffer.capacity() == 0 || buffer.capacity() > MAX_CAPACITY) {
+                return;
+            }
+            buffer.clear();
+            spare_.push_back(std::move(buffer));
+        }
+
+    private:
+        static inline thread_local std::vector<String> spare_;
+    };
+} // namespace Utils
@@ -0,0 +1,221 @@
+#include "host_table.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <folly/logging/xlog.h>
+
+namespace Routing {
+    struct HostSnapshot {
+        std::shared_ptr<const HostTable> table;
+        uint64_t generation = 0;
+        size_t leases = 0;
+    };
+
+    namespace {
+        std::mutex g_hosts_mutex;
+        std::shared_ptr<const HostTable> g_hosts;
+        std::atomic<uint64_t> g_hosts_generation{0};
+
+        // This thread's snapshots; the last one is current, the others still have leases.
+        thread_local std::vector<std::unique_ptr<HostSnapshot> > tl_host_snapshots;
+    }
+
+    folly::StringPiece HostTable::normalize(folly::StringPiece authority, char (&buffer)[MAX_NAME_LENGTH]) noexcept {
+        folly::StringPiece name = authority;
+        if (name.startsWith('[')) {
+            // IPv6 literal, the port follows the closing bracket.
+            const size_t end = name.find(']');
+            name = end == folly::StringPiece::npos ? folly::StringPiece() : name.subpiece(0, end + 1);
+        } else {
+            const size_t colon = name.rfind(':');
+            if (colon != folly::StringPiece::npos) {
+                name = name.subpiece(0, colon);
+            }
+        }
+        if (name.endsWith('.')) {
+            name.pop_back();
+        }
+        if (name.empty() || name.size() > MAX_NAME_LENGTH) {
+            return {};
+        }
+
+        for (size_t i = 0; i < name.size(); ++i) {
+            const char c = name[i];
+            buffer[i] = c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+        }
+        return {buffer, name.size()};
+    }
+
+    uint64_t HostTable::hash(folly::StringPiece name, uint16_t port, bool wildcard) noexcept {
+        return XXH3_64bits_withSeed(name.data(), name.size(), (static_cast<uint64_t>(port) << 1) | wildcard);
+    }
+
+    std::shared_ptr<const HostTable> HostTable::build(std::vector<Host> hosts) {
+        auto table = std::make_shared<HostTable>();
+
+        size_t count = 0;
+        size_t name_bytes = 0;
+        for (const auto &host: hosts) {
+            count += host.names.size();
+            for (const auto &name: host.names) name_bytes += name.size();
+        }
+
+        // Load factor of at most 0.5, misses probe for every label of the name.
+        size_t capacity = 16;
+        while (capacity < count * 2) capacity <<= 1;
+        table->slots_.assign(capacity, Slot{0, NONE});
+        table->mask_ = capacity - 1;
+        table->keys_.reserve(count);
+        table->names_.reserve(name_bytes);
+        table->hosts_.reserve(hosts.size());
+
+        std::vector<uint16_t> explicit_defaults;
+        for (auto &host: hosts) {
+            const uint32_t index = static_cast<uint32_t>(table->hosts_.size());
+            for (const auto &configured: host.names) {
+                char buffer[MAX_NAME_LENGTH];
+                const bool wildcard = folly::StringPiece(configured).startsWith("*.");
+                const folly::StringPiece name = normalize(
+                    wildcard ? folly::StringPiece(configured).subpiece(2) : folly::StringPiece(configured), buffer);
+                if (name.empty()) {
+                    XLOG(WARN) << "Ignoring invalid host name \"" << configured << "\"";
+                    continue;
+                }
+                if (!table->insert(name, host.port, wildcard, index)) {
+                    XLOG(WARN) << "Host name " << configured << ':' << host.port
+                            << " is configured twice, using the first one";
+                }
+            }
+
+            // The first host on a port is its default unless another one asks to be.
+            const auto it = std::ranges::find(table->defaults_, host.port, &std::pair<uint16_t, uint32_t>::first);
+            if (it == table->defaults_.end()) {
+                table->defaults_.emplace_back(host.port, index);
+                if (host.is_default) explicit_defaults.push_back(host.port);
+            } else if (host.is_default) {
+                if (std::ranges::find(explicit_defaults, host.port) != explicit_defaults.end()) {
+                    XLOG(WARN) << "More than one default host for port " << host.port << ", using the first one";
+                } else {
+                    it->second = index;
+                    explicit_defaults.push_back(host.port);
+                }
+            }
+            table->hosts_.push_back(std::move(host.config));
+        }
+
+        XLOG(INFO) << "Routing " << table->keys_.size() << " host names to " << table->hosts_.size()
+                << " virtual hosts on " << table->defaults_.size() << " ports";
+        return table;
+    }
+
+    bool HostTable::insert(folly::StringPiece name, uint16_t port, bool wildcard, uint32_t host) {
+        const uint64_t key_hash = hash(name, port, wildcard);
+        const uint32_t tag = static_cast<uint32_t>(key_hash >> 32);
+        uint64_t slot = key_hash & mask_;
+        while (slots_[slot].key != NONE) {
+            const Slot &taken = slots_[slot];
+            const Key &key = keys_[taken.key];
+            if (taken.tag == tag && key.port == port && key.wildcard == wildcard &&
+                folly::StringPiece(names_.data() + key.name_offset, key.name_length) == name) {
+                return false;
+            }
+            slot = (slot + 1) & mask_;
+        }
+
+        Key key;
+        key.name_offset = names_.size();
+        key.name_length = static_cast<uint32_t>(name.size());
+        key.host = host;
+        key.port = port;
+        key.wildcard = wildcard;
+        names_.append(name.data(), name.size());
+
+        slots_[slot] = Slot{tag, static_cast<uint32_t>(keys_.size())};
+        keys_.push_back(key);
+        return true;
+    }
+
+    const HostTable::Key *HostTable::lookup(folly::StringPiece name, uint16_t port, bool wildcard) const noexcept {
+        const uint64_t key_hash = hash(name, port, wildcard);
+        const uint32_t tag = static_cast<uint32_t>(key_hash >> 32);
+        for (uint64_t slot = key_hash & mask_;; slot = (slot + 1) & mask_) {
+            const Slot &candidate = slots_[slot];
+            if (candidate.key == NONE) {
+                return nullptr;
+            }
+            if (candidate.tag == tag) {
+                const Key &key = keys_[candidate.key];
+                if (key.port == port && key.wildcard == wildcard &&
+                    folly::StringPiece(names_.data() + key.name_offset, key.name_length) == name) {
+                    return &key;
+                }
+            }
+        }
+    }
+
+    const Cache::VirtualHostConfig *HostTable::find(folly::StringPiece authority, uint16_t port) const {
+        if (hosts_.empty()) {
+            return nullptr;
+        }
+
+        char buffer[MAX_NAME_LENGTH];
+        const folly::StringPiece name = normalize(authority, buffer);
+        if (!name.empty()) {
+            if (const Key *key = lookup(name, port, false)) {
+                return &hosts_[key->host];
+            }
+            // "a.b.example.com" tries "*.b.example.com", then "*.example.com", then "*.com".
+            for (size_t dot = name.find('.'); dot != folly::StringPiece::npos; dot = name.find('.', dot + 1)) {
+                if (const Key *key = lookup(name.subpiece(dot + 1), port, true)) {
+                    return &hosts_[key->host];
+                }
+            }
+        }
+
+        for (const auto &[listener, host]: defaults_) {
+            if (listener == port) {
+                return &hosts_[host];
+            }
+        }
+        return nullptr;
+    }
+
+    const HostTable *HostLease::acquire() {
+        reset();
+        // Workers only take the lock after a publish; otherwise this is a single atomic load.
+        auto &snapshots = tl_host_snapshots;
+        const uint64_t generation = g_hosts_generation.load(std::memory_order_acquire);
+        if (snapshots.empty() || snapshots.back()->generation != generation) {
+            auto snapshot = std::make_unique<HostSnapshot>();
+            {
+                std::lock_guard lock(g_hosts_mutex);
+                snapshot->table = g_hosts;
+                snapshot->generation = g_hosts_generation.load(std::memory_order_relaxed);
+            }
+            std::erase_if(snapshots, [](const auto &old) { return old->leases == 0; });
+            snapshots.push_back(std::move(snapshot));
+        }
+        snapshot_ = snapshots.back().get();
+        snapshot_->leases++;
+        return snapshot_->table.get();
+    }
+
+    void HostLease::reset() noexcept {
+        if (!snapshot_) {
+            return;
+        }
+        auto &snapshots = tl_host_snapshots;
+        if (--snapshot_->leases == 0 && snapshot_ != snapshots.back().get()) {
+            std::erase_if(snapshots, [&](const auto &old) { return old.get() == snapshot_; });
+        }
+        snapshot_ = nullptr;
+    }
+
+    void publishHosts(std::shared_ptr<const HostTable> hosts) {
+        std::lock_guard lock(g_hosts_mutex);
+        g_hosts = std::move(hosts);
+        g_hosts_generation.fetch_add(1, std::memory_order_release);
+    }
+} // namespace Routing
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <folly/Range.h>
+
+#include "cache.h"
+
+namespace Routing {
+    // Immutable table of the virtual hosts, shared by every worker.
+    //
+    // Names are normalized (lower case, no port, no trailing dot) and keyed together with the local port
+    // the request arrived on, so a Host header with or without ":port" finds the same host. Keys live in
+    // an open-addressed table of (hash tag, key) pairs like Index's; a lookup is one probe for the exact
+    // name plus one per label for wildcards. "*.example.com" matches every name below example.com, the
+    // most specific wildcard winning. A request matching no name goes to its listener's default host.
+    class HostTable {
+    public:
+        struct Host {
+            std::vector<std::string> names; // exact names and "*." wildcards
+            uint16_t port = 80;
+            bool is_default = false; // for requests on `port` that match no name
+            Cache::VirtualHostConfig config;
+        };
+
+        static std::shared_ptr<const HostTable> build(std::vector<Host> hosts);
+
+        // `authority` is the Host header (or :authority) as received. Its port, if any, is ignored in
+        // favour of the local `port` of the connection.
+        const Cache::VirtualHostConfig *find(folly::StringPiece authority, uint16_t port) const;
+
+        size_t size() const noexcept {
+            return hosts_.size();
+        }
+
+        static constexpr size_t MAX_NAME_LENGTH = 255;
+
+        // Lower-cased `authority` without port and trailing dot, written to `buffer`. Empty when there is
+        // no usable name.
+        static folly::StringPiece normalize(folly::StringPiece authority, char (&buffer)[MAX_NAME_LENGTH]) noexcept;
+
+    private:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        struct Key {
+            uint64_t name_offset = 0;
+            uint32_t name_length = 0;
+            uint32_t host = 0;
+            uint16_t port = 0;
+            bool wildcard = false;
+        };
+
+        struct Slot {
+            uint32_t tag; // upper half of the key hash
+            uint32_t key; // NONE marks a free slot
+        };
+
+        static uint64_t hash(folly::StringPiece name, uint16_t port, bool wildcard) noexcept;
+
+        const Key *lookup(folly::StringPiece name, uint16_t port, bool wildcard) const noexcept;
+
+        bool insert(folly::StringPiece name, uint16_t port, bool wildcard, uint32_t host);
+
+        std::string names_;
+        std::vector<Key> keys_;
+        std::vector<Slot> slots_;
+        uint64_t mask_ = 0;
+        std::vector<std::pair<uint16_t, uint32_t> > defaults_; // (port, host), one per listener
+        std::vector<Cache::VirtualHostConfig> hosts_;
+    };
+
+    struct HostSnapshot;
+
+    // A request's hold on the host table in use, so that the host it was routed to outlives a reload.
+    // Holds are counted per thread, in the thread's own snapshot of the table: taking one touches no cache
+    // line shared with other workers. A snapshot replaced by a reload goes once its last holder lets go.
+    // Must be released on the thread that acquired it.
+    class HostLease {
+    public:
+        HostLease() = default;
+
+        ~HostLease() {
+            reset();
+        }
+
+        HostLease(const HostLease &) = delete;
+
+        HostLease &operator=(const HostLease &) = delete;
+
+        // The table in use, held until reset() or the next acquire(). Null before the first publish.
+        const HostTable *acquire();
+
+        void reset() noexcept;
+
+    private:
+        HostSnapshot *snapshot_ = nullptr;
+    };
+
+    void publishHosts(std::shared_ptr<const HostTable> hosts);
+} // namespace Routing
@@ -0,0 +1,73 @@
+#include "page_cache.h"
+
+#include <algorithm>
+
+namespace Cache {
+    static int64_t now_seconds() noexcept {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    PageCache::PageCache(size_t max_entries, std::chrono::seconds refresh_timeout)
+        : refresh_timeout_(refresh_timeout.count()) {
+        shards_.reserve(SHARD_COUNT);
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            shards_.push_back(std::make_unique<Shard>(std::max<size_t>(max_entries / SHARD_COUNT, 1)));
+        }
+    }
+
+    std::optional<PageCache::Lookup> PageCache::get(folly::StringPiece key) {
+        const XXH64_hash_t hash = Utils::computeXXH64Hash(key);
+        Shard &shard = shard_for(hash);
+        std::lock_guard lock(shard.mutex);
+
+        const auto it = shard.entries.find(hash);
+        if (it == shard.entries.end() || folly::StringPiece(it->second.key) != key) {
+            return std::nullopt;
+        }
+
+        Entry &entry = it->second;
+        const int64_t now = now_seconds();
+        if (now < entry.fresh_until) {
+            return Lookup{entry.page, false};
+        }
+        if (now >= entry.stale_until) {
+            shard.entries.erase(it);
+            return std::nullopt;
+        }
+
+        const bool refresh = now >= entry.refreshing_until;
+        if (refresh) {
+            entry.refreshing_until = now + refresh_timeout_;
+        }
+        return Lookup{entry.page, refresh};
+    }
+
+    void PageCache::set(folly::StringPiece key, std::shared_ptr<const Page> page, std::chrono::seconds ttl,
+                        std::chrono::seconds stale) {
+        const int64_t fresh_until = now_seconds() + ttl.count();
+        const XXH64_hash_t hash = Utils::computeXXH64Hash(key);
+        Shard &shard = shard_for(hash);
+        std::lock_guard lock(shard.mutex);
+        // A colliding key simply takes the slot over.
+        shard.entries.set(hash, Entry{key.str(), std::move(page), fresh_until, fresh_until + stale.count()});
+    }
+
+    void PageCache::abandon(folly::StringPiece key) {
+        const XXH64_hash_t hash = Utils::computeXXH64Hash(key);
+        Shard &shard = shard_for(hash);
+        std::lock_guard lock(shard.mutex);
+
+        const auto it = shard.entries.find(hash);
+        if (it != shard.entries.end() && folly::StringPiece(it->second.key) == key) {
+            it->second.refreshing_until = 0;
+        }
+    }
+
+    void PageCache::clear() {
+        for (auto &shard: shards_) {
+            std::lock_guard lock(shard->mutex);
+            shard->entries.clear();
+        }
+    }
+} // namespace Cache
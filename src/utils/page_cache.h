@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <folly/Range.h>
+#include <folly/container/EvictingCacheMap.h>
+#include <folly/io/IOBuf.h>
+#include <proxygen/lib/http/HTTPMessage.h>
+
+#include "utils/utils.h"
+
+namespace Cache {
+    // A generated response, kept as sent.
+    struct Page {
+        uint16_t status = 200;
+        proxygen::HTTPHeaders headers;
+        std::shared_ptr<folly::IOBuf> body;
+    };
+
+    // Short-lived cache for dynamic responses.
+    //
+    // A page is fresh for its TTL and may then be served stale for a grace period while one request
+    // regenerates it: get() hands the refresh to a single caller at a time and everybody else keeps
+    // getting the stale copy, so an expiring hot page costs one backend run instead of a stampede.
+    //
+    // Entries are found by the hash of their key and then compared in full, so two keys sharing a hash
+    // never see each other's page.
+    class PageCache {
+    public:
+        static constexpr size_t SHARD_COUNT = 16;
+
+        struct Lookup {
+            std::shared_ptr<const Page> page;
+            bool refresh = false; // stale, and this caller should regenerate it with set() or abandon()
+        };
+
+        // `refresh_timeout` bounds how long a refresh may take before another caller is given one.
+        PageCache(size_t max_entries, std::chrono::seconds refresh_timeout);
+
+        // nullopt on a miss or once the grace period is over.
+        std::optional<Lookup> get(folly::StringPiece key);
+
+        void set(folly::StringPiece key, std::shared_ptr<const Page> page, std::chrono::seconds ttl,
+                 std::chrono::seconds stale);
+
+        // The refresh handed out by get() did not produce a cacheable page; the next caller may retry.
+        void abandon(folly::StringPiece key);
+
+        void clear();
+
+    private:
+        struct Entry {
+            std::string key;
+            std::shared_ptr<const Page> page;
+            int64_t fresh_until;
+            int64_t stale_until;
+            int64_t refreshing_until = 0;
+        };
+
+        struct alignas(64) Shard {
+            explicit Shard(size_t max_entries) : entries(max_entries) {
+            }
+
+            std::mutex mutex;
+            folly::EvictingCacheMap<XXH64_hash_t, Entry> entries;
+        };
+
+        Shard &shard_for(XXH64_hash_t key) noexcept {
+            return *shards_[key & (SHARD_COUNT - 1)];
+        }
+
+        int64_t refresh_timeout_;
+        std::vector<std::unique_ptr<Shard> > shards_;
+    };
+} // namespace Cache
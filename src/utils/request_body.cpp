@@ -0,0 +1,143 @@
+#include "request_body.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <folly/Executor.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/logging/xlog.h>
+
+namespace Utils {
+    RequestBody::RequestBody(const RequestBody &other)
+        : file_(other.file_), spilled_(other.spilled_), size_(other.size_), spill_failed_(other.spill_failed_) {
+        if (const folly::IOBuf *front = other.memory_.front()) {
+            memory_.append(front->clone());
+        }
+    }
+
+    RequestBody &RequestBody::operator=(const RequestBody &other) {
+        if (this != &other) {
+            memory_.reset();
+            if (const folly::IOBuf *front = other.memory_.front()) {
+                memory_.append(front->clone());
+            }
+            file_ = other.file_;
+            spilled_ = other.spilled_;
+            size_ = other.size_;
+            spill_failed_ = other.spill_failed_;
+        }
+        return *this;
+    }
+
+    void RequestBody::append(std::unique_ptr<folly::IOBuf> data) {
+        if (!data) {
+            return;
+        }
+        size_ += data->computeChainDataLength();
+        memory_.append(std::move(data), true);
+    }
+
+    void RequestBody::spill(folly::EventBase *evb, folly::Executor &executor, const std::string &directory,
+                            SpillCallback done) {
+        if (!file_) {
+            file_ = std::make_shared<SpillFile>();
+        }
+        // The worker writes a clone of what is buffered now; chunks appended meanwhile go behind it.
+        const size_t length = memory_.chainLength();
+        executor.add([this, evb, length, directory, file = file_, data = memory_.front()->clone(),
+                      done = std::move(done)]() mutable {
+            const bool written = (file->fd >= 0 || file->create(directory)) && file->write(*data);
+            evb->runInEventBaseThread([this, length, written, done = std::move(done)]() mutable {
+                if (written) {
+                    memory_.trimStart(length);
+                    spilled_ += length;
+                } else {
+                    spill_failed_ = true;
+                }
+                done(written);
+            });
+        });
+    }
+
+    RequestBody::SpillFile::~SpillFile() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool RequestBody::SpillFile::create(const std::string &directory) {
+        fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            // Filesystems without O_TMPFILE: a named file, unlinked right away.
+            std::string path = directory + "/wbsrv-body-XXXXXX";
+            fd = mkostemp(path.data(), O_CLOEXEC);
+            if (fd >= 0) {
+                unlink(path.c_str());
+            }
+        }
+        if (fd < 0) {
+            XLOG(WARN) << "Can't create a request body file in " << directory << ": " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    bool RequestBody::SpillFile::write(const folly::IOBuf &data) {
+        for (const auto range: data) {
+            const uint8_t *position = range.data();
+            size_t remaining = range.size();
+            while (remaining > 0) {
+                const ssize_t written = ::write(fd, position, remaining);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    XLOG(WARN) << "Can't write a request body file: " << strerror(errno);
+                    return false;
+                }
+                position += written;
+                remaining -= written;
+            }
+        }
+        return true;
+    }
+
+    folly::fbstring RequestBody::toString() const {
+        folly::fbstring result;
+        result.resize(size_);
+        Reader reader(*this);
+        size_t filled = 0;
+        while (filled < size_) {
+            const size_t count = reader.read(result.data() + filled, size_ - filled);
+            if (count == 0) break;
+            filled += count;
+        }
+        result.resize(filled);
+        return result;
+    }
+
+    RequestBody::Reader::Reader(const RequestBody &body) : body_(body) {
+    }
+
+    size_t RequestBody::Reader::read(void *buffer, size_t length) {
+        // The spilled prefix first, then whatever stayed in memory.
+        if (offset_ < body_.spilled_) {
+            for (;;) {
+                const ssize_t count = pread(body_.file_->fd, buffer, std::min(length, body_.spilled_ - offset_),
+                                            static_cast<off_t>(offset_));
+                if (count < 0 && errno == EINTR) continue;
+                if (count <= 0) return 0;
+                offset_ += count;
+                return static_cast<size_t>(count);
+            }
+        }
+        if (!cursor_) {
+            if (const folly::IOBuf *front = body_.memory_.front()) {
+                cursor_.emplace(front);
+            } else {
+                return 0;
+            }
+        }
+        return cursor_->pullAtMost(buffer, length);
+    }
+} // namespace Utils
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <folly/FBString.h>
+#include <folly/Function.h>
+#include <folly/io/Cursor.h>
+#include <folly/io/IOBufQueue.h>
+
+namespace folly {
+    class EventBase;
+    class Executor;
+}
+
+namespace Utils {
+    // A request body as it arrives, in the IOBufs proxygen delivered. Its owner may spill() a large body:
+    // what has arrived so far moves to an unlinked file in a temp directory, so an upload costs page cache
+    // rather than heap. The file is created and written on an executor, never on the event loop. Bodies
+    // that stay in memory allocate nothing beyond their buffers.
+    //
+    // Appended to and spilled on the request's EventBase; once complete it may be read from any thread.
+    // Copies share the file and the buffers.
+    class RequestBody {
+    public:
+        using SpillCallback = folly::Function<void(bool written)>;
+
+        RequestBody() = default;
+
+        RequestBody(const RequestBody &other);
+
+        RequestBody &operator=(const RequestBody &other);
+
+        RequestBody(RequestBody &&) noexcept = default;
+
+        RequestBody &operator=(RequestBody &&) noexcept = default;
+
+        void append(std::unique_ptr<folly::IOBuf> data);
+
+        // Writes the bytes still in memory to the spill file, created in `directory` on first use, on
+        // `executor`; `done` then runs on `evb`. The body may be appended to meanwhile, but must neither be
+        // copied nor moved until `done` ran. If the file can't be created or written, that and everything
+        // after it stays in memory.
+        void spill(folly::EventBase *evb, folly::Executor &executor, const std::string &directory,
+                   SpillCallback done);
+
+        // Whether spill() is still worth calling: nothing has failed yet.
+        bool spillable() const noexcept {
+            return !spill_failed_;
+        }
+
+        // Bytes held in memory rather than in the file.
+        size_t buffered() const noexcept {
+            return memory_.chainLength();
+        }
+
+        size_t size() const noexcept {
+            return size_;
+        }
+
+        bool empty() const noexcept {
+            return size_ == 0;
+        }
+
+        // The whole body in one string, for callers that can't consume it piecewise.
+        folly::fbstring toString() const;
+
+        // Sequential reader; each byte is copied once, straight into the caller's buffer.
+        class Reader {
+        public:
+            explicit Reader(const RequestBody &body);
+
+            // Fills up to `length` bytes and returns how many; 0 at the end of the body.
+            size_t read(void *buffer, size_t length);
+
+        private:
+            const RequestBody &body_;
+            std::optional<folly::io::Cursor> cursor_;
+            size_t offset_ = 0;
+        };
+
+    private:
+        struct SpillFile {
+            int fd = -1;
+
+            ~SpillFile();
+
+            bool create(const std::string &directory);
+
+            bool write(const folly::IOBuf &data);
+        };
+
+        folly::IOBufQueue memory_{folly::IOBufQueue::cacheChainLength()};
+        std::shared_ptr<SpillFile> file_;
+        size_t spilled_ = 0; // leading bytes held by the file
+        size_t size_ = 0;
+        bool spill_failed_ = false;
+    };
+} // namespace Utils
@@ -0,0 +1,312 @@
+#include "response_cache.h"
+
+#include <algorithm>
+#include <mutex>
+#include <tuple>
+#include <folly/io/IOBuf.h>
+#include <folly/executors/GlobalExecutor.h>
+#include <folly/logging/xlog.h>
+
+namespace Cache {
+    static_assert(ResponseCache::SHARD_COUNT == 64, "shard_for() takes the top 6 bits of the key");
+
+    ResponseCache::ResponseCache(size_t max_bytes, size_t max_object_bytes, std::chrono::seconds revalidate_after,
+                                 bool hugepages)
+        : revalidate_after_(revalidate_after.count()), arena_(hugepages) {
+        shard_capacity_ = std::max<size_t>(max_bytes / SHARD_COUNT, 1);
+        small_capacity_ = std::max<size_t>(shard_capacity_ / 10, 1);
+        // A single object may not take more than a quarter of its shard, otherwise one large file
+        // would flush everything else out of it.
+        max_object_bytes_ = shard_capacity_ / 4;
+        if (max_object_bytes > max_object_bytes_) {
+            XLOG(WARN) << "cache_max_object_kb is capped at " << (max_object_bytes_ >> 10)
+                    << " KB, a quarter of a cache shard; raise cache_size_mb to cache larger files";
+        } else if (max_object_bytes) {
+            max_object_bytes_ = max_object_bytes;
+        }
+    }
+
+    size_t ResponseCache::charge_of(const ResponseData &data) {
+        size_t charge = sizeof(Entry) + sizeof(ResponseData);
+        if (data.data) {
+            charge += AssetArena::footprint(data.data->computeChainDataLength());
+        }
+        return charge;
+    }
+
+    CachedResponse ResponseCache::get(XXH64_hash_t key, bool *revalidate) {
+        Shard &shard = shard_for(key);
+        std::shared_lock lock(shard.mutex);
+
+        const auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            return nullptr;
+        }
+
+        Entry &entry = *it->second;
+        // Concurrent readers may race on the increment; losing a hit here is harmless.
+        const uint8_t freq = entry.freq.load(std::memory_order_relaxed);
+        if (freq < MAX_FREQ) {
+            entry.freq.store(freq + 1, std::memory_order_relaxed);
+        }
+
+        if (revalidate && !watched_.load(std::memory_order_relaxed)) {
+            const int64_t now = now_seconds();
+            int64_t validated_at = entry.validated_at.load(std::memory_order_relaxed);
+            // Only the caller that moves the timestamp forward does the stat.
+            *revalidate = now - validated_at >= revalidate_after_ &&
+                          entry.validated_at.compare_exchange_strong(validated_at, now, std::memory_order_relaxed);
+        }
+        return entry.data;
+    }
+
+    void ResponseCache::validated(XXH64_hash_t key) {
+        Shard &shard = shard_for(key);
+        std::shared_lock lock(shard.mutex);
+
+        const auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            it->second->validated_at.store(now_seconds(), std::memory_order_relaxed);
+        }
+    }
+
+    CachedResponse ResponseCache::set(XXH64_hash_t key, ResponseData data, folly::StringPiece path,
+                                      uint64_t generation) {
+        const size_t charge = charge_of(data);
+        if (charge > max_object_bytes_) {
+            return nullptr;
+        }
+        if (data.data) {
+            // Copy outside the shard lock; the chain the caller built is dropped with `data`.
+            data.data = arena_.store(*data.data);
+        }
+        auto stored = std::make_shared<const ResponseData>(std::move(data));
+        std::string owned_path = path.str();
+
+        Shard &shard = shard_for(key);
+        std::unique_lock lock(shard.mutex);
+
+        // erase() advances the generation under this lock, so a stale fill can't slip in behind it.
+        if (generation != ANY_GENERATION && generation != this->generation(key)) {
+            return nullptr;
+        }
+
+        if (const auto it = shard.index.find(key); it != shard.index.end()) {
+            Entry &entry = *it->second;
+            (entry.in_main ? shard.main_bytes : shard.small_bytes) += charge - entry.charge;
+            entry.data = stored;
+            entry.path = std::move(owned_path);
+            entry.charge = charge;
+            entry.validated_at.store(now_seconds(), std::memory_order_relaxed);
+            evict(shard);
+            lock.unlock();
+            maybe_compact();
+            return stored;
+        }
+
+        bool to_main = false;
+        if (const auto ghost_it = shard.ghost_index.find(key); ghost_it != shard.ghost_index.end()) {
+            shard.ghost.erase(ghost_it->second);
+            shard.ghost_index.erase(ghost_it);
+            to_main = true;
+        }
+
+        EntryList &queue = to_main ? shard.main : shard.small;
+        Entry &entry = queue.emplace_front();
+        entry.key = key;
+        entry.data = stored;
+        entry.path = std::move(owned_path);
+        entry.charge = charge;
+        entry.in_main = to_main;
+        entry.validated_at.store(now_seconds(), std::memory_order_relaxed);
+        (to_main ? shard.main_bytes : shard.small_bytes) += charge;
+        shard.index[key] = queue.begin();
+
+        evict(shard);
+        lock.unlock();
+        maybe_compact();
+        return stored;
+    }
+
+    void ResponseCache::erase(XXH64_hash_t key) {
+        Shard &shard = shard_for(key);
+        std::unique_lock lock(shard.mutex);
+
+        // Also when nothing is cached yet: a read in flight for the key must not be stored.
+        generations_[key & (GENERATION_STRIPES - 1)].fetch_add(1, std::memory_order_release);
+
+        const auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            unlink(shard, it->second);
+        }
+    }
+
+    void ResponseCache::clear() {
+        epoch_.fetch_add(1, std::memory_order_release);
+        for (Shard &shard: shards_) {
+            std::unique_lock lock(shard.mutex);
+            shard.index.clear();
+            shard.small.clear();
+            shard.main.clear();
+            shard.ghost.clear();
+            shard.ghost_index.clear();
+            shard.small_bytes = 0;
+            shard.main_bytes = 0;
+        }
+    }
+
+    size_t ResponseCache::size_bytes() const {
+        size_t total = 0;
+        for (const Shard &shard: shards_) {
+            std::shared_lock lock(shard.mutex);
+            total += shard.small_bytes + shard.main_bytes;
+        }
+        return total;
+    }
+
+    std::vector<std::string> ResponseCache::hot_paths(size_t max_bytes) const {
+        struct Hot {
+            uint8_t freq;
+            bool in_main;
+            size_t charge;
+            std::string path;
+        };
+        std::vector<Hot> hot;
+        for (const Shard &shard: shards_) {
+            std::shared_lock lock(shard.mutex);
+            for (const EntryList *queue: {&shard.main, &shard.small}) {
+                for (const Entry &entry: *queue) {
+                    if (!entry.path.empty()) {
+                        hot.push_back({
+                            entry.freq.load(std::memory_order_relaxed), entry.in_main, entry.charge, entry.path
+                        });
+                    }
+                }
+            }
+        }
+        // Promoted entries first, they proved themselves beyond their current counter.
+        std::ranges::stable_sort(hot, [](const Hot &a, const Hot &b) {
+            return std::tie(a.in_main, a.freq) > std::tie(b.in_main, b.freq);
+        });
+
+        std::vector<std::string> paths;
+        size_t total = 0;
+        for (auto &entry: hot) {
+            if (total + entry.charge > max_bytes) break;
+            total += entry.charge;
+            paths.push_back(std::move(entry.path));
+        }
+        return paths;
+    }
+
+    void ResponseCache::maybe_compact() {
+        // At most one pass a second: blocks also stay pinned by responses still being sent.
+        const int64_t now = now_seconds();
+        if (!arena_.fragmented() || now == last_compaction_.load(std::memory_order_relaxed) ||
+            compacting_.exchange(true)) {
+            return;
+        }
+        last_compaction_.store(now, std::memory_order_relaxed);
+        folly::getUnsafeMutableGlobalCPUExecutor()->add([this] {
+            compact();
+            compacting_ = false;
+        });
+    }
+
+    // Copies the bodies of mostly dead blocks into the current one, entry by entry. Hits in flight keep the
+    // old copy, and its block goes away with the last of them.
+    void ResponseCache::compact() {
+        size_t moved = 0;
+        for (Shard &shard: shards_) {
+            std::vector<std::pair<XXH64_hash_t, CachedResponse> > sparse;
+            {
+                std::shared_lock lock(shard.mutex);
+                for (const EntryList *queue: {&shard.small, &shard.main}) {
+                    for (const Entry &entry: *queue) {
+                        if (entry.data->data && arena_.sparse(*entry.data->data)) {
+                            sparse.emplace_back(entry.key, entry.data);
+                        }
+                    }
+                }
+            }
+
+            for (const auto &[key, old]: sparse) {
+                ResponseData copy = *old;
+                copy.data = arena_.store(*old->data);
+                auto relocated = std::make_shared<const ResponseData>(std::move(copy));
+
+                std::unique_lock lock(shard.mutex);
+                // Replaced or dropped in the meantime: the copy goes with `relocated`.
+                if (const auto it = shard.index.find(key); it != shard.index.end() && it->second->data == old) {
+                    it->second->data = std::move(relocated);
+                    moved++;
+                }
+            }
+        }
+        XLOG(DBG) << "Response cache compaction moved " << moved << " entries";
+    }
+
+    void ResponseCache::evict(Shard &shard) {
+        while (shard.small_bytes + shard.main_bytes > shard_capacity_) {
+            if (shard.small_bytes > small_capacity_ || shard.main.empty()) {
+                evict_small(shard);
+            } else {
+                evict_main(shard);
+            }
+        }
+    }
+
+    void ResponseCache::evict_small(Shard &shard) {
+        const auto it = std::prev(shard.small.end());
+
+        if (it->freq.load(std::memory_order_relaxed) > 0) {
+            // Hit while on probation: promote to main.
+            it->freq.store(0, std::memory_order_relaxed);
+            it->in_main = true;
+            shard.small_bytes -= it->charge;
+            shard.main_bytes += it->charge;
+            shard.main.splice(shard.main.begin(), shard.small, it);
+            return;
+        }
+
+        remember_ghost(shard, it->key);
+        unlink(shard, it);
+    }
+
+    void ResponseCache::evict_main(Shard &shard) {
+        const auto it = std::prev(shard.main.end());
+
+        const uint8_t freq = it->freq.load(std::memory_order_relaxed);
+        if (freq > 0) {
+            // Second chance: reinsert at the head with one less credit.
+            it->freq.store(freq - 1, std::memory_order_relaxed);
+            shard.main.splice(shard.main.begin(), shard.main, it);
+            return;
+        }
+
+        unlink(shard, it);
+    }
+
+    void ResponseCache::remember_ghost(Shard &shard, XXH64_hash_t key) {
+        // The ghost queue tracks as many keys as main holds objects.
+        const size_t ghost_capacity = std::max<size_t>(shard.main.size(), 64);
+        while (shard.ghost.size() >= ghost_capacity) {
+            shard.ghost_index.erase(shard.ghost.back());
+            shard.ghost.pop_back();
+        }
+
+        shard.ghost.push_front(key);
+        shard.ghost_index[key] = shard.ghost.begin();
+    }
+
+    void ResponseCache::unlink(Shard &shard, EntryList::iterator it) {
+        shard.index.erase(it->key);
+        if (it->in_main) {
+            shard.main_bytes -= it->charge;
+            shard.main.erase(it);
+        } else {
+            shard.small_bytes -= it->charge;
+            shard.small.erase(it);
+        }
+    }
+} // namespace Cache
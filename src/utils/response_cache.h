@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "asset_arena.h"
+#include "cache.h"
+#include "utils/defines.h"
+#include "utils/utils.h"
+
+namespace Cache {
+    // A cache hit: the stored entry itself, shared read-only with the cache and every other hit.
+    using CachedResponse = std::shared_ptr<const ResponseData>;
+
+    // Process-wide static response cache shared by all worker threads.
+    //
+    // Keys are spread over independent shards; lookups take only the shard's shared lock and bump an
+    // atomic frequency counter. Eviction is S3-FIFO with byte accounting: new objects enter a small
+    // probation queue, objects that were hit there are promoted to the main queue, and the keys of
+    // dropped one-hit objects are kept in a ghost queue so that a quick re-request is admitted to main.
+    //
+    // Bodies are copied into an AssetArena on insertion, so every entry is a single contiguous buffer,
+    // and a hit only takes a reference on the entry. Entries are charged what they take up in the arena,
+    // and once evictions leave its blocks fragmented, the survivors of mostly dead blocks are moved on the
+    // CPU executor so that those blocks can be unmapped.
+    //
+    // Entries remember when they were last validated against the file system. Without a file watcher,
+    // get() hands the revalidation of a stale entry to exactly one caller per period; the others keep
+    // serving it.
+    //
+    // A fill takes generation() before it reads the file and passes it to set(). erase() and clear()
+    // advance the generation, so a read that raced with an invalidation is not stored afterwards.
+    class ResponseCache {
+    public:
+        static constexpr size_t SHARD_COUNT = 64;
+        static constexpr size_t GENERATION_STRIPES = 4096;
+        static constexpr uint64_t ANY_GENERATION = UINT64_MAX;
+
+        explicit ResponseCache(size_t max_bytes, size_t max_object_bytes = 0,
+                               std::chrono::seconds revalidate_after = std::chrono::seconds(CACHE_TTL),
+                               bool hugepages = false);
+
+        ResponseCache(const ResponseCache &) = delete;
+
+        ResponseCache &operator=(const ResponseCache &) = delete;
+
+        // When `revalidate` is given it is set to true if the caller should stat the file and either
+        // erase() the entry or report it unchanged with validated().
+        CachedResponse get(XXH64_hash_t key, bool *revalidate = nullptr);
+
+        void validated(XXH64_hash_t key);
+
+        // Set once a file watcher reports every change; entries are then never handed out for revalidation.
+        void set_watched(bool watched) noexcept {
+            watched_.store(watched, std::memory_order_relaxed);
+        }
+
+        // Changes whenever `key` may have been invalidated. Keys sharing a stripe advance together, which
+        // only costs the occasional refused fill.
+        uint64_t generation(XXH64_hash_t key) const noexcept {
+            return epoch_.load(std::memory_order_acquire) +
+                   generations_[key & (GENERATION_STRIPES - 1)].load(std::memory_order_acquire);
+        }
+
+        // Returns the stored entry, or null when the object is larger than the per-object admission limit
+        // or `key` was invalidated since `generation` was taken. `path` is only remembered for hot_paths().
+        CachedResponse set(XXH64_hash_t key, ResponseData data, folly::StringPiece path = {},
+                           uint64_t generation = ANY_GENERATION);
+
+        void erase(XXH64_hash_t key);
+
+        void clear();
+
+        size_t size_bytes() const;
+
+        // Paths of the entries stored with one, most frequently hit first, until their bodies add up to
+        // `max_bytes`. Lets a new process start with the files this one was serving.
+        std::vector<std::string> hot_paths(size_t max_bytes) const;
+
+        size_t max_object_bytes() const noexcept {
+            return max_object_bytes_;
+        }
+
+    private:
+        struct Entry {
+            XXH64_hash_t key = 0;
+            CachedResponse data;
+            std::string path;
+            size_t charge = 0;
+            std::atomic<uint8_t> freq{0};
+            std::atomic<int64_t> validated_at{0};
+            bool in_main = false;
+        };
+
+        using EntryList = std::list<Entry>;
+
+        struct alignas(64) Shard {
+            mutable std::shared_mutex mutex;
+            EntryList small; // front is the most recently inserted
+            EntryList main;
+            std::unordered_map<XXH64_hash_t, EntryList::iterator> index;
+            std::list<XXH64_hash_t> ghost;
+            std::unordered_map<XXH64_hash_t, std::list<XXH64_hash_t>::iterator> ghost_index;
+            size_t small_bytes = 0;
+            size_t main_bytes = 0;
+        };
+
+        static constexpr uint8_t MAX_FREQ = 3;
+
+        static size_t charge_of(const ResponseData &data);
+
+        static int64_t now_seconds() noexcept {
+            return std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        Shard &shard_for(XXH64_hash_t key) noexcept {
+            return shards_[(key >> 58) & (SHARD_COUNT - 1)];
+        }
+
+        void evict(Shard &shard);
+
+        void evict_small(Shard &shard);
+
+        void evict_main(Shard &shard);
+
+        void remember_ghost(Shard &shard, XXH64_hash_t key);
+
+        void maybe_compact();
+
+        void compact();
+
+        void unlink(Shard &shard, EntryList::iterator it);
+
+        size_t shard_capacity_;
+        size_t small_capacity_;
+        size_t max_object_bytes_;
+        int64_t revalidate_after_;
+        std::atomic<bool> watched_{false};
+        std::atomic<bool> compacting_{false};
+        std::atomic<int64_t> last_compaction_{0};
+        std::atomic<uint64_t> epoch_{0};
+        std::atomic<uint64_t> generations_[GENERATION_STRIPES]{};
+        AssetArena arena_;
+        Shard shards_[SHARD_COUNT];
+    };
+} // namespace Cache
@@ -0,0 +1,340 @@
+#include "route_index.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <folly/logging/xlog.h>
+
+#include "utils/utils.h"
+
+namespace Routing {
+    namespace {
+        struct ScannedFile {
+            std::string path;
+            Cache::FileSystemMetadata metadata;
+            uint32_t root;
+        };
+
+        struct PendingDirectory {
+            std::string path;
+            uint32_t root;
+        };
+
+        void scan_directory(const PendingDirectory &directory, std::vector<ScannedFile> &files,
+                            std::vector<PendingDirectory> &subdirectories) {
+            const int dir_fd = open(directory.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd < 0) {
+                XLOG(WARN) << "Can't index " << directory.path << ": " << strerror(errno);
+                return;
+            }
+            DIR *dir = fdopendir(dir_fd);
+            if (!dir) {
+                close(dir_fd);
+                return;
+            }
+
+            while (const dirent *item = readdir(dir)) {
+                if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) continue;
+
+                struct stat st{};
+                if (fstatat(dir_fd, item->d_name, &st, 0) != 0) continue; // dangling symlink, raced unlink
+
+                ScannedFile file{directory.path + '/' + item->d_name, Cache::FileSystemMetadata::fromStat(st),
+                                 directory.root};
+                // Following directory symlinks could loop; std::filesystem did not descend into them either.
+                // Some file systems leave d_type unknown, lstat tells a link apart there.
+                bool symlink = item->d_type == DT_LNK;
+                if (item->d_type == DT_UNKNOWN && file.metadata.is_directory) {
+                    struct stat link_st{};
+                    symlink = fstatat(dir_fd, item->d_name, &link_st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                              S_ISLNK(link_st.st_mode);
+                }
+                if (file.metadata.is_directory && !symlink) {
+                    subdirectories.push_back({file.path, directory.root});
+                }
+                files.push_back(std::move(file));
+            }
+            closedir(dir);
+        }
+
+        // Breadth-first walk shared by `threads` workers; each keeps its own result list.
+        std::vector<std::vector<ScannedFile> > scan(const std::vector<Root> &roots, unsigned threads) {
+            std::vector<std::vector<ScannedFile> > results(threads);
+            std::vector<PendingDirectory> queue;
+            std::mutex mutex;
+            std::condition_variable ready;
+            size_t active = 0;
+
+            for (uint32_t i = 0; i < roots.size(); ++i) {
+                struct stat st{};
+                if (stat(roots[i].path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                    XLOG(WARN) << "Document root " << roots[i].path << " is not a directory";
+                    continue;
+                }
+                results[0].push_back({roots[i].path, Cache::FileSystemMetadata::fromStat(st), i});
+                queue.push_back({roots[i].path, i});
+            }
+
+            auto worker = [&](std::vector<ScannedFile> &files) {
+                std::vector<PendingDirectory> subdirectories;
+                for (;;) {
+                    PendingDirectory directory;
+                    {
+                        std::unique_lock lock(mutex);
+                        ready.wait(lock, [&] { return !queue.empty() || active == 0; });
+                        if (queue.empty()) return;
+                        directory = std::move(queue.back());
+                        queue.pop_back();
+                        active++;
+                    }
+
+                    scan_directory(directory, files, subdirectories);
+
+                    {
+                        std::lock_guard lock(mutex);
+                        for (auto &subdirectory: subdirectories) {
+                            queue.push_back(std::move(subdirectory));
+                        }
+                        active--;
+                    }
+                    subdirectories.clear();
+                    ready.notify_all();
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (unsigned i = 1; i < threads; ++i) {
+                workers.emplace_back(worker, std::ref(results[i]));
+            }
+            worker(results[0]);
+            for (auto &thread: workers) {
+                thread.join();
+            }
+            return results;
+        }
+
+        std::mutex g_index_mutex;
+        std::shared_ptr<const Index> g_index;
+        std::atomic<uint64_t> g_generation{0};
+
+        thread_local std::shared_ptr<const Index> tl_index;
+        thread_local uint64_t tl_generation = 0;
+    } // namespace
+
+    std::shared_ptr<const Index> Index::build(const std::vector<Root> &roots, unsigned threads) {
+        const auto started = std::chrono::steady_clock::now();
+        auto scanned = scan(roots, std::max(threads, 1u));
+
+        auto index = std::make_shared<Index>();
+        size_t count = 0;
+        size_t path_bytes = 0;
+        for (const auto &files: scanned) {
+            count += files.size();
+            for (const auto &file: files) path_bytes += file.path.size();
+        }
+
+        // Load factor of at most 0.7.
+        size_t capacity = 16;
+        while (capacity * 7 < count * 10) capacity <<= 1;
+        index->slots_.assign(capacity, Slot{0, NONE});
+        index->mask_ = capacity - 1;
+        index->entries_.reserve(count);
+        index->paths_.reserve(path_bytes);
+
+        std::vector<uint32_t> entry_roots;
+        entry_roots.reserve(count);
+        for (auto &files: scanned) {
+            for (auto &file: files) {
+                const XXH64_hash_t hash = Utils::computeXXH64Hash(file.path);
+                const uint32_t tag = static_cast<uint32_t>(hash >> 32);
+                uint64_t slot = hash & index->mask_;
+                bool duplicate = false;
+                // Roots may nest; the first scan of a path wins.
+                while (index->slots_[slot].entry != NONE) {
+                    const Slot &taken = index->slots_[slot];
+                    if (taken.tag == tag && index->path(index->entries_[taken.entry]) == file.path) {
+                        duplicate = true;
+                        break;
+                    }
+                    slot = (slot + 1) & index->mask_;
+                }
+                if (duplicate) continue;
+
+                Entry entry;
+                entry.metadata = file.metadata;
+                entry.path_offset = index->paths_.size();
+                entry.path_length = static_cast<uint32_t>(file.path.size());
+                index->paths_.append(file.path);
+
+                index->slots_[slot] = Slot{tag, static_cast<uint32_t>(index->entries_.size())};
+                index->entries_.push_back(entry);
+                entry_roots.push_back(file.root);
+            }
+            files = {};
+        }
+
+        // Directory -> index page, decided once here instead of by a stat per request.
+        std::string candidate;
+        for (size_t i = 0; i < index->entries_.size(); ++i) {
+            Entry &entry = index->entries_[i];
+            if (!entry.metadata.is_directory) continue;
+
+            for (const auto &page: roots[entry_roots[i]].index_pages) {
+                candidate.assign(index->path(entry).data(), entry.path_length);
+                candidate += '/';
+                candidate += page;
+
+                const Entry *found = index->find(candidate);
+                if (found && !found->metadata.is_directory) {
+                    entry.index_page = static_cast<uint32_t>(found - index->entries_.data());
+                    break;
+                }
+            }
+        }
+
+        XLOG(INFO) << "Indexed " << index->entries_.size() << " paths in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - started).count() << " ms";
+        return index;
+    }
+
+    const Index::Entry *Index::find(folly::StringPiece path) const {
+        if (entries_.empty()) {
+            return nullptr;
+        }
+
+        const XXH64_hash_t hash = Utils::computeXXH64Hash(path);
+        const uint32_t tag = static_cast<uint32_t>(hash >> 32);
+        for (uint64_t slot = hash & mask_;; slot = (slot + 1) & mask_) {
+            const Slot &candidate = slots_[slot];
+            if (candidate.entry == NONE) {
+                return nullptr;
+            }
+            if (candidate.tag == tag) {
+                const Entry &entry = entries_[candidate.entry];
+                if (this->path(entry) == path) {
+                    return &entry;
+                }
+            }
+        }
+    }
+
+    static int64_t now_seconds() noexcept {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    DirectoryCache::DirectoryCache(size_t max_entries, std::chrono::seconds positive_ttl,
+                                   std::chrono::seconds negative_ttl)
+        : positive_ttl_(positive_ttl.count()), negative_ttl_(negative_ttl.count()) {
+        shards_.reserve(SHARD_COUNT);
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            shards_.push_back(std::make_unique<Shard>(std::max<size_t>(max_entries / SHARD_COUNT, 1)));
+        }
+    }
+
+    std::optional<folly::fbstring> DirectoryCache::get(folly::StringPiece directory) {
+        const XXH64_hash_t key = Utils::computeXXH64Hash(directory);
+        Shard &shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+
+        const auto it = shard.entries.find(key);
+        if (it == shard.entries.end() || it->second.directory != directory) {
+            return std::nullopt;
+        }
+        if (it->second.expires_at <= now_seconds()) {
+            shard.entries.erase(it);
+            return std::nullopt;
+        }
+        return it->second.index_page;
+    }
+
+    void DirectoryCache::set(folly::StringPiece directory, folly::fbstring index_page) {
+        const XXH64_hash_t key = Utils::computeXXH64Hash(directory);
+        const int64_t ttl = index_page.empty() ? negative_ttl_ : positive_ttl_;
+        Shard &shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+        shard.entries.set(key, Resolution{directory.str(), std::move(index_page), now_seconds() + ttl});
+    }
+
+    void DirectoryCache::erase(folly::StringPiece directory) {
+        const XXH64_hash_t key = Utils::computeXXH64Hash(directory);
+        Shard &shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+        shard.entries.erase(key);
+    }
+
+    void DirectoryCache::clear() {
+        for (auto &shard: shards_) {
+            std::lock_guard lock(shard->mutex);
+            shard->entries.clear();
+        }
+    }
+
+    Rescanner::Rescanner(unsigned threads) : threads_(threads), thread_([this] { run(); }) {
+    }
+
+    Rescanner::~Rescanner() {
+        stop();
+    }
+
+    void Rescanner::request(std::vector<Root> roots) {
+        {
+            std::lock_guard lock(mutex_);
+            if (stopping_) return;
+            pending_ = std::move(roots);
+        }
+        wake_.notify_one();
+    }
+
+    void Rescanner::stop() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void Rescanner::run() {
+        for (;;) {
+            std::vector<Root> roots;
+            {
+                std::unique_lock lock(mutex_);
+                wake_.wait(lock, [this] { return stopping_ || pending_; });
+                if (stopping_) return;
+                roots = std::move(*pending_);
+                pending_.reset();
+            }
+            publish(Index::build(roots, threads_));
+        }
+    }
+
+    const Index &current() {
+        static const Index empty;
+
+        // Workers only take the lock after a publish; otherwise this is a single atomic load.
+        const uint64_t generation = g_generation.load(std::memory_order_acquire);
+        if (generation != tl_generation) {
+            std::lock_guard lock(g_index_mutex);
+            tl_index = g_index;
+            tl_generation = g_generation.load(std::memory_order_relaxed);
+        }
+        return tl_index ? *tl_index : empty;
+    }
+
+    void publish(std::shared_ptr<const Index> index) {
+        std::lock_guard lock(g_index_mutex);
+        g_index = std::move(index);
+        g_generation.fetch_add(1, std::memory_order_release);
+    }
+} // namespace Routing
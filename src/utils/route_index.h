@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <folly/Range.h>
+#include <folly/container/EvictingCacheMap.h>
+
+#include "cache.h"
+
+namespace Routing {
+    // A document root and the index pages tried, in order, for its directories.
+    struct Root {
+        std::string path;
+        std::vector<std::string> index_pages;
+    };
+
+    // Immutable snapshot of every file below the document roots.
+    //
+    // Built once by a parallel scan and then only read. Paths are stored back to back in one string and
+    // looked up through an open-addressed table of (hash tag, entry) pairs, so a probe touches one or two
+    // cache lines. Directories carry their resolved index page. A rescan builds a new Index and publishes
+    // it; workers keep using the snapshot they hold until their next request.
+    class Index {
+    public:
+        struct Entry {
+            Cache::FileSystemMetadata metadata;
+            uint64_t path_offset = 0;
+            uint32_t path_length = 0;
+            uint32_t index_page = NONE; // entry of the directory's index page
+        };
+
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        // Scans `roots` with `threads` workers. Symlinked directories are indexed but not descended into.
+        static std::shared_ptr<const Index> build(const std::vector<Root> &roots, unsigned threads);
+
+        // `path` is absolute and has no trailing slash.
+        const Entry *find(folly::StringPiece path) const;
+
+        folly::StringPiece path(const Entry &entry) const noexcept {
+            return {paths_.data() + entry.path_offset, entry.path_length};
+        }
+
+        // Empty when the entry is not a directory or none of the index pages exist.
+        folly::StringPiece indexPage(const Entry &entry) const noexcept {
+            return entry.index_page == NONE ? folly::StringPiece() : path(entries_[entry.index_page]);
+        }
+
+        size_t size() const noexcept {
+            return entries_.size();
+        }
+
+    private:
+        struct Slot {
+            uint32_t tag; // upper half of the path hash
+            uint32_t entry; // NONE marks a free slot
+        };
+
+        std::string paths_;
+        std::vector<Entry> entries_;
+        std::vector<Slot> slots_;
+        uint64_t mask_ = 0;
+    };
+
+    // Index pages resolved on demand for directories the index cannot answer: created after the last scan,
+    // without an index page at scan time, or everything when the startup scan is disabled. Both hits and
+    // misses are remembered, in bounded LRU shards, for a limited time.
+    class DirectoryCache {
+    public:
+        static constexpr size_t SHARD_COUNT = 16;
+
+        DirectoryCache(size_t max_entries, std::chrono::seconds positive_ttl, std::chrono::seconds negative_ttl);
+
+        // nullopt when unknown or expired; an empty string when the directory has no index page.
+        std::optional<folly::fbstring> get(folly::StringPiece directory);
+
+        void set(folly::StringPiece directory, folly::fbstring index_page);
+
+        void erase(folly::StringPiece directory);
+
+        void clear();
+
+    private:
+        struct Resolution {
+            folly::fbstring directory;
+            folly::fbstring index_page;
+            int64_t expires_at;
+        };
+
+        struct alignas(64) Shard {
+            explicit Shard(size_t max_entries) : entries(max_entries) {
+            }
+
+            std::mutex mutex;
+            folly::EvictingCacheMap<XXH64_hash_t, Resolution> entries;
+        };
+
+        Shard &shard_for(XXH64_hash_t key) noexcept {
+            return *shards_[key & (SHARD_COUNT - 1)];
+        }
+
+        int64_t positive_ttl_;
+        int64_t negative_ttl_;
+        std::vector<std::unique_ptr<Shard> > shards_;
+    };
+
+    // Rebuilds and publishes the index on a thread of its own, one scan at a time. Requests made during a
+    // scan fold into a single further scan of the latest roots. Owns everything it touches, so it only has
+    // to be stopped before the server goes away.
+    class Rescanner {
+    public:
+        explicit Rescanner(unsigned threads);
+
+        ~Rescanner();
+
+        Rescanner(const Rescanner &) = delete;
+
+        Rescanner &operator=(const Rescanner &) = delete;
+
+        void request(std::vector<Root> roots);
+
+        // Waits for a scan in progress; requests after this are ignored.
+        void stop();
+
+    private:
+        void run();
+
+        unsigned threads_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::optional<std::vector<Root> > pending_;
+        bool stopping_ = false;
+        std::thread thread_;
+    };
+
+    // The index in use. The reference stays valid until the calling thread calls current() again.
+    const Index &current();
+
+    void publish(std::shared_ptr<const Index> index);
+} // namespace Routing
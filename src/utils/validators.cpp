@@ -0,0 +1,170 @@
+#include "validators.h"
+
+#include <cctype>
+#include <ctime>
+#include <random>
+#include <folly/Conv.h>
+#include <folly/Format.h>
+
+namespace Validators {
+    static folly::StringPiece trim(folly::StringPiece value) {
+        while (!value.empty() && isspace(value.front())) value.pop_front();
+        while (!value.empty() && isspace(value.back())) value.pop_back();
+        return value;
+    }
+
+    static folly::StringPiece stripWeak(folly::StringPiece tag) {
+        if (tag.startsWith("W/")) {
+            tag.advance(2);
+        }
+        return tag;
+    }
+
+    folly::fbstring formatETag(const Cache::FileSystemMetadata &metadata, Compression::Encoding encoding) {
+        if (encoding == Compression::Encoding::IDENTITY) {
+            return folly::sformat("\"{:016x}\"", metadata.etag);
+        }
+        return folly::sformat("\"{:016x}-{}\"", metadata.etag, Compression::name(encoding));
+    }
+
+    folly::fbstring formatHttpDate(int64_t seconds) {
+        const time_t time = static_cast<time_t>(seconds);
+        struct tm tm{};
+        gmtime_r(&time, &tm);
+
+        char buffer[32];
+        const size_t length = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return folly::fbstring(buffer, length);
+    }
+
+    std::optional<int64_t> parseHttpDate(folly::StringPiece value) {
+        const std::string date = trim(value).str();
+        struct tm tm{};
+        // Only IMF-fixdate; the obsolete formats are not worth a 304.
+        const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (!end || *end != '\0') {
+            return std::nullopt;
+        }
+        return static_cast<int64_t>(timegm(&tm));
+    }
+
+    bool isNotModified(const proxygen::HTTPHeaders &headers, folly::StringPiece etag, int64_t mtime_seconds) {
+        const std::string &if_none_match = headers.getSingleOrEmpty(proxygen::HTTP_HEADER_IF_NONE_MATCH);
+        if (!if_none_match.empty()) {
+            // If-None-Match takes precedence over If-Modified-Since and uses the weak comparison.
+            folly::StringPiece list(if_none_match);
+            while (!list.empty()) {
+                const size_t comma = list.find(',');
+                const folly::StringPiece tag = trim(list.subpiece(0, comma));
+                list = comma == folly::StringPiece::npos ? folly::StringPiece() : list.subpiece(comma + 1);
+
+                if (tag == "*" || stripWeak(tag) == stripWeak(etag)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        const std::string &if_modified_since = headers.getSingleOrEmpty(proxygen::HTTP_HEADER_IF_MODIFIED_SINCE);
+        if (!if_modified_since.empty()) {
+            const auto since = parseHttpDate(if_modified_since);
+            return since && mtime_seconds <= *since;
+        }
+        return false;
+    }
+
+    RangeResult parseRange(const proxygen::HTTPHeaders &headers, folly::StringPiece etag,
+                           folly::StringPiece last_modified, uint64_t size, std::vector<ByteRange> &ranges) {
+        ranges.clear();
+
+        const std::string &range_header = headers.getSingleOrEmpty(proxygen::HTTP_HEADER_RANGE);
+        if (range_header.empty()) {
+            return RangeResult::FULL;
+        }
+
+        // If-Range: the range only applies while the representation is unchanged (strong comparison).
+        const std::string &if_range = headers.getSingleOrEmpty(proxygen::HTTP_HEADER_IF_RANGE);
+        if (!if_range.empty()) {
+            const folly::StringPiece validator = trim(if_range);
+            if (validator.startsWith("W/")) {
+                return RangeResult::FULL;
+            }
+            if (validator.startsWith("\"") ? validator != etag : validator != last_modified) {
+                return RangeResult::FULL;
+            }
+        }
+
+        folly::StringPiece spec = trim(range_header);
+        if (!spec.startsWith("bytes=")) {
+            return RangeResult::FULL;
+        }
+        spec.advance(6);
+
+        while (!spec.empty()) {
+            const size_t comma = spec.find(',');
+            const folly::StringPiece item = trim(spec.subpiece(0, comma));
+            spec = comma == folly::StringPiece::npos ? folly::StringPiece() : spec.subpiece(comma + 1);
+            if (item.empty()) continue;
+
+            const size_t dash = item.find('-');
+            if (dash == folly::StringPiece::npos) {
+                return RangeResult::FULL;
+            }
+            const folly::StringPiece first_str = item.subpiece(0, dash);
+            const folly::StringPiece last_str = item.subpiece(dash + 1);
+
+            ByteRange range{};
+            if (first_str.empty()) {
+                // Suffix range: the last N bytes.
+                const auto suffix = folly::tryTo<uint64_t>(last_str);
+                if (!suffix) return RangeResult::FULL;
+                if (*suffix == 0 || size == 0) continue;
+                range.length = std::min(*suffix, size);
+                range.first = size - range.length;
+            } else {
+                const auto first = folly::tryTo<uint64_t>(first_str);
+                if (!first) return RangeResult::FULL;
+                uint64_t last = size ? size - 1 : 0;
+                if (!last_str.empty()) {
+                    const auto parsed_last = folly::tryTo<uint64_t>(last_str);
+                    if (!parsed_last || *parsed_last < *first) return RangeResult::FULL;
+                    last = std::min(*parsed_last, last);
+                }
+                if (*first >= size) continue;
+                range.first = *first;
+                range.length = last - *first + 1;
+            }
+
+            if (ranges.size() == MAX_RANGES) {
+                // Many small ranges are a cheap way to amplify a response; just send the file.
+                ranges.clear();
+                return RangeResult::FULL;
+            }
+            ranges.push_back(range);
+        }
+
+        return ranges.empty() ? RangeResult::UNSATISFIABLE : RangeResult::PARTIAL;
+    }
+
+    folly::fbstring formatContentRange(const ByteRange &range, uint64_t size) {
+        return folly::sformat("bytes {}-{}/{}", range.first, range.first + range.length - 1, size);
+    }
+
+    const folly::fbstring &multipartBoundary() {
+        static const folly::fbstring boundary = [] {
+            std::random_device device;
+            std::mt19937_64 generator(device());
+            return folly::sformat("wbsrv-{:016x}{:016x}", generator(), generator());
+        }();
+        return boundary;
+    }
+
+    folly::fbstring multipartPartHeader(folly::StringPiece content_type, const ByteRange &range, uint64_t size) {
+        return folly::sformat("\r\n--{}\r\nContent-Type: {}\r\nContent-Range: {}\r\n\r\n",
+                              multipartBoundary(), content_type, formatContentRange(range, size));
+    }
+
+    folly::fbstring multipartTrailer() {
+        return folly::sformat("\r\n--{}--\r\n", multipartBoundary());
+    }
+} // namespace Validators
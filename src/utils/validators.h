@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include <proxygen/lib/http/HTTPMessage.h>
+
+#include "utils/cache.h"
+#include "utils/compression.h"
+
+// HTTP validators (ETag / Last-Modified), conditional requests and byte ranges for static responses.
+namespace Validators {
+    struct ByteRange {
+        uint64_t first;
+        uint64_t length;
+    };
+
+    enum class RangeResult : uint8_t {
+        FULL = 0, // no usable Range header: send the whole representation
+        PARTIAL = 1,
+        UNSATISFIABLE = 2,
+    };
+
+    static constexpr size_t MAX_RANGES = 16;
+
+    // Strong ETag of a representation; encoded variants get their own tag.
+    folly::fbstring formatETag(const Cache::FileSystemMetadata &metadata, Compression::Encoding encoding);
+
+    // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+    folly::fbstring formatHttpDate(int64_t seconds);
+
+    std::optional<int64_t> parseHttpDate(folly::StringPiece value);
+
+    // If-None-Match / If-Modified-Since evaluation for GET and HEAD.
+    bool isNotModified(const proxygen::HTTPHeaders &headers, folly::StringPiece etag, int64_t mtime_seconds);
+
+    // Parses Range (honouring If-Range) against a representation of `size` bytes.
+    RangeResult parseRange(const proxygen::HTTPHeaders &headers, folly::StringPiece etag,
+                           folly::StringPiece last_modified, uint64_t size, std::vector<ByteRange> &ranges);
+
+    folly::fbstring formatContentRange(const ByteRange &range, uint64_t size);
+
+    // Boundary used for multipart/byteranges bodies, random per process.
+    const folly::fbstring &multipartBoundary();
+
+    // Part header preceding each range of a multipart/byteranges body.
+    folly::fbstring multipartPartHeader(folly::StringPiece content_type, const ByteRange &range, uint64_t size);
+
+    folly::fbstring multipartTrailer();
+} // namespace Validators